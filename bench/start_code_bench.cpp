@@ -0,0 +1,98 @@
+﻿//
+// 起始码查找的性能测试: 对比find_start_codes与原有的find_start_code/ts_memmem标量实现.
+//
+
+#include "start_code.hpp"
+#include <chrono>
+#include <random>
+#include <vector>
+#include <iostream>
+
+namespace {
+
+	// 模拟高码率视频的ts payload: 随机数据中按一定间隔插入起始码.
+	std::vector<uint8_t> make_payload(size_t size, size_t start_code_interval)
+	{
+		std::mt19937 rng(1);
+		std::vector<uint8_t> data(size);
+		for (auto& b : data)
+			b = static_cast<uint8_t>(rng());
+		for (size_t i = 0; i + 4 < size; i += start_code_interval)
+		{
+			data[i] = 0;
+			data[i + 1] = 0;
+			data[i + 2] = 1;
+		}
+		return data;
+	}
+
+	template <typename Func>
+	void run(const char* name, const std::vector<uint8_t>& data, size_t chunk, Func func)
+	{
+		const size_t total = 1ull << 30;
+		size_t found = 0;
+		size_t bytes = 0;
+
+		auto begin = std::chrono::steady_clock::now();
+		while (bytes < total)
+		{
+			for (size_t pos = 0; pos + chunk <= data.size(); pos += chunk)
+				found += func(data.data() + pos, data.data() + pos + chunk);
+			bytes += data.size() - data.size() % chunk;
+		}
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+		std::cout << name << ", chunk " << chunk << ": "
+			<< static_cast<int64_t>(bytes / secs / 1e6) << " MB/s, "
+			<< found << " start codes" << std::endl;
+	}
+}
+
+int main()
+{
+	auto data = make_payload(1 << 20, 1500);
+
+	for (size_t chunk : { size_t(184), size_t(1 << 16) })
+	{
+		run("find_start_code", data, chunk, [](const uint8_t* p, const uint8_t* end) {
+			size_t n = 0;
+			uint32_t state = -1;
+			while (p < end)
+			{
+				p = util::find_start_code(p, end, &state);
+				if ((state & 0xFFFFFF00) == 0x100)
+					n++;
+			}
+			return n;
+		});
+
+		run("ts_memmem", data, chunk, [](const uint8_t* p, const uint8_t* end) {
+			size_t n = 0;
+			while (p < end)
+			{
+				p = (const uint8_t*)util::ts_memmem(p, end - p, "\000\000\001", 3);
+				if (!p)
+					break;
+				n++;
+				p += 3;
+			}
+			return n;
+		});
+
+		run("find_start_codes", data, chunk, [](const uint8_t* p, const uint8_t* end) {
+			uint32_t offsets[256];
+			size_t n = 0;
+			while (p < end)
+			{
+				size_t count = util::find_start_codes(p, end - p, offsets, 256);
+				n += count;
+				if (count < 256)
+					break;
+				p += offsets[count - 1];
+			}
+			return n;
+		});
+	}
+
+	return 0;
+}
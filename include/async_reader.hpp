@@ -0,0 +1,117 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace util {
+
+	// 按文件顺序读取数据块, 同时保持depth个读请求在进行中, 解析当前块时
+	// 后续块的读取不会停止. linux上使用io_uring并注册缓冲, 不可用时使用
+	// pread线程池.
+	class async_reader
+	{
+		// c++11 noncopyable.
+		async_reader(const async_reader&) = delete;
+		async_reader& operator=(const async_reader&) = delete;
+
+	public:
+		async_reader();
+		~async_reader();
+
+	public:
+		// block_size会按4096对齐, direct为true时使用O_DIRECT绕过页缓存.
+		bool open(const std::string& file, size_t block_size = 1024 * 1024,
+			int depth = 8, bool direct = false);
+		void close();
+
+		// 取得下一块数据, 文件结束或读取出错时返回false, 数据在release前有效.
+		bool next(const uint8_t*& data, size_t& size);
+		// next因为读取出错而返回false.
+		bool error() const;
+		// 归还next取得的块, 缓冲用于读取后面的数据.
+		void release();
+
+		bool using_io_uring() const;
+		uint64_t file_size() const;
+
+	protected:
+		struct block
+		{
+			uint8_t* data_;
+			uint64_t offset_;
+			size_t size_;		// 需要读取的字节数.
+			size_t filled_;		// 已读取的字节数.
+			enum
+			{
+				idle,
+				pending,
+				done,
+				failed,
+			} state_;
+		};
+
+	protected:
+		void submit(int index);
+		// 等待块的读取结束, 读取完成时返回true, 块空闲或读取出错时返回false.
+		bool wait(int index);
+
+		bool uring_init();
+		void uring_close();
+		void uring_submit(int index);
+		bool uring_wait(int index);
+		void uring_complete(int index, int result);
+
+		void pool_init();
+		void pool_close();
+		void pool_worker();
+
+	protected:
+		int m_fd;
+		uint64_t m_file_size;
+		size_t m_block_size;
+		bool m_direct;
+		std::vector<block> m_blocks;
+		uint64_t m_next_offset;		// 下一个提交的读请求的文件偏移.
+		uint64_t m_current;			// next返回的块序号.
+		bool m_error;
+
+		// io_uring.
+		bool m_uring;
+		int m_ring_fd;
+		void* m_sq_ptr;
+		size_t m_sq_size;
+		void* m_cq_ptr;
+		size_t m_cq_size;
+		void* m_sqes;
+		size_t m_sqes_size;
+		unsigned* m_sq_head;
+		unsigned* m_sq_tail;
+		unsigned* m_sq_mask;
+		unsigned* m_sq_array;
+		unsigned* m_cq_head;
+		unsigned* m_cq_tail;
+		unsigned* m_cq_mask;
+		void* m_cqes;
+		bool m_fixed;				// 缓冲已注册, 使用IORING_OP_READ_FIXED.
+
+		// pread线程池.
+		std::vector<std::thread> m_threads;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::vector<int> m_queue;
+		bool m_stop;
+	};
+
+}
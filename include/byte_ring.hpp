@@ -0,0 +1,84 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include "spsc_ring.hpp"
+
+namespace util {
+
+	// 单生产者单消费者的定长字节环形缓冲, 不使用锁, 接口与byte_streambuf相同.
+	// 采用bip buffer的方式, prepare总是返回连续的空间, 尾部空间不足时从头
+	// 开始写, 读取时先读完尾部的数据. 生产者每次提交完整的包, 消费者读到的
+	// 就总是完整的包.
+	class byte_ring
+	{
+		// c++11 noncopyable.
+		byte_ring(const byte_ring&) = delete;
+		byte_ring& operator=(const byte_ring&) = delete;
+
+	public:
+		explicit byte_ring(size_t capacity);
+		~byte_ring();
+
+	public:
+		// 生产者: 返回至少n字节的连续可写空间, 空间不足时返回nullptr.
+		// 可以一次prepare多个包的空间, 写完后一次commit.
+		uint8_t* prepare(size_t n);
+		// 生产者: 提交prepare空间中的前n个字节, 消费者在wait_data中等待时唤醒它.
+		void commit(size_t n);
+		// 生产者: 等待直到prepare(n)可以成功, n不能超过容量的一半, 缓冲关闭时返回false.
+		bool wait_space(size_t n);
+		// 生产者: 不再写入数据, 唤醒所有等待.
+		void close();
+
+		// 消费者: 当前可读的连续数据, 不含已经绕回开头的部分.
+		const uint8_t* data();
+		size_t size();
+		void consume(size_t n);
+		// 消费者: 等待直到可读数据至少为n字节, 缓冲关闭且数据不足时返回false.
+		// 数据绕回时返回后size()可能小于n, consume完尾部后data()从开头继续.
+		bool wait_data(size_t n);
+
+		bool closed() const;
+		size_t capacity() const;
+
+	private:
+		size_t readable(size_t& begin);
+		// 包括已经绕回开头部分的全部可读数据.
+		size_t available() const;
+		void notify(std::atomic<bool>& waiting);
+
+	private:
+		std::vector<uint8_t> m_buffer;
+		size_t m_capacity;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::atomic<bool> m_closed;
+		char m_pad0[cache_line_size];
+
+		// 消费者修改.
+		std::atomic<size_t> m_read;
+		std::atomic<bool> m_consumer_waiting;
+		char m_pad1[cache_line_size];
+
+		// 生产者修改, m_watermark为绕回前数据的结束位置.
+		std::atomic<size_t> m_write;
+		std::atomic<size_t> m_watermark;
+		std::atomic<bool> m_producer_waiting;
+		size_t m_reserve;		// prepare返回空间的起始位置.
+		char m_pad2[cache_line_size];
+	};
+
+}
@@ -0,0 +1,35 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#	define MPEGTS_X86 1
+#endif
+
+// 对单个函数启用指定的指令集, 配合运行时检测使用, 不影响全局编译选项.
+#if defined(__GNUC__) || defined(__clang__)
+#	define MPEGTS_TARGET(x) __attribute__((target(x)))
+#else
+#	define MPEGTS_TARGET(x)
+#endif
+
+namespace util {
+
+	struct cpu_features
+	{
+		bool sse2;
+		bool ssse3;
+		bool sse41;
+		bool pclmul;
+		bool avx2;
+		bool avx512bw;
+	};
+
+	// 返回当前cpu支持的指令集, 只在第一次调用时检测.
+	const cpu_features& get_cpu_features();
+}
@@ -0,0 +1,48 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace util {
+
+	// CRC-32/MPEG-2: 多项式0x04c11db7, 初值0xffffffff, 输入输出不反转, 结果不异或.
+	// 运行时根据cpu选择pclmulqdq折叠或slicing-by-8查表实现.
+	uint32_t crc32(const uint8_t* data, size_t len);
+
+	// 增量计算, crc为之前所有数据的计算结果, 第一次调用时为0xffffffff.
+	uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len);
+
+	// 用于跨多个ts包的section, 按顺序update每段数据, 不需要先拼接.
+	class crc32_stream
+	{
+	public:
+		crc32_stream()
+			: m_crc(0xffffffff)
+		{}
+
+		void update(const uint8_t* data, size_t len)
+		{
+			m_crc = crc32_update(m_crc, data, len);
+		}
+
+		uint32_t value() const
+		{
+			return m_crc;
+		}
+
+		void reset()
+		{
+			m_crc = 0xffffffff;
+		}
+
+	private:
+		uint32_t m_crc;
+	};
+}
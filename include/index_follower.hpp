@@ -0,0 +1,86 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+
+#include "mpegts.hpp"
+#include "mirrored_streambuf.hpp"
+#include "ts_index.hpp"
+
+namespace util {
+
+	// 为持续写入的ts文件维护索引, 每次只解析新增的数据.
+	// 解析器在两次更新之间保持状态(PSI, 帧类型, 连续计数), 未解析完的包留到
+	// 下一次; 解析器的快照和索引一起保存在"索引文件.state"中, 重新打开时从
+	// 索引记录的位置继续, 没有快照时重新读取文件开头的PAT/PMT.
+	class index_follower
+	{
+		// c++11 noncopyable.
+		index_follower(const index_follower&) = delete;
+		index_follower& operator=(const index_follower&) = delete;
+
+	public:
+		index_follower();
+		~index_follower();
+
+	public:
+		// 已有有效的索引时从它记录的位置继续, 否则从头建立.
+		bool open(const std::string& file, const std::string& index_file);
+		void close();
+
+		// 解析文件新增的数据并保存索引, 返回新增的条目数, 出错返回-1.
+		int64_t update();
+
+		// 跟随文件增长持续更新, 直到stop或出错. Linux上使用inotify等待文件
+		// 变化, 否则每interval毫秒检查一次.
+		bool follow(int interval = 500);
+		void stop();
+
+		int64_t indexed_bytes() const;
+		const index_builder& builder() const;
+
+	protected:
+		void reset();
+		bool bootstrap();
+		bool load_state();
+		bool save_state();
+		size_t process(const uint8_t* data, size_t size);
+		bool save();
+
+	protected:
+		std::string m_file;
+		std::string m_index_file;
+		FILE* m_fp;
+		std::unique_ptr<mpegts_parser> m_parser;
+		index_builder m_builder;
+		mirrored_streambuf m_buffer;
+		// 已读取的文件位置, m_buffer中数据的起始位置.
+		int64_t m_read_offset;
+		int64_t m_parsed_offset;
+		int m_packet_size;
+		bool m_resync;
+		std::atomic<bool> m_stop;
+
+		// 批量解析的列缓冲.
+		std::vector<uint16_t> m_pids;
+		std::vector<uint8_t> m_flags;
+		std::vector<uint8_t> m_picts;
+		std::vector<int64_t> m_pcrs;
+		std::vector<int64_t> m_ptss;
+		std::vector<int64_t> m_dtss;
+		mpegts_batch m_batch;
+	};
+
+}
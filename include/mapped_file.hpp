@@ -0,0 +1,61 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace util {
+
+	// 访问方式提示, 不支持的平台上忽略.
+	enum map_advice
+	{
+		map_normal,
+		map_sequential,		// 顺序访问, 内核加大预读并尽早回收已读页.
+		map_random,
+		map_willneed,		// 提前读入.
+		map_hugepage,		// 尽量使用透明大页, 减少TLB缺失.
+	};
+
+	// 只读映射整个文件, data()直接指向映射内存, 可以不经拷贝交给解析器.
+	class mapped_file
+	{
+		// c++11 noncopyable.
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+	public:
+		mapped_file();
+		~mapped_file();
+
+	public:
+		// 失败时返回false, 如文件不存在或地址空间不足(32位系统上的大文件).
+		bool open(const std::string& file);
+		void close();
+		bool is_open() const;
+
+		// offset和length会按页对齐, length为0表示到文件末尾.
+		bool advise(map_advice advice, size_t offset = 0, size_t length = 0);
+
+		const uint8_t* data() const;
+		size_t size() const;
+
+	private:
+		uint8_t* m_data;
+		size_t m_size;
+		bool m_open;
+#if defined(_WIN32)
+		void* m_file;
+		void* m_mapping;
+#else
+		int m_fd;
+#endif
+	};
+
+}
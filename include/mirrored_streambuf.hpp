@@ -0,0 +1,66 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace util {
+
+	// 接口与byte_streambuf相同的环形缓冲, 同一块内存(memfd)被连续映射两次,
+	// 读写位置跨过环的结尾时数据在虚拟地址上仍然连续, 因此consume和prepare
+	// 都不需要memmove, data()总是返回完整的连续可读数据.
+	// 不支持的平台或映射失败时退化为普通的线性缓冲.
+	class mirrored_streambuf
+	{
+		// c++11 noncopyable.
+		mirrored_streambuf(const mirrored_streambuf&) = delete;
+		mirrored_streambuf& operator=(const mirrored_streambuf&) = delete;
+
+		enum { buffer_delta = 64 * 1024 };
+
+	public:
+		mirrored_streambuf();
+		~mirrored_streambuf();
+
+		// 支持move构造.
+		mirrored_streambuf(mirrored_streambuf&& rhs);
+
+	public:
+		void clear();
+		void shrink_to_fit();
+		size_t size() const noexcept;
+		size_t capacity() const noexcept;
+		const uint8_t* data() const noexcept;
+		uint8_t* prepare(size_t n);
+
+		void commit(size_t n);
+		void consume(size_t n);
+
+		// 是否使用了双重映射.
+		bool mirrored() const noexcept;
+
+	private:
+		void reserve(size_t n);
+		bool map_ring(size_t capacity);
+		void unmap_ring();
+
+	private:
+		// 双重映射时m_data映射长度为2倍m_capacity.
+		uint8_t* m_data;
+		size_t m_capacity;
+		bool m_mirrored;
+		std::vector<uint8_t> m_buffer;
+
+		// 读写位置, 双重映射时m_get总是小于m_capacity.
+		size_t m_get;
+		size_t m_put;
+	};
+
+}
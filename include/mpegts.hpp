@@ -9,12 +9,17 @@
 
 #include <set>
 #include <map>
+#include <deque>
 #include <vector>
 #include <string>
 #include <algorithm>
 #include <cinttypes>
 #include <bitset>
 
+#include "crc32.hpp"
+#include "stream_types.hpp"
+#include "mirrored_streambuf.hpp"
+
 namespace util {
 
 	class byte_streambuf
@@ -69,48 +74,6 @@ namespace util {
 		size_t m_max_size;
 	};
 
-	enum {
-		unkown_type = 0x00,
-		video_mpeg1 = 0x01,
-		video_mpeg2 = 0x02,
-		audio_mpeg1 = 0x03,
-		audio_mpeg2 = 0x04,
-		private_section = 0x05,
-		private_data = 0x06,
-		iso_13818_1_pes = 0x07,
-		iso_13522_mheg = 0x08,
-		itu_t_rec_h_222_1 = 0x09,
-		iso_13818_6_type_a = 0x0a,
-		iso_13818_6_type_b = 0x0b,
-		iso_13818_6_type_c = 0x0c,
-		iso_13818_6_type_d = 0x0d,
-		iso_13818_1_auxiliary = 0x0e,
-		audio_aac = 0x0f,
-		video_mpeg4 = 0x10,
-		audio_aac_latm = 0x11,
-		iso_14496_1_pes = 0x12,
-		iso_14496_1_sections = 0x13,
-		iso_13818_6_SDP = 0x14,
-		metadata = 0x15,
-		video_h264 = 0x1b,
-		video_hevc = 0x24,
-		video_cavs = 0x42,
-		video_dirac = 0xd1,
-		video_vc1 = 0xea,
-		audio_pcm_bluray = 0x80,
-		audio_ac3 = 0x81,
-		audio_dts_0 = 0x82,
-		audio_truehd = 0x83,
-		audio_eac3_0 = 0x84,
-		audio_dts_1 = 0x85,
-		audio_dts_2 = 0x86,
-		audio_eac3_1 = 0x87,
-		audio_eac3_2 = 0xa1,
-		audio_dts_3 = 0xa2,
-		hdmv_pgs_subtitle = 0x90,
-		audio_dts_4 = 0x8a,
-	};
-
 	enum {
 		av_picture_type_none = 0,	///< Undefined
 		av_picture_type_i,			///< Intra
@@ -122,6 +85,66 @@ namespace util {
 		av_picture_type_bi,			///< BI type
 	};
 
+	// ts包的封装格式, 取值即每个包的字节数.
+	enum ts_packet_format
+	{
+		ts_packet_188 = 188,	// 标准ts.
+		ts_packet_192 = 192,	// m2ts, 每个包前有4字节TP_extra_header(到达时间戳).
+		ts_packet_204 = 204,	// 每个包后有16字节Reed-Solomon校验.
+	};
+
+	// 编译期的包格式信息, prefix为ts包之前的字节数.
+	template <int PacketSize>
+	struct ts_packet_traits;
+
+	template <>
+	struct ts_packet_traits<ts_packet_188>
+	{
+		enum { size = ts_packet_188, prefix = 0 };
+		static int64_t arrival_time(const uint8_t*) { return -1; }
+	};
+
+	template <>
+	struct ts_packet_traits<ts_packet_192>
+	{
+		enum { size = ts_packet_192, prefix = 4 };
+		// TP_extra_header = copy_permission_indicator(2) + arrival_time_stamp(30).
+		static int64_t arrival_time(const uint8_t* p)
+		{
+			return ((int64_t)(p[0] & 0x3f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		}
+	};
+
+	template <>
+	struct ts_packet_traits<ts_packet_204>
+	{
+		enum { size = ts_packet_204, prefix = 0 };
+		static int64_t arrival_time(const uint8_t*) { return -1; }
+	};
+
+	inline int ts_packet_prefix(int packet_size)
+	{
+		return packet_size == ts_packet_192 ? ts_packet_traits<ts_packet_192>::prefix : 0;
+	}
+
+	// 根据同步字节的间隔检测数据的包格式, 返回包大小, 无法确定时返回0.
+	// offset不为空时返回第一个完整包的起始位置.
+	int detect_packet_size(const uint8_t* data, size_t size, size_t* offset = nullptr);
+
+	// 指向一段连续的数据, 不持有内存.
+	struct mpegts_span
+	{
+		const uint8_t* data_;
+		size_t size_;
+	};
+
+	// mux_stream输入片段的处理方式.
+	enum mux_nal_flags
+	{
+		mux_nal_annexb = 1,		// 每个片段是一个不带起始码的NAL, 在前面插入起始码.
+		mux_nal_aud = 2,		// h264/hevc访问单元开头没有AUD时插入AUD.
+	};
+
 	struct mpegts_info
 	{
 		mpegts_info()
@@ -139,6 +162,7 @@ namespace util {
 			, stream_type_(0)
 			, payload_begin_(nullptr)
 			, payload_end_(nullptr)
+			, arrival_time_(-1)
 		{}
 
 		int pid_;
@@ -153,6 +177,7 @@ namespace util {
 			idr,
 			data,
 			nullpkt,
+			filtered,
 		} type_;
 		int pict_type_;
 		int64_t pcr_;
@@ -163,6 +188,65 @@ namespace util {
 		int stream_type_;
 		uint8_t* payload_begin_;
 		uint8_t* payload_end_;
+		// m2ts的到达时间戳(27MHz), 其它格式为-1.
+		int64_t arrival_time_;
+	};
+
+	// 批量解析的列式输出, 每列由调用者分配且至少能容纳n_packets个元素,
+	// 不需要的列置为nullptr即可.
+	struct mpegts_batch
+	{
+		mpegts_batch()
+			: pid_(nullptr)
+			, flags_(nullptr)
+			, type_(nullptr)
+			, cc_(nullptr)
+			, pict_type_(nullptr)
+			, pcr_(nullptr)
+			, pts_(nullptr)
+			, dts_(nullptr)
+			, payload_begin_(nullptr)
+			, payload_end_(nullptr)
+			, arrival_time_(nullptr)
+		{}
+
+		enum
+		{
+			flag_start = 0x01,	// payload_unit_start_indicator.
+			flag_video = 0x02,
+			flag_audio = 0x04,
+			flag_idr = 0x08,
+		};
+
+		uint16_t* pid_;
+		uint8_t* flags_;
+		uint8_t* type_;			// mpegts_info::pkt_t.
+		uint8_t* cc_;
+		uint8_t* pict_type_;
+		int64_t* pcr_;
+		int64_t* pts_;
+		int64_t* dts_;
+		// payload相对188字节ts包起始(不含m2ts前缀)的偏移, 没有payload时两者相等.
+		uint8_t* payload_begin_;
+		uint8_t* payload_end_;
+		int64_t* arrival_time_;
+	};
+
+	// pid过滤方式.
+	enum pid_filter_mode
+	{
+		pid_filter_none,		// 不过滤.
+		pid_filter_whitelist,	// 只解析名单中的pid.
+		pid_filter_blacklist,	// 不解析名单中的pid.
+	};
+
+	// 每个pid需要解析的字段, 可以组合使用.
+	enum parse_fields
+	{
+		parse_pcr = 0x01,
+		parse_pts = 0x02,			// PES头中的pts/dts.
+		parse_pict_type = 0x04,		// 帧类型, 需要查找视频payload中的起始码.
+		parse_all = 0xff,
 	};
 
 	struct stream_info
@@ -178,8 +262,6 @@ namespace util {
 	};
 
 
-	uint32_t crc32(const uint8_t* data, size_t len);
-
 	class mpegts_parser
 	{
 		// c++11 noncopyable.
@@ -191,33 +273,142 @@ namespace util {
 		~mpegts_parser();
 
 	public:
+		// 设置pid过滤, 被过滤的包只解析ts头, type_为mpegts_info::filtered,
+		// PAT和PMT不受过滤影响.
+		void set_pid_filter(const std::vector<uint16_t>& pids, pid_filter_mode mode);
+		void clear_pid_filter();
+		// 设置pid需要解析的字段, 见parse_fields, 默认为parse_all.
+		void set_pid_fields(uint16_t pid, int fields);
+
+		// 设置输入数据的包格式, 见ts_packet_format, 默认为188字节.
+		bool set_packet_size(int packet_size);
+		int packet_size() const;
+
+		// parse_ptr指向按packet_size()格式封装的一个包.
 		bool do_parser(const uint8_t* parse_ptr, mpegts_info& info, bool check_crc = false);
+		// 批量解析buf中连续的n_packets个包, 结果按列写入batch, 返回成功解析的包数,
+		// 遇到第一个解析失败的包(如同步字节错误)即停止, 由调用者决定如何重新同步.
+		size_t do_parser_batch(const uint8_t* buf, size_t n_packets, mpegts_batch& batch, bool check_crc = false);
 		std::vector<uint8_t>& matadata();
 
 		uint8_t stream_type(uint16_t pid) const;
 		std::string stream_name(uint16_t pid) const;
 		uint16_t stream_type(const std::string& name) const;
 
+		// 复制other的配置(包格式, pid过滤和解析字段)和已解析的PAT/PMT,
+		// 用于并行解析时各个分段从相同的流信息开始.
+		void copy_stream_info(const mpegts_parser& other);
+		// PAT以及其中所有的PMT都已经解析.
+		bool stream_info_ready() const;
+		// pid当前帧的帧类型是否还在查找中.
+		bool frame_type_pending(uint16_t pid) const;
+		// pid是否为PAT或已知的PMT.
+		bool is_psi_pid(uint16_t pid) const;
+
+		// 把解析状态(配置, PAT/PMT, 连续计数, 帧类型查找状态和未完成的section)
+		// 保存为紧凑的二进制数据, 不包含ts编码的状态. 另一个解析器restore后
+		// 从保存时的输入位置继续解析, 不需要等待下一个PAT/PMT.
+		void snapshot(std::vector<uint8_t>& out) const;
+		// 数据无效时返回false, 解析器的状态不变.
+		bool restore(const uint8_t* data, size_t size);
+
 	public:
 		// 初始化用于编码到ts的流信息.
 		bool init_streams(const std::vector<stream_info>& streams);
+		// 按pcr时间重复插入PAT/PMT的间隔, 默认100毫秒, 0表示只在开始时插入.
+		void set_psi_interval(int milliseconds);
+		// 固定码率输出, 用空包填充并按字节位置计算pcr, 0表示按输入速度输出(默认).
+		void set_mux_rate(int64_t bits_per_second);
+		// 固定码率时pcr的最大间隔, 不超过40毫秒.
+		void set_pcr_interval(int milliseconds);
+		// 固定码率时访问单元最早在解码时间之前多久发送, 默认700毫秒.
+		void set_mux_delay(int milliseconds);
+		// 固定码率时pid在T-STD模型中的缓冲大小, 不指定时按流类型估计.
+		void set_stream_buffer(uint16_t pid, size_t bytes);
+		// 固定码率时因码率不足而在解码时间之后才发送完的访问单元数.
+		int64_t mux_underflows() const;
 
 		// 添加数据到ts编码器中.
 		bool mux_stream(const mpegts_info& info);
+		// 访问单元分布在多个片段中(如SPS, PPS, SEI和slice各自的缓冲)时使用,
+		// 打包时直接从各片段读取, 不需要先拼接. flags为mux_nal_flags的组合.
+		bool mux_stream(const mpegts_info& info, const mpegts_span* nals, size_t count, int flags = 0);
 
 		// 获取已经编码的ts数据大小.
 		size_t mpegts_size() const;
 		// 从已经编码的ts数据缓冲中取出指定大小的ts数据.
 		void fetch_mpegts(uint8_t* data, int size);
+		// 不拷贝直接访问已经编码的ts数据, 在下一次mux_stream或release_mpegts前有效.
+		mpegts_span mpegts_output() const;
+		// 释放mpegts_output中已经写出的n字节.
+		void release_mpegts(size_t n);
+
+	protected:
+		// PSI section的重组状态和已解析的版本, 每个PAT/PMT pid一个.
+		struct psi_section
+		{
+			psi_section()
+				: cc_(-1)
+				, need_(0)
+			{}
+
+			int cc_;
+			// 跨包section已接收的数据, need_为section总长度, 0表示没有未完成的section.
+			std::vector<uint8_t> buffer_;
+			size_t need_;
+			// 按section_number保存上次解析的(version_number << 32 | CRC_32), -1表示未解析.
+			std::vector<int64_t> versions_;
+		};
+
+		// T-STD模型中一个流的缓冲, 访问单元在解码时间被移出.
+		struct tstd_buffer
+		{
+			tstd_buffer()
+				: size_(0)
+				, fill_(0)
+			{}
+
+			size_t size_;
+			size_t fill_;
+			// 缓冲中的访问单元(解码时间, 字节数).
+			std::deque<std::pair<int64_t, size_t>> units_;
+		};
 
 	protected:
 		inline bool do_internal_parser(const uint8_t* parse_ptr, mpegts_info& info, bool check_crc = false);
 		inline void do_parse_h264(const uint8_t* ptr, const uint8_t* end, mpegts_info& info);
 		inline void do_parse_hevc(const uint8_t* ptr, const uint8_t* end, mpegts_info& info);
 		inline void do_parse_mpeg2(const uint8_t* ptr, const uint8_t* end, mpegts_info& info);
+		inline void check_continuity(const mpegts_info& info);
+		inline bool do_parse_psi(const uint8_t* parse_ptr, mpegts_info& info, bool check_crc);
+		inline bool do_append_section(psi_section& state, const uint8_t* ptr, const uint8_t* end,
+			mpegts_info& info, bool check_crc);
+		bool do_parse_section(psi_section& state, const uint8_t* section, size_t size,
+			const uint8_t* packet, mpegts_info& info, bool check_crc);
+		bool parse_pat_section(const uint8_t* section, size_t size);
+		bool parse_pmt_section(const uint8_t* section, size_t size);
+		template <typename Traits>
+		size_t do_parser_batch_impl(const uint8_t* buf, size_t n_packets, mpegts_batch& batch, bool check_crc);
 
 		void add_pat(uint8_t* ts);
 		void add_pmt(uint8_t* ts);
+		void write_psi(int64_t now);
+		// 编码器当前的pcr时间(27MHz).
+		int64_t mux_clock(const mpegts_info& info) const;
+		// 固定码率时第bytes个字节的发送时间.
+		int64_t cbr_clock(int64_t bytes) const;
+		bool psi_due(int64_t now) const;
+		bool pcr_due(int packets = 1) const;
+		// 固定码率时访问单元展开33位回绕后的解码时间(27MHz), 没有时间戳时为-1.
+		int64_t mux_decode_time(const mpegts_info& info);
+		// 时间戳跳变时把编码时钟重新对齐到decode_time, 丢弃T-STD中的访问单元.
+		void mux_rebase(int64_t decode_time);
+		void mux_pace(const mpegts_info& stream, int64_t decode_time, size_t size);
+		void pad_until(int64_t time);
+		void write_pcr_packet();
+		// 把一个访问单元打包为PES并切分为ts包, 负载可以分布在多个片段中.
+		void write_pes(mpegts_info& stream, const mpegts_info& info,
+			const mpegts_span* spans, size_t count, bool write_pcr);
 
 	protected:
 		std::bitset<0x2000> m_video_elementary_PIDs;
@@ -229,8 +420,12 @@ namespace util {
 		std::bitset<0x2000> m_type_pids;
 		bool m_has_pat;
 		int16_t m_pcr_pid;
-		// key = stream type id, value = stream type name.
-		std::map<uint8_t, std::string> m_stream_types;
+		// key = PAT/PMT pid.
+		std::map<uint16_t, psi_section> m_psi_sections;
+		int m_packet_size;
+		// 需要跳过的pid, 以及每个pid需要解析的字段.
+		std::bitset<0x2000> m_pid_filter;
+		std::vector<uint8_t> m_pid_fields;
 		// key = pid, value = stream type id.
 		std::vector<uint8_t> m_streams;
 
@@ -243,6 +438,30 @@ namespace util {
 		int m_pcr_packet_count;
 		int m_pat_count;
 		int m_pmt_count;
-		byte_streambuf m_mpegts_data;
+		mirrored_streambuf m_mpegts_data;
+		// 缓存已生成的PAT和PMT包, 为空时重新生成.
+		std::vector<uint8_t> m_psi_packets;
+		int m_psi_version;
+		int64_t m_psi_interval;
+		int64_t m_last_psi_pcr;
+		// 固定码率编码.
+		int64_t m_mux_rate;
+		int64_t m_pcr_interval;
+		int64_t m_mux_delay;
+		int64_t m_cbr_base;
+		int64_t m_last_pcr;
+		int m_mux_pcr_pid;
+		int64_t m_mux_underflows;
+		// 解码时间回绕展开的状态(90KHz).
+		int64_t m_mux_last_dts;
+		int64_t m_mux_dts_offset;
+		// 最近一个有时间戳的访问单元的时钟(27MHz)和当时已输出的字节数.
+		int64_t m_mux_last_clock;
+		int64_t m_mux_clock_bytes;
+		// 时钟重新对齐后, 下一个pcr设置discontinuity_indicator.
+		bool m_pcr_discontinuity;
+		std::map<int, tstd_buffer> m_tstd;
+		// mux_stream中复用的片段列表.
+		std::vector<mpegts_span> m_mux_spans;
 	};
 }
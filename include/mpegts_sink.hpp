@@ -0,0 +1,49 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mpegts.hpp"
+
+namespace util {
+
+	// 把已编码的ts数据直接从编码缓冲写到文件描述符, 不经过中间缓冲.
+	// datagram_packets为0时按字节流使用writev写出, 否则按数据报使用sendmsg,
+	// 每个数据报最多datagram_packets个ts包(UDP通常为7).
+	// 非阻塞的fd写不完时返回已写出的字节数, 剩余部分留到下一次.
+	class mpegts_sink
+	{
+		// c++11 noncopyable.
+		mpegts_sink(const mpegts_sink&) = delete;
+		mpegts_sink& operator=(const mpegts_sink&) = delete;
+
+	public:
+		explicit mpegts_sink(int fd, size_t datagram_packets = 0);
+		~mpegts_sink();
+
+	public:
+		// 写出parser中已编码的数据, 并释放已写出的部分.
+		// 返回写出的字节数, 出错返回-1.
+		int64_t write(mpegts_parser& parser);
+		// 按顺序写出多个数据片段, 比如多个编码器的输出.
+		int64_t write(const mpegts_span* spans, size_t count);
+
+		int fd() const;
+
+	private:
+		int64_t write_stream(const mpegts_span* spans, size_t count);
+		int64_t write_datagram(const mpegts_span* spans, size_t count);
+
+	private:
+		int m_fd;
+		size_t m_datagram_size;
+	};
+
+}
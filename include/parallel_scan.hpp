@@ -0,0 +1,60 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "mpegts.hpp"
+
+namespace util {
+
+	// 并行扫描中需要输出的包, 按文件位置排序.
+	struct scan_event
+	{
+		enum
+		{
+			// 低位与mpegts_batch::flags_相同.
+			flag_first = 0x40,	// 分段中第一个音频或视频包, 用于输出流类型.
+			flag_head = 0x80,	// 分段中这个pid第一个起始包之前的包.
+		};
+
+		int64_t pos_;		// 包在文件中的偏移(含m2ts前缀).
+		uint16_t pid_;
+		uint8_t flags_;
+		uint8_t pict_type_;
+		int64_t pcr_;
+		int64_t pts_;
+		int64_t dts_;
+	};
+
+	struct scan_result
+	{
+		scan_result()
+			: packets_(0)
+			, skipped_bytes_(0)
+			, cc_errors_(0)
+		{}
+
+		// 视频的帧起始包, 关键帧包, 确定帧类型的包, 含pcr的包以及每个分段第一个音视频包.
+		std::vector<scan_event> events_;
+		uint64_t packets_;
+		uint64_t skipped_bytes_;
+		uint64_t cc_errors_;
+	};
+
+	// 把data按同步字节对齐分成多个分段, 每个分段由独立的mpegts_parser在
+	// threads个线程上解析, 结果按文件顺序合并, 与顺序解析的输出一致.
+	// parser提供包格式, pid过滤等配置, 返回时包含最后一个分段的流信息,
+	// 可以用stream_name等查询. 第一个分段之后的分段使用从文件开始部分预先
+	// 解析的PAT/PMT, 文件中间PMT发生变化时结果可能与顺序解析不同.
+	bool parallel_scan(mpegts_parser& parser, const uint8_t* data, size_t size,
+		int threads, scan_result& result);
+
+}
@@ -0,0 +1,132 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <functional>
+
+#include "mpegts.hpp"
+
+namespace util {
+
+	// 指向输入缓冲中的一段数据.
+	struct pes_span
+	{
+		const uint8_t* data_;
+		size_t size_;
+	};
+
+	// 一个完整的PES包, 只在回调期间有效.
+	struct pes_unit
+	{
+		uint16_t pid_;
+		uint8_t stream_id_;
+		int stream_type_;		// 通过push_batch输入时为-1.
+		bool is_video_;
+		bool is_audio_;
+		bool is_key_;			// 任意一个包被解析为关键帧.
+		bool discontinuity_;	// 中间有丢包, 或PES_packet_length不完整.
+		int64_t pts_;
+		int64_t dts_;
+		// 不含PES头的负载, 按顺序分布在span_count_个片段中.
+		const pes_span* spans_;
+		size_t span_count_;
+		size_t size_;
+		// 连续拷贝模式下指向拷贝后的负载, 否则为nullptr.
+		const uint8_t* data_;
+	};
+
+	// 按pid重组音视频PES包, 默认输出指向输入缓冲的片段列表而不拷贝数据,
+	// 调用者需要保证输入缓冲在PES包输出前有效, 缓冲即将失效时调用detach.
+	class pes_assembler
+	{
+		// c++11 noncopyable.
+		pes_assembler(const pes_assembler&) = delete;
+		pes_assembler& operator=(const pes_assembler&) = delete;
+
+	public:
+		typedef std::function<void(const pes_unit&)> handler_type;
+
+		pes_assembler();
+		explicit pes_assembler(handler_type handler);
+		~pes_assembler();
+
+	public:
+		void set_handler(handler_type handler);
+
+		// 开启后把负载拷贝到内部复用的连续缓冲, 通过pes_unit::data_访问.
+		void set_contiguous(bool contiguous);
+		bool contiguous() const;
+
+		// ts指向188字节ts包的同步字节, info为mpegts_parser对这个包的解析结果.
+		// 只处理音视频pid, 其它包直接忽略.
+		void push(const uint8_t* ts, const mpegts_info& info);
+
+		// buf, n_packets和packet_size与传给do_parser_batch的一致,
+		// batch至少需要pid_, flags_, payload_begin_和payload_end_列.
+		void push_batch(const uint8_t* buf, size_t n_packets, int packet_size, const mpegts_batch& batch);
+
+		// 把未完成PES包引用的输入数据拷贝到内部缓冲, 之后可以释放输入缓冲.
+		void detach();
+
+		// 输出所有未完成的PES包, 用于输入结束时.
+		void flush();
+
+		// 丢弃所有未完成的PES包.
+		void reset();
+
+		// 保存连续计数和未完成的PES包(包括已收到的负载), 与mpegts_parser::snapshot
+		// 配合使用, restore后继续输入之后的包即可输出跨越保存位置的PES包.
+		void snapshot(std::vector<uint8_t>& out) const;
+		// 数据无效时返回false, 状态不变.
+		bool restore(const uint8_t* data, size_t size);
+
+	protected:
+		struct pes_state
+		{
+			pes_state()
+				: pid_(0)
+				, cc_(-1)
+				, active_(false)
+				, need_(0)
+				, size_(0)
+				, unit_()
+			{}
+
+			uint16_t pid_;
+			int cc_;
+			bool active_;
+			// PES头中的PES_packet_length换算出的负载大小, 0表示未指定.
+			size_t need_;
+			size_t size_;
+			pes_unit unit_;
+			std::vector<pes_span> spans_;
+			// detach后保存的数据.
+			std::vector<uint8_t> owned_;
+		};
+
+	protected:
+		pes_state& state(uint16_t pid);
+		void do_push(const uint8_t* ts, uint16_t pid, bool start, const uint8_t* begin, const uint8_t* end,
+			bool is_video, bool is_audio, bool is_key, int stream_type, int64_t pts, int64_t dts);
+		void do_append(pes_state& s, const uint8_t* begin, const uint8_t* end);
+		void do_emit(pes_state& s);
+
+	protected:
+		handler_type m_handler;
+		bool m_contiguous;
+		// pid到m_states的下标, -1表示没有状态.
+		std::vector<int16_t> m_slots;
+		std::vector<pes_state> m_states;
+		std::vector<uint8_t> m_buffer;
+		std::vector<uint8_t> m_scratch;
+	};
+
+}
@@ -0,0 +1,22 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace util {
+
+	// 在data中查找同步位置: 从该位置开始连续lock_count个间隔为packet_size的字节都是0x47.
+	// 找到时返回true, skipped为同步位置之前需要跳过的字节数.
+	// 未找到时返回false, skipped为可以安全丢弃的字节数, 剩余的字节不足以确认同步,
+	// 需要补充数据后再次查找; 在数据末尾可以用较小的lock_count确认最后几个包.
+	// 有sse2/avx2时一次检查多个候选位置, 否则使用逐字节的实现.
+	bool ts_resync(const uint8_t* data, size_t size, size_t& skipped,
+		int lock_count = 3, size_t packet_size = 188);
+}
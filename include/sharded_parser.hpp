@@ -0,0 +1,101 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <functional>
+
+#include "mpegts.hpp"
+#include "spsc_ring.hpp"
+
+namespace util {
+
+	// 按pid把包分发到多个工作线程解析, 每个工作线程有自己的mpegts_parser,
+	// 负责分配给它的pid的帧类型查找等状态. 同一个pid的包总是由同一个工作
+	// 线程按输入顺序处理, PAT/PMT发送给所有工作线程.
+	class sharded_parser
+	{
+		// c++11 noncopyable.
+		sharded_parser(const sharded_parser&) = delete;
+		sharded_parser& operator=(const sharded_parser&) = delete;
+
+	public:
+		// 在工作线程中调用, packet指向按packet_size()格式封装的包, 只在调用期间有效.
+		typedef std::function<void(int worker, const uint8_t* packet, int64_t pos,
+			const mpegts_info& info)> handler_type;
+
+		sharded_parser();
+		~sharded_parser();
+
+	public:
+		// 启动前设置, 见mpegts_parser::set_packet_size.
+		bool set_packet_size(int packet_size);
+		int packet_size() const;
+
+		// 启动workers个工作线程, 每个线程的队列容纳capacity个包. cpus不为空时
+		// 第i个工作线程绑定到cpus[i % cpus.size()], 分发线程的绑定由调用者决定.
+		bool start(int workers, size_t capacity, handler_type handler,
+			const std::vector<int>& cpus = std::vector<int>());
+
+		// 在分发线程中调用, 分发buf中连续的n_packets个包, pos为第一个包的文件偏移.
+		// 队列满时等待工作线程处理. 返回分发的包数, 遇到同步字节错误即停止.
+		size_t dispatch(const uint8_t* buf, size_t n_packets, int64_t pos);
+
+		// 等待所有已分发的包处理完成.
+		void drain();
+
+		// 处理完队列中的包后停止所有工作线程.
+		void stop();
+
+		// pid分配到的工作线程, 还未分配时返回-1.
+		int worker_of(uint16_t pid) const;
+
+	protected:
+		struct slot
+		{
+			int64_t pos_;
+			uint8_t data_[ts_packet_204];
+		};
+
+		struct worker
+		{
+			explicit worker(size_t capacity)
+				: ring_(capacity)
+			{}
+
+			spsc_ring<slot> ring_;
+			mpegts_parser parser_;
+			std::thread thread_;
+		};
+
+	protected:
+		void do_push(int index, const uint8_t* packet, int64_t pos);
+		int do_route(uint16_t pid);
+		void do_work(int index);
+
+	protected:
+		int m_packet_size;
+		handler_type m_handler;
+		std::vector<std::unique_ptr<worker>> m_workers;
+		std::atomic<bool> m_stop;
+
+		// 分发线程用于识别PAT/PMT和流类型的解析器.
+		mpegts_parser m_psi;
+		bool m_psi_ready;
+		// pid到工作线程的映射, -1表示未分配.
+		std::vector<int16_t> m_routes;
+		int m_next_video;
+		int m_next_other;
+	};
+
+}
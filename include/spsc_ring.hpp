@@ -0,0 +1,168 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#	include <intrin.h>
+#endif
+
+namespace util {
+
+	// 缓存行大小, 生产者和消费者修改的变量分开放置以避免伪共享.
+	enum { cache_line_size = 64 };
+
+	// 单生产者单消费者的定长环形队列, 不使用锁.
+	// 生产者调用alloc/push, 消费者调用front/pop, 容量向上取整为2的幂.
+	template <typename T>
+	class spsc_ring
+	{
+		// c++11 noncopyable.
+		spsc_ring(const spsc_ring&) = delete;
+		spsc_ring& operator=(const spsc_ring&) = delete;
+
+	public:
+		explicit spsc_ring(size_t capacity)
+			: m_head(0)
+			, m_cached_tail(0)
+			, m_tail(0)
+			, m_cached_head(0)
+		{
+			size_t size = 1;
+			while (size < capacity)
+				size <<= 1;
+			m_slots.resize(size);
+			m_mask = size - 1;
+		}
+
+	public:
+		// 生产者: 返回下一个可写的槽位, 队列满时返回nullptr.
+		T* alloc()
+		{
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+			if (tail - m_cached_head > m_mask)
+			{
+				m_cached_head = m_head.load(std::memory_order_acquire);
+				if (tail - m_cached_head > m_mask)
+					return nullptr;
+			}
+			return &m_slots[tail & m_mask];
+		}
+
+		// 生产者: 提交alloc返回的槽位.
+		void push()
+		{
+			m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		bool try_push(const T& value)
+		{
+			T* slot = alloc();
+			if (!slot)
+				return false;
+			*slot = value;
+			push();
+			return true;
+		}
+
+		// 消费者: 返回队首元素, 队列空时返回nullptr.
+		T* front()
+		{
+			size_t head = m_head.load(std::memory_order_relaxed);
+			if (head == m_cached_tail)
+			{
+				m_cached_tail = m_tail.load(std::memory_order_acquire);
+				if (head == m_cached_tail)
+					return nullptr;
+			}
+			return &m_slots[head & m_mask];
+		}
+
+		// 消费者: 移除队首元素, 之后槽位可以被生产者重用.
+		void pop()
+		{
+			m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		// 任意线程调用时只是近似值.
+		size_t size() const
+		{
+			return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+		}
+
+		bool empty() const
+		{
+			return size() == 0;
+		}
+
+		size_t capacity() const
+		{
+			return m_mask + 1;
+		}
+
+	private:
+		std::vector<T> m_slots;
+		size_t m_mask;
+		char m_pad0[cache_line_size];
+
+		// 消费者修改.
+		std::atomic<size_t> m_head;
+		size_t m_cached_tail;
+		char m_pad1[cache_line_size];
+
+		// 生产者修改.
+		std::atomic<size_t> m_tail;
+		size_t m_cached_head;
+		char m_pad2[cache_line_size];
+	};
+
+	// 等待队列状态变化时的退避, 先自旋, 然后让出时间片, 长时间空闲时休眠.
+	class spin_backoff
+	{
+	public:
+		spin_backoff()
+			: m_count(0)
+		{}
+
+		void wait()
+		{
+			if (m_count < 64)
+			{
+				m_count++;
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+				_mm_pause();
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+				__builtin_ia32_pause();
+#endif
+				return;
+			}
+			if (m_count < 128)
+			{
+				m_count++;
+				std::this_thread::yield();
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+
+		void reset()
+		{
+			m_count = 0;
+		}
+
+	private:
+		int m_count;
+	};
+
+}
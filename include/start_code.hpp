@@ -0,0 +1,84 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+namespace util {
+
+	// 查找[data, data + size)中所有的00 00 01起始码, 把起始码之后第一个字节(NAL头或者
+	// mpeg2的起始码值)的偏移依次写入offsets, 最多写入max_count个, 返回写入的个数.
+	// 只报告后面至少还有1个字节的起始码. 运行时按cpu选择avx512bw/avx2/sse2或标量实现.
+	size_t find_start_codes(const uint8_t* data, size_t size, uint32_t* offsets, size_t max_count);
+
+	// 逐个查找起始码的标量实现, state保存最近4个字节, 返回起始码后第一个字节之后的位置.
+	static inline const uint8_t* find_start_code(const uint8_t* p,
+		const uint8_t* end, uint32_t* state)
+	{
+		int i;
+
+		if (p >= end)
+			return end;
+
+		for (i = 0; i < 3; i++) {
+			uint32_t tmp = *state << 8;
+			*state = tmp + *(p++);
+			if (tmp == 0x100 || p == end)
+				return p;
+		}
+
+		while (p < end) {
+			if (p[-1] > 1) p += 3;
+			else if (p[-2]) p += 2;
+			else if (p[-3] | (p[-1] - 1)) p++;
+			else {
+				p++;
+				break;
+			}
+		}
+
+		p = std::min(p, end) - 4;
+		*state = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+
+		return p + 4;
+	}
+
+	static inline void* ts_memmem(const void *haystack, size_t haystack_len,
+		const void *needle, size_t needle_len)
+	{
+		const char *begin = (const char *)haystack;
+		const char *last_possible = begin + haystack_len - needle_len;
+		const char *tail = (const char *)needle;
+		char point;
+
+		/*
+		 * The first occurrence of the empty string is deemed to occur at
+		 * the beginning of the string.
+		 */
+		if (needle_len == 0)
+			return (void *)begin;
+
+		/*
+		 * Sanity check, otherwise the loop might search through the whole
+		 * memory.
+		 */
+		if (haystack_len < needle_len)
+			return NULL;
+
+		point = *tail++;
+		for (; begin <= last_possible; begin++) {
+			if (*begin == point && !memcmp(begin + 1, tail, needle_len - 1))
+				return (void *)begin;
+		}
+
+		return NULL;
+	}
+}
@@ -0,0 +1,65 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace util {
+
+	// 状态快照的序列化, 整数按小端存放, 与平台无关.
+	class blob_writer
+	{
+	public:
+		explicit blob_writer(std::vector<uint8_t>& out);
+
+	public:
+		void put_u8(uint8_t v);
+		void put_u16(uint16_t v);
+		void put_u32(uint32_t v);
+		void put_u64(uint64_t v);
+		void put_i64(int64_t v);
+		// 长度(u32)加数据.
+		void put_bytes(const uint8_t* data, size_t size);
+		void put_raw(const void* data, size_t size);
+
+	protected:
+		std::vector<uint8_t>& m_out;
+	};
+
+	// 数据不足时之后的读取都返回0, 最后通过ok()检查.
+	class blob_reader
+	{
+	public:
+		blob_reader(const uint8_t* data, size_t size);
+
+	public:
+		uint8_t get_u8();
+		uint16_t get_u16();
+		uint32_t get_u32();
+		uint64_t get_u64();
+		int64_t get_i64();
+		// 读取put_bytes写入的数据, 长度超过max_size时失败.
+		bool get_bytes(std::vector<uint8_t>& out, size_t max_size);
+		bool get_raw(void* data, size_t size);
+
+		size_t remaining() const;
+		bool ok() const;
+
+	protected:
+		uint64_t get(size_t n);
+
+	protected:
+		const uint8_t* m_data;
+		size_t m_size;
+		size_t m_pos;
+		bool m_ok;
+	};
+
+}
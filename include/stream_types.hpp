@@ -0,0 +1,170 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace util {
+
+	enum {
+		unkown_type = 0x00,
+		video_mpeg1 = 0x01,
+		video_mpeg2 = 0x02,
+		audio_mpeg1 = 0x03,
+		audio_mpeg2 = 0x04,
+		private_section = 0x05,
+		private_data = 0x06,
+		iso_13818_1_pes = 0x07,
+		iso_13522_mheg = 0x08,
+		itu_t_rec_h_222_1 = 0x09,
+		iso_13818_6_type_a = 0x0a,
+		iso_13818_6_type_b = 0x0b,
+		iso_13818_6_type_c = 0x0c,
+		iso_13818_6_type_d = 0x0d,
+		iso_13818_1_auxiliary = 0x0e,
+		audio_aac = 0x0f,
+		video_mpeg4 = 0x10,
+		audio_aac_latm = 0x11,
+		iso_14496_1_pes = 0x12,
+		iso_14496_1_sections = 0x13,
+		iso_13818_6_SDP = 0x14,
+		metadata = 0x15,
+		video_h264 = 0x1b,
+		video_hevc = 0x24,
+		video_cavs = 0x42,
+		video_dirac = 0xd1,
+		video_vc1 = 0xea,
+		audio_pcm_bluray = 0x80,
+		audio_ac3 = 0x81,
+		audio_dts_0 = 0x82,
+		audio_truehd = 0x83,
+		audio_eac3_0 = 0x84,
+		audio_dts_1 = 0x85,
+		audio_dts_2 = 0x86,
+		audio_eac3_1 = 0x87,
+		audio_eac3_2 = 0xa1,
+		audio_dts_3 = 0xa2,
+		hdmv_pgs_subtitle = 0x90,
+		audio_dts_4 = 0x8a,
+	};
+
+	enum stream_kind
+	{
+		stream_kind_unknown = 0,	// 不支持的stream type.
+		stream_kind_video,
+		stream_kind_audio,
+		stream_kind_other,			// 已知, 但不是音视频, 如私有数据.
+	};
+
+	struct stream_type_traits
+	{
+		uint8_t kind;			// stream_kind.
+		uint8_t codec;			// 解析时使用的stream type, 如0x20按h264处理.
+		uint8_t stream_id;		// 封装PES时使用的stream_id.
+		bool muxable;			// 是否可用于init_streams.
+		const char* name;		// 未知stream type为nullptr.
+	};
+
+#define MPEGTS_UNKNOWN_STREAM_TYPE { stream_kind_unknown, unkown_type, 0x00, false, nullptr }
+
+	// 以stream type为下标的编译期常量表, 查找为O(1), 不需要构造时分配.
+	constexpr stream_type_traits stream_type_table[256] =
+	{
+		/* 0x00 */ MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x01 */ { stream_kind_video, video_mpeg1, 0xe0, true, "MPEG2VIDEO|ISO/IEC 11172-2 Video" },
+		/* 0x02 */ { stream_kind_video, video_mpeg2, 0xe0, true, "MPEG2VIDEO|ISO/IEC 13818-2 Video" },
+		/* 0x03 */ { stream_kind_audio, audio_mpeg1, 0xc0, true, "MP3|ISO/IEC 11172-3 Audio" },
+		/* 0x04 */ { stream_kind_audio, audio_mpeg2, 0xc0, true, "MP3|ISO/IEC 13818-3 Audio" },
+		/* 0x05 */ { stream_kind_other, private_section, 0xfc, true, "ISO/IEC 13818-1 PRIVATE SECTION" },
+		/* 0x06 */ { stream_kind_other, private_data, 0xfc, true, "ISO/IEC 13818-1 PES" },
+		/* 0x07 */ { stream_kind_other, iso_13818_1_pes, 0xfc, true, "ISO/IEC 13522 MHEG" },
+		/* 0x08 */ { stream_kind_other, iso_13522_mheg, 0xfc, true, "ISO/IEC 13818-1 Annex A DSM-CC" },
+		/* 0x09 */ { stream_kind_other, itu_t_rec_h_222_1, 0xfc, true, "ITU-T Rec.H.222.1" },
+		/* 0x0a */ { stream_kind_other, iso_13818_6_type_a, 0xfc, true, "ISO/IEC 13818-6 type A" },
+		/* 0x0b */ { stream_kind_other, iso_13818_6_type_b, 0xfc, true, "ISO/IEC 13818-6 type B" },
+		/* 0x0c */ { stream_kind_other, iso_13818_6_type_c, 0xfc, true, "ISO/IEC 13818-6 type C" },
+		/* 0x0d */ { stream_kind_other, iso_13818_6_type_d, 0xfc, true, "ISO/IEC 13818-6 type D" },
+		/* 0x0e */ { stream_kind_other, iso_13818_1_auxiliary, 0xfc, true, "ISO/IEC 13818-1 AUXILIARY" },
+		/* 0x0f */ { stream_kind_audio, audio_aac, 0xc0, true, "AAC" },
+		/* 0x10 */ { stream_kind_video, video_mpeg4, 0xe0, true, "MPEG4|ISO/IEC 14496-2 Visual" },
+		/* 0x11 */ { stream_kind_audio, audio_aac_latm, 0xc0, true, "LATM|ISO/IEC 14496-3 Audio with the LATM transport syntax as defined in ISO/IEC 14496-3 / AMD 1" },
+		/* 0x12 */ { stream_kind_other, iso_14496_1_pes, 0xfc, true, "ISO/IEC 14496-1 SL-packetized stream or FlexMux stream carried in PES packets" },
+		/* 0x13 */ { stream_kind_other, iso_14496_1_sections, 0xfc, true, "ISO/IEC 14496-1 SL-packetized stream or FlexMux stream carried in ISO/IEC14496_sections" },
+		/* 0x14 */ { stream_kind_other, iso_13818_6_SDP, 0xfc, true, "ISO/IEC 13818-6 Synchronized Download Protocol" },
+		/* 0x15 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x1b */ { stream_kind_video, video_h264, 0xe0, true, "H264" },
+		/* 0x1c */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x20 */ { stream_kind_video, video_h264, 0xe0, true, "H264" },
+		/* 0x21 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x24 */ { stream_kind_video, video_hevc, 0xe0, true, "HEVC" },
+		/* 0x25 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x2d */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x35 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x3d */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x42 */ { stream_kind_video, video_cavs, 0xe0, true, "CAVS" },
+		/* 0x43 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x4b */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x53 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x5b */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x63 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x6b */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x73 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x7b */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x80 */ { stream_kind_audio, audio_pcm_bluray, 0xfc, false, "PCM_BLURAY" },
+		/* 0x81 */ { stream_kind_audio, audio_ac3, 0xfd, false, "AC3|DOLBY_AC3_AUDIO" },
+		/* 0x82 */ { stream_kind_audio, audio_dts_0, 0xfc, false, "DTS" },
+		/* 0x83 */ { stream_kind_audio, audio_truehd, 0xfc, false, "TRUEHD" },
+		/* 0x84 */ { stream_kind_audio, audio_eac3_0, 0xfc, false, "EAC3" },
+		/* 0x85 */ { stream_kind_audio, audio_dts_1, 0xfc, false, "DTS" },
+		/* 0x86 */ { stream_kind_audio, audio_dts_2, 0xfc, false, "DTS" },
+		/* 0x87 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x8a */ { stream_kind_audio, audio_dts_4, 0xfc, false, "DTS" },
+		/* 0x8b */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x90 */ { stream_kind_audio, hdmv_pgs_subtitle, 0xfc, false, "HDMV_PGS_SUBTITLE" },
+		/* 0x91 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0x99 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xa1 */ { stream_kind_audio, audio_eac3_2, 0xfc, false, "EAC3" },
+		/* 0xa2 */ { stream_kind_audio, audio_dts_3, 0xfc, false, "DTS" },
+		/* 0xa3 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xab */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xb3 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xbb */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xc3 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xcb */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xd1 */ { stream_kind_video, video_dirac, 0xfd, true, "DIRAC" },
+		/* 0xd2 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xda */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xe2 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xea */ { stream_kind_video, video_vc1, 0xe0, true, "VC1" },
+		/* 0xeb */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xf3 */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+		/* 0xfb */ MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE, MPEGTS_UNKNOWN_STREAM_TYPE,
+	};
+
+#undef MPEGTS_UNKNOWN_STREAM_TYPE
+
+	constexpr const stream_type_traits& stream_traits(uint8_t stream_type)
+	{
+		return stream_type_table[stream_type];
+	}
+
+	// 按名称反查stream type, 多个stream type同名时返回最小的一个, 找不到返回0.
+	inline uint8_t stream_type_by_name(const char* name)
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			const char* n = stream_type_table[i].name;
+			if (n && std::strcmp(n, name) == 0)
+				return static_cast<uint8_t>(i);
+		}
+		return unkown_type;
+	}
+
+}
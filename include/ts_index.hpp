@@ -0,0 +1,196 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "mpegts.hpp"
+#include "mapped_file.hpp"
+
+namespace util {
+
+	// 索引文件格式, 全部为小端定长结构, 可以直接映射后访问:
+	//   index_header
+	//   index_section[section_count_]	每个视频pid一个.
+	//   index_entry[...]				每个section的条目连续存放, 按文件位置排序.
+	// section的条目之后可以有预留的空间, 读取方只使用offset_和count_.
+	enum
+	{
+		index_version = 1,
+		index_key = 0x01,		// 关键帧(IDR/I帧).
+	};
+
+	struct index_header
+	{
+		char magic_[4];			// "MTSI".
+		uint32_t version_;
+		uint32_t header_size_;
+		uint32_t entry_size_;
+		uint32_t packet_size_;
+		uint32_t section_count_;
+		uint64_t source_size_;	// 建立索引时源文件的大小.
+		uint64_t indexed_bytes_;	// 已经解析到的源文件位置.
+		int64_t last_pcr_;		// 解析到indexed_bytes_时最近的pcr, 用于继续建立索引.
+		uint8_t reserved_[16];
+	};
+
+	struct index_section
+	{
+		uint16_t pid_;
+		uint8_t stream_type_;
+		uint8_t reserved0_;
+		uint32_t reserved1_;
+		uint64_t offset_;		// 第一个条目在索引文件中的位置.
+		uint64_t count_;
+		uint64_t capacity_;		// 为追加预留的条目数, 不小于count_, 0表示没有预留.
+	};
+
+	// 一个访问单元的开始, 时间戳为90KHz, 已展开33位回绕, 没有时为-1.
+	struct index_entry
+	{
+		int64_t pos_;			// 起始ts包在源文件中的位置.
+		int64_t pts_;
+		int64_t dts_;
+		int64_t pcr_;			// 之前最近的pcr, 单位与mpegts_info::pcr_相同(毫秒), 没有时为-1.
+		uint16_t flags_;
+		uint8_t pict_type_;
+		uint8_t reserved_[5];
+	};
+
+	static_assert(sizeof(index_header) == 64, "index_header layout");
+	static_assert(sizeof(index_section) == 32, "index_section layout");
+	static_assert(sizeof(index_entry) == 40, "index_entry layout");
+
+	// 根据解析结果记录每个视频pid所有访问单元开始的位置和时间戳.
+	class index_builder
+	{
+		// c++11 noncopyable.
+		index_builder(const index_builder&) = delete;
+		index_builder& operator=(const index_builder&) = delete;
+
+	public:
+		index_builder();
+		~index_builder();
+
+	public:
+		void set_packet_size(int packet_size);
+		void set_stream_type(uint16_t pid, uint8_t stream_type);
+
+		// pos为ts包在源文件中的位置, info为mpegts_parser对这个包的解析结果.
+		void push(int64_t pos, const mpegts_info& info);
+		// 与push相同, 参数来自mpegts_batch的列, flags为mpegts_batch::flag_xxx.
+		void push(int64_t pos, uint16_t pid, uint8_t flags, uint8_t pict_type,
+			int64_t pcr, int64_t pts, int64_t dts);
+
+		// 已经解析到源文件的位置, 保存在索引头中.
+		void set_indexed_bytes(int64_t bytes, int64_t source_size);
+
+		// 写入临时文件后改名, 读取方不会看到写了一半的索引.
+		bool save(const std::string& file);
+		// 增量保存, 用于持续增长的源文件. file是上一次save/append/load的文件且
+		// 预留的空间足够时, 只写入新的条目后再修改section表和索引头; 否则按当前
+		// 条目数的两倍预留空间重新写入整个文件. 之后内存中只保留每个pid的最后
+		// 一个条目, 之前的条目在需要重写文件时从file中复制.
+		bool append(const std::string& file);
+		// 读入已有的索引, 之后可以继续追加. 内存中只保留每个pid的最后一个条目.
+		bool load(const std::string& file);
+		int64_t indexed_bytes() const;
+		int packet_size() const;
+		// load之后解析器的状态也已恢复到indexed_bytes时调用, 之后的包可以继续
+		// 补充最后一个条目的帧类型.
+		void continue_entries();
+
+		void clear();
+		size_t entry_count() const;
+
+	protected:
+		struct pid_state
+		{
+			pid_state()
+				: stream_type_(0)
+				, last_pts_(-1)
+				, pts_offset_(0)
+				, last_dts_(-1)
+				, dts_offset_(0)
+				, resumed_(false)
+				, base_(0)
+				, offset_(0)
+				, capacity_(0)
+				, written_(0)
+			{}
+
+			uint8_t stream_type_;
+			int64_t last_pts_;
+			int64_t pts_offset_;
+			int64_t last_dts_;
+			int64_t dts_offset_;
+			// 最后一个条目由load读入, 之后的包不再修改它.
+			bool resumed_;
+			// entries_[0]之前只保存在m_file中的条目数.
+			uint64_t base_;
+			// 在m_file中的位置, 预留的条目数和已经写入的条目数, offset_为0表示还没有写入.
+			uint64_t offset_;
+			uint64_t capacity_;
+			uint64_t written_;
+			std::vector<index_entry> entries_;
+		};
+
+		static int64_t unwrap(int64_t ts, int64_t& last, int64_t& offset);
+		index_header make_header(size_t section_count) const;
+		// 重新写入整个文件, spare为true时为每个section预留空间.
+		bool write_file(const std::string& file, bool spare);
+		// 写入之后丢弃内存中除最后一个外的条目.
+		void trim_entries();
+
+	protected:
+		std::map<uint16_t, pid_state> m_pids;
+		int m_packet_size;
+		int64_t m_last_pcr;
+		int64_t m_indexed_bytes;
+		int64_t m_source_size;
+		// pid_state中的布局对应的索引文件.
+		std::string m_file;
+	};
+
+	// 映射索引文件, 通过二分查找定位.
+	class ts_index
+	{
+		// c++11 noncopyable.
+		ts_index(const ts_index&) = delete;
+		ts_index& operator=(const ts_index&) = delete;
+
+	public:
+		ts_index();
+		~ts_index();
+
+	public:
+		bool open(const std::string& file);
+		void close();
+		bool is_open() const;
+
+		const index_header& header() const;
+		size_t section_count() const;
+		const index_section& section(size_t i) const;
+		const index_section* find_section(uint16_t pid) const;
+		const index_entry* entries(const index_section& section) const;
+
+		// 查找pid中解码时间(dts, 没有时为pts)不大于time的最后一个访问单元,
+		// key_only时继续向前找到最近的关键帧, 找不到时返回nullptr.
+		const index_entry* seek(uint16_t pid, int64_t time, bool key_only = true) const;
+
+	private:
+		mapped_file m_file;
+		const index_header* m_header;
+		const index_section* m_sections;
+	};
+
+}
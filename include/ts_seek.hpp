@@ -0,0 +1,45 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mpegts.hpp"
+
+namespace util {
+
+	struct seek_result
+	{
+		seek_result()
+			: pos_(-1)
+			, time_(-1)
+			, probes_(0)
+		{}
+
+		int64_t pos_;		// 找到的包在data中的偏移.
+		int64_t time_;		// 这个包上的时间, 与流中的值相同(未展开回绕).
+		int probes_;		// 读取探测的次数.
+	};
+
+	// 没有索引时按时间二分查找, data通常为mapped_file映射的整个文件, 每次探测
+	// 只读取探测位置之后到下一个时间戳为止的少量数据.
+	// parser需要已经解析过PAT/PMT, 只读取它的流信息和包格式.
+	// 时间按第一个时间戳展开33位回绕, 时间回退(不连续)时认为目标在回退之前.
+	// 目标在第一个时间戳之前时没有满足条件的帧, 与ts_index::seek一样返回false.
+
+	// 按pid的解码时间(dts, 没有时为pts, 90KHz)查找时间不大于pts的最后一帧,
+	// key_only时为最后一个关键帧, 结果为帧起始包的位置.
+	bool seek_to_pts(const mpegts_parser& parser, const uint8_t* data, size_t size,
+		uint16_t pid, int64_t pts, bool key_only, seek_result& result);
+
+	// 查找pcr不大于目标的最后一个含pcr的包, pcr与mpegts_info::pcr_单位相同(毫秒).
+	bool seek_to_pcr(const mpegts_parser& parser, const uint8_t* data, size_t size,
+		int64_t pcr, seek_result& result);
+
+}
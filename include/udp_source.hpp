@@ -0,0 +1,85 @@
+﻿//
+// Copyright (C) 2016 Jack.
+//
+// Author: jack
+// Email:  jack.wgm at gmail dot com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace util {
+
+	// 一个收到的数据报, data_指向udp_source内部的接收缓冲, 在下一次receive前有效.
+	struct udp_datagram
+	{
+		const uint8_t* data_;		// ts包, 已去掉RTP头和填充.
+		size_t size_;
+		int64_t arrival_time_;		// 内核收到数据报的时间(纳秒, CLOCK_REALTIME), 没有时为-1.
+		int32_t rtp_seq_;			// RTP序号, 没有RTP头时为-1.
+		uint32_t rtp_timestamp_;
+		uint32_t lost_;				// 与上一个RTP包之间丢失的包数.
+	};
+
+	// 从UDP接收ts数据(裸ts或RTP封装), 组播地址时加入组播, 仅支持IPv4.
+	// Linux上用recvmmsg一次接收多个数据报到预先分配的缓冲中, 每个数据报
+	// 通常为7个ts包, 可以直接交给mpegts_parser::do_parser_batch解析.
+	class udp_source
+	{
+		// c++11 noncopyable.
+		udp_source(const udp_source&) = delete;
+		udp_source& operator=(const udp_source&) = delete;
+
+	public:
+		// batch为每次最多接收的数据报数, slab_size为每个数据报的缓冲大小.
+		explicit udp_source(size_t batch = 64, size_t slab_size = 2048);
+		~udp_source();
+
+	public:
+		// address为空时接收所有地址, interface为加入组播使用的本地地址.
+		bool open(const std::string& address, uint16_t port,
+			const std::string& interface = std::string());
+		void close();
+		bool is_open() const;
+		// 实际绑定的端口, 用于port为0时.
+		uint16_t port() const;
+
+		// 最多等待timeout毫秒(-1一直等待), 接收已到达的数据报,
+		// 返回本次收到的个数, 超时返回0, 出错返回-1.
+		int receive(int timeout);
+		const udp_datagram* datagrams() const;
+		size_t count() const;
+
+		int64_t received() const;		// 收到的数据报数.
+		int64_t rtp_lost() const;		// 按RTP序号统计的丢包数, 包括之后迟到而被丢弃的包.
+		int64_t rtp_reordered() const;	// 迟到或重复的RTP包数, 这些包都被丢弃.
+		int64_t truncated() const;		// 超过slab_size被截断而丢弃的数据报数.
+
+	protected:
+		// 去掉RTP头并检查序号, 返回false时丢弃这个数据报.
+		bool strip_rtp(udp_datagram& d);
+
+	protected:
+		int m_fd;
+		uint16_t m_port;
+		size_t m_batch;
+		size_t m_slab_size;
+		std::vector<uint8_t> m_slabs;
+		std::vector<uint8_t> m_control;
+		// recvmmsg的参数, 在构造时一次准备好, 每次接收复用.
+		std::vector<uint8_t> m_headers;
+		std::vector<uint8_t> m_iovecs;
+		std::vector<udp_datagram> m_datagrams;
+		size_t m_count;
+		int32_t m_last_seq;
+		int64_t m_received;
+		int64_t m_rtp_lost;
+		int64_t m_rtp_reordered;
+		int64_t m_truncated;
+	};
+
+}
@@ -1,5 +1,14 @@
 ﻿#include "mpegts.hpp"
+#include "resync.hpp"
+#include "mapped_file.hpp"
+#include "async_reader.hpp"
+#include "parallel_scan.hpp"
+#include "ts_index.hpp"
+#include "index_follower.hpp"
+#include "udp_source.hpp"
 #include <iostream>
+#include <cstring>
+#include <thread>
 #include <boost/program_options.hpp>
 namespace po = boost::program_options;
 
@@ -10,18 +19,34 @@ int main(int argc, char** argv)
 	bool show_frame_pts = false;
 	bool show_frame_dts = false;
 	bool show_key_frame = false;
+	bool use_mmap = true;
+	bool use_async = false;
+	bool direct_io = false;
+	int threads = 1;
+	bool follow = false;
 	std::string file;
+	std::string udp;
+	std::string index_file;
+	std::vector<int> filter_pids;
 
 	po::options_description desc("Options");
 	desc.add_options()
 		("help,h", "Help message.")
 		("version", "Current mpegts parser version.")
 		("ts", po::value<std::string>(&file), "Specify one input file.")
+		("udp", po::value<std::string>(&udp), "Receive raw or RTP ts from address:port (multicast groups are joined), stop after 5 seconds without data.")
 		("show_pcr_time", po::value<bool>(&show_pcr_time)->default_value(false), "Show pcr time.")
 		("show_frame_pos", po::value<bool>(&show_frame_pos)->default_value(false), "Show frame pos.")
 		("show_frame_pts", po::value<bool>(&show_frame_pts)->default_value(false), "Show frame pts.")
 		("show_frame_dts", po::value<bool>(&show_frame_dts)->default_value(false), "Show frame dts.")
 		("show_key_frame", po::value<bool>(&show_key_frame)->default_value(false), "Show key frame.")
+		("pid", po::value<std::vector<int>>(&filter_pids)->multitoken(), "Only parse the specified pids.")
+		("mmap", po::value<bool>(&use_mmap)->default_value(true), "Read input file by memory mapping.")
+		("async_read", po::value<bool>(&use_async)->default_value(false), "Read input file with queued asynchronous reads (io_uring).")
+		("direct_io", po::value<bool>(&direct_io)->default_value(false), "Bypass page cache (O_DIRECT) for asynchronous reads.")
+		("threads", po::value<int>(&threads)->default_value(1), "Parse memory mapped input on multiple threads, 0 for all cores.")
+		("index", po::value<std::string>(&index_file), "Write keyframe/timestamp seek index to the file.")
+		("follow", po::value<bool>(&follow)->default_value(false), "Keep the index up to date while the input file grows.")
 		;
 
 	try {
@@ -29,7 +54,7 @@ int main(int argc, char** argv)
 		po::store(po::parse_command_line(argc, argv, desc), vm);
 		po::notify(vm);
 
-		if (argc < 2 || vm.count("help") || file.empty()) {
+		if (argc < 2 || vm.count("help") || (file.empty() && udp.empty())) {
 			std::cout << desc << "\n";
 			return -1;
 		}
@@ -39,18 +64,75 @@ int main(int argc, char** argv)
 		return -1;
 	}
 
-	FILE* fp = fopen(file.c_str(), "r+b");
-	if (!fp) {
-		std::cerr << "Can't open file " << file << "\n";
-		return -1;
+	// 跟随正在写入的文件, 只解析新增的数据并更新索引.
+	if (follow && !index_file.empty()) {
+		util::index_follower follower;
+		if (!follower.open(file, index_file) || !follower.follow())
+			return -1;
+		return 0;
+	}
+
+	// 优先映射整个文件, 解析器直接读取映射内存, 失败时使用fread.
+	// 异步读取时保持多个读请求在进行中, 解析器直接读取完成的块.
+	// 网络输入时每个数据报包含完整的ts包, 直接解析接收缓冲.
+	util::async_reader ar;
+	util::mapped_file mf;
+	util::udp_source us;
+	FILE* fp = nullptr;
+	const int udp_idle_timeout = 5000;
+	bool udp_input = !udp.empty();
+	bool async = !udp_input && use_async && ar.open(file, 1024 * 1024, 8, direct_io);
+	if (async) {
+		// 已经打开.
+	}
+	else if (udp_input) {
+		auto colon = udp.rfind(':');
+		int port = colon == std::string::npos ? 0 : atoi(udp.c_str() + colon + 1);
+		if (port <= 0 || port > 0xffff || !us.open(udp.substr(0, colon), static_cast<uint16_t>(port))) {
+			std::cerr << "Can't receive from " << udp << "\n";
+			return -1;
+		}
+	}
+	else if (!use_mmap || !mf.open(file)) {
+		fp = fopen(file.c_str(), "r+b");
+		if (!fp) {
+			std::cerr << "Can't open file " << file << "\n";
+			return -1;
+		}
+	}
+	else {
+		mf.advise(util::map_sequential);
+		mf.advise(util::map_hugepage);
 	}
 
 	util::mpegts_parser p;
-	util::byte_streambuf buf;
+	util::mirrored_streambuf buf;
+
+	if (!filter_pids.empty()) {
+		std::vector<uint16_t> pids(filter_pids.begin(), filter_pids.end());
+		p.set_pid_filter(pids, util::pid_filter_whitelist);
+	}
+
+	// 重新同步时需要确认的连续同步字节数.
+	const int resync_lock_count = 3;
+
+	// 批量解析的列缓冲.
+	const size_t batch_size = 1000;
+	std::vector<uint16_t> pids(batch_size);
+	std::vector<uint8_t> flags(batch_size);
+	std::vector<uint8_t> picts(batch_size);
+	std::vector<int64_t> pcrs(batch_size), ptss(batch_size), dtss(batch_size);
+	util::mpegts_batch batch;
+	batch.pid_ = pids.data();
+	batch.flags_ = flags.data();
+	batch.pict_type_ = picts.data();
+	batch.pcr_ = pcrs.data();
+	batch.pts_ = ptss.data();
+	batch.dts_ = dtss.data();
+
 	int vc = 0;
 	int sc = 0;
-	int offset = 0;
-	int64_t pts = 0, dts = 0;
+	int64_t offset = 0;
 	bool vknown_type = false;
 	bool aknown_type = false;
 
@@ -79,76 +161,250 @@ int main(int argc, char** argv)
 // 		p.do_parser(data + 188, info);
 // 		std::cout << info.pid_;
 // 	}
-	while (!feof(fp)) {
 
-		if (buf.size() < 188) {
-			auto pre = buf.prepare(188 * 1000);
-			auto sz = fread(pre, 1, 188 * 1000, fp);
-			buf.commit(sz);
+	// 根据文件开始部分的数据检测包格式(188/192/204).
+	const uint8_t* head = mf.data();
+	size_t head_size = std::min<size_t>(mf.size(), 188 * 1000);
+	if (fp) {
+		auto pre = buf.prepare(188 * 1000);
+		auto sz = fread(pre, 1, 188 * 1000, fp);
+		buf.commit(sz);
+		head = buf.data();
+		head_size = buf.size();
+	}
+	const uint8_t* block = nullptr;
+	size_t block_size = 0;
+	if (async && ar.next(block, block_size)) {
+		head = block;
+		head_size = std::min<size_t>(block_size, 188 * 1000);
+	}
+	if (udp_input && us.receive(udp_idle_timeout) > 0) {
+		head = us.datagrams()[0].data_;
+		head_size = us.datagrams()[0].size_;
+	}
+
+	size_t packet_size = util::ts_packet_188;
+	size_t skipped_bytes = 0;
+	size_t first = 0;
+	int detected = util::detect_packet_size(head, head_size, &first);
+	if (detected) {
+		packet_size = detected;
+		p.set_packet_size(static_cast<int>(packet_size));
+		offset += first;
+		skipped_bytes += first;
+	}
+	if (packet_size != util::ts_packet_188)
+		std::cout << "packet size: " << packet_size << std::endl;
+	size_t prefix = util::ts_packet_prefix(static_cast<int>(packet_size));
+
+	util::index_builder index;
+	index.set_packet_size(static_cast<int>(packet_size));
+
+	// 输出一个包的信息, 顺序解析和并行解析共用.
+	auto report = [&](int64_t pos, uint16_t pid, uint8_t f, uint8_t pict, int64_t pcr, int64_t pts, int64_t dts)
+	{
+		if (!index_file.empty())
+			index.push(pos, pid, f, pict, pcr, pts, dts);
+
+		bool is_video = !!(f & util::mpegts_batch::flag_video);
+		bool is_audio = !!(f & util::mpegts_batch::flag_audio);
+		bool is_idr = !!(f & util::mpegts_batch::flag_idr);
+
+		if (is_video && !vknown_type) {
+			std::string s = p.stream_name(pid);
+			if (!s.empty() && !vknown_type) {
+				vknown_type = true;
+				std::cout << "pid " << pid << " stream type: " << s << std::endl;
+			}
+		}
+
+		if (is_audio && !aknown_type) {
+			std::string s = p.stream_name(pid);
+			if (!s.empty() && !aknown_type) {
+				aknown_type = true;
+				std::cout << "pid " << pid << " stream type: " << s << std::endl;
+			}
 		}
 
-		while (buf.size() >= 188) {
-			const uint8_t* data = buf.data();
-			util::mpegts_info info;
-			auto suc = p.do_parser(data, info);
-			if (!suc) {
-				buf.consume(1);
-			} else {
-				buf.consume(188);
+		if (is_idr && is_video)
+			vc++;
+
+		if ((f & util::mpegts_batch::flag_start) && is_video) {
+			sc++;
+			if (show_key_frame) {
+				if (is_idr)
+					std::cout << "flags=K_" << std::endl;
 			}
+			if (show_frame_pos)
+				std::cout << "pos=" << pos << std::endl;
+		}
 
-			if (info.is_video_ && !vknown_type) {
-				std::string s = p.stream_name(info.pid_);
-				if (!s.empty() && !vknown_type) {
-					vknown_type = true;
-					std::cout << "pid " << info.pid_ << " stream type: " << s << std::endl;
-				}
+		if (show_frame_dts) {
+			if (is_video && dts != -1) {
+				std::cout << "dts=" << dts << std::endl;
 			}
+		}
 
-			if (info.is_audio_ && !aknown_type) {
-				std::string s = p.stream_name(info.pid_);
-				if (!s.empty() && !aknown_type) {
-					aknown_type = true;
-					std::cout << "pid " << info.pid_ << " stream type: " << s << std::endl;
-				}
+		if (show_frame_pts) {
+			if (is_video && pts != -1) {
+				std::cout << "pts=" << pts << std::endl;
 			}
+		}
 
-			if (info.type_ == util::mpegts_info::idr && info.is_video_)
-				vc++;
+		if (show_pcr_time && pcr != -1) {
+			std::cout << "pcr=" << pcr << std::endl;
+		}
+	};
 
-			if (info.start_ && info.is_video_) {
-				sc++;
-				if (show_key_frame) {
-					if (info.type_ == util::mpegts_info::idr)
-						std::cout << "flags=K_" << std::endl;
+	// 解析data中的数据, 返回已处理的字节数, 剩余不足一个包或不足以确认
+	// 重新同步的数据留给下一次调用, eof表示之后没有更多数据.
+	bool resync = false;
+	auto process = [&](const uint8_t* data, size_t size, bool eof) -> size_t
+	{
+		size_t pos = 0;
+		while (size - pos >= packet_size) {
+			if (resync) {
+				size_t skipped = 0;
+				bool locked = size - pos > prefix && util::ts_resync(data + pos + prefix,
+					size - pos - prefix, skipped, resync_lock_count, packet_size);
+				// 到达文件末尾后剩余数据不足以确认多个同步字节, 只需要1个即可.
+				if (!locked && eof) {
+					size_t tail = 0;
+					locked = size - pos - skipped > prefix && util::ts_resync(data + pos + skipped + prefix,
+						size - pos - skipped - prefix, tail, 1, packet_size);
+					skipped = locked ? skipped + tail : size - pos;
 				}
-				if (show_frame_pos)
-					std::cout << "pos=" << offset << std::endl;
+				pos += skipped;
+				offset += skipped;
+				skipped_bytes += skipped;
+				if (!locked)
+					break;
+				resync = false;
+				continue;
 			}
 
-			if (show_frame_dts) {
-				if (info.is_video_ && info.dts_ != -1) {
-					std::cout << "dts=" << info.dts_ << std::endl;
-				}
+			size_t count = std::min<size_t>((size - pos) / packet_size, batch_size);
+			size_t n = p.do_parser_batch(data + pos, count, batch);
+
+			for (size_t i = 0; i < n; i++) {
+				report(offset, pids[i], flags[i], picts[i], pcrs[i], ptss[i], dtss[i]);
+				offset += packet_size;
+			}
+			pos += n * packet_size;
+
+			// 第n个包解析失败, 跳过1个字节后重新同步.
+			if (n < count) {
+				pos += 1;
+				offset += 1;
+				skipped_bytes += 1;
+				resync = true;
 			}
+		}
+		return pos;
+	};
 
-			if (show_frame_pts) {
-				if (info.is_video_ && info.pts_ != -1) {
-					std::cout << "pts=" << info.pts_ << std::endl;
+	if (async) {
+		const uint8_t* data = block + first;
+		size_t size = block_size - first;
+		bool more = block_size > 0;
+		while (more) {
+			// 上一块剩余的数据和这一块的开头拼接后解析, 然后直接解析块中的数据.
+			if (buf.size()) {
+				size_t old = buf.size();
+				size_t k = std::min<size_t>(size, packet_size * resync_lock_count * 2);
+				memcpy(buf.prepare(k), data, k);
+				buf.commit(k);
+				size_t used = process(buf.data(), buf.size(), false);
+				if (used >= old) {
+					data += used - old;
+					size -= used - old;
+					buf.consume(buf.size());
+				}
+				else {
+					buf.consume(used);
+					memcpy(buf.prepare(size - k), data + k, size - k);
+					buf.commit(size - k);
+					buf.consume(process(buf.data(), buf.size(), false));
+					size = 0;
 				}
 			}
 
-			if (show_pcr_time && info.pcr_ != -1) {
-				std::cout << "pcr=" << info.pcr_ << std::endl;
+			size_t used = process(data, size, false);
+			if (used < size) {
+				memcpy(buf.prepare(size - used), data + used, size - used);
+				buf.commit(size - used);
 			}
 
-			if (!suc)
-				offset += 1;
-			else
-				offset += 188;
+			ar.release();
+			more = ar.next(block, block_size);
+			data = block;
+			size = block_size;
+		}
+		buf.consume(process(buf.data(), buf.size(), true));
+		if (ar.error())
+			std::cerr << "Read file " << file << " failed" << std::endl;
+	}
+	else if (udp_input) {
+		// 第一批数据报已经在检测包格式时收到.
+		bool more = us.count() > 0;
+		size_t skip = first;
+		while (more) {
+			const util::udp_datagram* d = us.datagrams();
+			for (size_t i = 0; i < us.count(); i++) {
+				process(d[i].data_ + skip, d[i].size_ - skip, true);
+				skip = 0;
+			}
+			int64_t received = us.received();
+			more = us.receive(udp_idle_timeout) >= 0 && us.received() != received;
+		}
+		if (us.rtp_lost())
+			std::cerr << "rtp lost packets: " << us.rtp_lost() << std::endl;
+	}
+	else if (!fp && threads != 1) {
+		// 分段并行解析, 合并后的结果按文件顺序输出.
+		if (threads <= 0)
+			threads = std::max<int>(1, std::thread::hardware_concurrency());
+		util::scan_result result;
+		util::parallel_scan(p, mf.data() + first, mf.size() - first, threads, result);
+		for (const auto& e : result.events_)
+			report(e.pos_ + first, e.pid_, e.flags_, e.pict_type_, e.pcr_, e.pts_, e.dts_);
+		skipped_bytes += result.skipped_bytes_;
+#if CONTINUITY_CHECK
+		// 与顺序解析一样, 只在打开连续性检查时报告.
+		if (result.cc_errors_)
+			std::cerr << "continuity errors: " << result.cc_errors_ << std::endl;
+#endif
+	}
+	else if (!fp) {
+		process(mf.data() + first, mf.size() - first, true);
+	}
+	else {
+		buf.consume(first);
+		while (true) {
+			bool eof = feof(fp) || ferror(fp);
+			buf.consume(process(buf.data(), buf.size(), eof));
+			if (eof)
+				break;
+
+			auto pre = buf.prepare(packet_size * 1000);
+			auto sz = fread(pre, 1, packet_size * 1000, fp);
+			buf.commit(sz);
+		}
+		if (ferror(fp))
+			std::cerr << "Read file " << file << " failed" << std::endl;
+		fclose(fp);
+	}
+	if (skipped_bytes)
+		std::cerr << "resync skipped " << skipped_bytes << " bytes" << std::endl;
+	if (!index_file.empty()) {
+		for (int pid = 0; pid < 0x2000; pid++) {
+			if (p.stream_type(static_cast<uint16_t>(pid)))
+				index.set_stream_type(static_cast<uint16_t>(pid), p.stream_type(static_cast<uint16_t>(pid)));
 		}
+		int64_t source_size = async ? ar.file_size() : ((fp || udp_input) ? offset : static_cast<int64_t>(mf.size()));
+		index.set_indexed_bytes(source_size, source_size);
+		index.save(index_file);
 	}
-	fclose(fp);
 	std::cout << "keyframe count: " << vc << ", frame count " << sc << std::endl;
 	return 0;
 }
@@ -0,0 +1,589 @@
+﻿#include "async_reader.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#if defined(_WIN32)
+#	include <io.h>
+#	include <fcntl.h>
+#	include <malloc.h>
+#	include <sys/stat.h>
+#else
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/stat.h>
+#	include <sys/mman.h>
+#	include <sys/uio.h>
+#	include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#	if __has_include(<linux/io_uring.h>)
+#		include <linux/io_uring.h>
+#		if defined(__NR_io_uring_setup)
+#			define MPEGTS_IO_URING 1
+#		endif
+#	endif
+#endif
+
+namespace util {
+
+	enum { io_alignment = 4096 };
+
+	static uint8_t* aligned_alloc_block(size_t size)
+	{
+#if defined(_WIN32)
+		return static_cast<uint8_t*>(_aligned_malloc(size, io_alignment));
+#else
+		void* p = nullptr;
+		if (posix_memalign(&p, io_alignment, size) != 0)
+			return nullptr;
+		return static_cast<uint8_t*>(p);
+#endif
+	}
+
+	static void aligned_free_block(uint8_t* p)
+	{
+#if defined(_WIN32)
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+
+	// 从offset处读取, 返回读取的字节数, 出错返回-1.
+	static int64_t read_at(int fd, uint8_t* data, size_t size, uint64_t offset)
+	{
+#if defined(_WIN32)
+		// windows下没有pread, 串行执行定位和读取.
+		static std::mutex read_mutex;
+		std::lock_guard<std::mutex> lock(read_mutex);
+		if (_lseeki64(fd, static_cast<int64_t>(offset), SEEK_SET) < 0)
+			return -1;
+		return _read(fd, data, static_cast<unsigned>(size));
+#else
+		ssize_t n;
+		do {
+			n = pread(fd, data, size, static_cast<off_t>(offset));
+		} while (n < 0 && errno == EINTR);
+		return n;
+#endif
+	}
+
+	// 块中下一次读取的起始位置, O_DIRECT要求偏移和缓冲对齐, 不完整的读取从对齐的位置重新读.
+	static inline size_t read_start(size_t filled, bool direct)
+	{
+		return direct ? filled & ~size_t(io_alignment - 1) : filled;
+	}
+
+	async_reader::async_reader()
+		: m_fd(-1)
+		, m_file_size(0)
+		, m_block_size(0)
+		, m_direct(false)
+		, m_next_offset(0)
+		, m_current(0)
+		, m_error(false)
+		, m_uring(false)
+		, m_ring_fd(-1)
+		, m_sq_ptr(nullptr)
+		, m_sq_size(0)
+		, m_cq_ptr(nullptr)
+		, m_cq_size(0)
+		, m_sqes(nullptr)
+		, m_sqes_size(0)
+		, m_sq_head(nullptr)
+		, m_sq_tail(nullptr)
+		, m_sq_mask(nullptr)
+		, m_sq_array(nullptr)
+		, m_cq_head(nullptr)
+		, m_cq_tail(nullptr)
+		, m_cq_mask(nullptr)
+		, m_cqes(nullptr)
+		, m_fixed(false)
+		, m_stop(false)
+	{
+	}
+
+	async_reader::~async_reader()
+	{
+		close();
+	}
+
+	bool async_reader::open(const std::string& file, size_t block_size/* = 1024 * 1024*/,
+		int depth/* = 8*/, bool direct/* = false*/)
+	{
+		close();
+
+		if (depth < 1)
+			depth = 1;
+		m_block_size = (std::max<size_t>(block_size, io_alignment) + io_alignment - 1) & ~size_t(io_alignment - 1);
+		m_direct = false;
+
+#if defined(_WIN32)
+		m_fd = _open(file.c_str(), _O_RDONLY | _O_BINARY);
+		if (m_fd < 0)
+			return false;
+		struct _stat64 st;
+		if (_fstat64(m_fd, &st) != 0)
+		{
+			close();
+			return false;
+		}
+#else
+#if defined(O_DIRECT)
+		if (direct)
+		{
+			// 部分文件系统(如tmpfs)不支持O_DIRECT, 此时使用普通读取.
+			m_fd = ::open(file.c_str(), O_RDONLY | O_DIRECT);
+			m_direct = m_fd >= 0;
+		}
+#endif
+		if (m_fd < 0)
+			m_fd = ::open(file.c_str(), O_RDONLY);
+		if (m_fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(m_fd, &st) != 0)
+		{
+			close();
+			return false;
+		}
+#endif
+		m_file_size = static_cast<uint64_t>(st.st_size);
+
+		m_blocks.resize(depth);
+		for (auto& b : m_blocks)
+		{
+			b.data_ = aligned_alloc_block(m_block_size);
+			b.offset_ = 0;
+			b.size_ = 0;
+			b.filled_ = 0;
+			b.state_ = block::idle;
+			if (!b.data_)
+			{
+				close();
+				return false;
+			}
+		}
+
+		m_uring = uring_init();
+		if (!m_uring)
+			pool_init();
+
+		for (int i = 0; i < depth && m_next_offset < m_file_size; i++)
+			submit(i);
+
+		return true;
+	}
+
+	void async_reader::close()
+	{
+		// 等待进行中的读请求完成后才能释放缓冲.
+		for (size_t i = 0; i < m_blocks.size(); i++)
+			wait(static_cast<int>(i));
+
+		if (m_uring)
+			uring_close();
+		else
+			pool_close();
+
+		for (auto& b : m_blocks)
+			aligned_free_block(b.data_);
+		m_blocks.clear();
+
+		if (m_fd >= 0)
+		{
+#if defined(_WIN32)
+			_close(m_fd);
+#else
+			::close(m_fd);
+#endif
+		}
+
+		m_fd = -1;
+		m_file_size = 0;
+		m_next_offset = 0;
+		m_current = 0;
+		m_error = false;
+		m_uring = false;
+	}
+
+	bool async_reader::next(const uint8_t*& data, size_t& size)
+	{
+		if (m_blocks.empty())
+			return false;
+
+		int index = static_cast<int>(m_current % m_blocks.size());
+		block& b = m_blocks[index];
+		if (!wait(index))
+		{
+			// wait返回后读取已经结束, 块空闲表示文件已经读完.
+			m_error = b.state_ == block::failed;
+			return false;
+		}
+		if (b.filled_ == 0)
+			return false;
+
+		data = b.data_;
+		size = b.filled_;
+		return true;
+	}
+
+	void async_reader::release()
+	{
+		if (m_blocks.empty())
+			return;
+
+		int index = static_cast<int>(m_current % m_blocks.size());
+		m_blocks[index].state_ = block::idle;
+		m_current++;
+		if (m_next_offset < m_file_size)
+			submit(index);
+	}
+
+	bool async_reader::error() const
+	{
+		return m_error;
+	}
+
+	bool async_reader::using_io_uring() const
+	{
+		return m_uring;
+	}
+
+	uint64_t async_reader::file_size() const
+	{
+		return m_file_size;
+	}
+
+	void async_reader::submit(int index)
+	{
+		block& b = m_blocks[index];
+		uint64_t offset = m_next_offset;
+		m_next_offset += m_block_size;
+
+		if (m_uring)
+		{
+			b.offset_ = offset;
+			b.size_ = static_cast<size_t>(std::min<uint64_t>(m_block_size, m_file_size - offset));
+			b.filled_ = 0;
+			b.state_ = block::pending;
+			uring_submit(index);
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		b.offset_ = offset;
+		b.size_ = static_cast<size_t>(std::min<uint64_t>(m_block_size, m_file_size - offset));
+		b.filled_ = 0;
+		b.state_ = block::pending;
+		m_queue.push_back(index);
+		m_cond.notify_all();
+	}
+
+	bool async_reader::wait(int index)
+	{
+		if (m_uring)
+			return uring_wait(index);
+
+		// 线程池模式下state_由读取线程修改, 只能在锁内访问.
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_blocks[index].state_ == block::pending)
+			m_cond.wait(lock);
+		return m_blocks[index].state_ == block::done;
+	}
+
+#if defined(MPEGTS_IO_URING)
+
+	static inline int io_uring_setup(unsigned entries, io_uring_params* p)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+	}
+
+	static inline int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+	}
+
+	static inline int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+	}
+
+	bool async_reader::uring_init()
+	{
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		int fd = io_uring_setup(static_cast<unsigned>(m_blocks.size()), &p);
+		if (fd < 0)
+			return false;
+		m_ring_fd = fd;
+
+		m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = !!(p.features & IORING_FEAT_SINGLE_MMAP);
+		if (single_mmap)
+			m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+
+		void* sq = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (sq == MAP_FAILED)
+		{
+			uring_close();
+			return false;
+		}
+		m_sq_ptr = sq;
+
+		if (single_mmap)
+		{
+			m_cq_ptr = sq;
+		}
+		else
+		{
+			void* cq = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			if (cq == MAP_FAILED)
+			{
+				uring_close();
+				return false;
+			}
+			m_cq_ptr = cq;
+		}
+
+		m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+		void* sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+		{
+			uring_close();
+			return false;
+		}
+		m_sqes = sqes;
+
+		uint8_t* sq_base = static_cast<uint8_t*>(m_sq_ptr);
+		uint8_t* cq_base = static_cast<uint8_t*>(m_cq_ptr);
+		m_sq_head = reinterpret_cast<unsigned*>(sq_base + p.sq_off.head);
+		m_sq_tail = reinterpret_cast<unsigned*>(sq_base + p.sq_off.tail);
+		m_sq_mask = reinterpret_cast<unsigned*>(sq_base + p.sq_off.ring_mask);
+		m_sq_array = reinterpret_cast<unsigned*>(sq_base + p.sq_off.array);
+		m_cq_head = reinterpret_cast<unsigned*>(cq_base + p.cq_off.head);
+		m_cq_tail = reinterpret_cast<unsigned*>(cq_base + p.cq_off.tail);
+		m_cq_mask = reinterpret_cast<unsigned*>(cq_base + p.cq_off.ring_mask);
+		m_cqes = cq_base + p.cq_off.cqes;
+
+		// 注册缓冲可以省去每次读取时的页面固定, 受RLIMIT_MEMLOCK限制可能失败.
+		std::vector<iovec> iov(m_blocks.size());
+		for (size_t i = 0; i < m_blocks.size(); i++)
+		{
+			iov[i].iov_base = m_blocks[i].data_;
+			iov[i].iov_len = m_block_size;
+		}
+		m_fixed = io_uring_register(fd, IORING_REGISTER_BUFFERS, iov.data(), static_cast<unsigned>(iov.size())) == 0;
+
+		return true;
+	}
+
+	void async_reader::uring_close()
+	{
+		if (m_sqes)
+			munmap(m_sqes, m_sqes_size);
+		if (m_cq_ptr && m_cq_ptr != m_sq_ptr)
+			munmap(m_cq_ptr, m_cq_size);
+		if (m_sq_ptr)
+			munmap(m_sq_ptr, m_sq_size);
+		if (m_ring_fd >= 0)
+			::close(m_ring_fd);
+
+		m_ring_fd = -1;
+		m_sq_ptr = nullptr;
+		m_cq_ptr = nullptr;
+		m_sqes = nullptr;
+		m_cqes = nullptr;
+		m_fixed = false;
+	}
+
+	void async_reader::uring_submit(int index)
+	{
+		block& b = m_blocks[index];
+
+		// 只有当前线程提交, 每个块最多一个请求, 提交队列不会满.
+		unsigned tail = *m_sq_tail;
+		unsigned slot = tail & *m_sq_mask;
+		io_uring_sqe* sqe = static_cast<io_uring_sqe*>(m_sqes) + slot;
+		memset(sqe, 0, sizeof(*sqe));
+
+		size_t start = read_start(b.filled_, m_direct);
+		size_t length = b.size_ - start;
+		if (m_direct)
+			length = (length + io_alignment - 1) & ~size_t(io_alignment - 1);
+
+		sqe->opcode = m_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->fd = m_fd;
+		sqe->off = b.offset_ + start;
+		sqe->addr = reinterpret_cast<uint64_t>(b.data_ + start);
+		sqe->len = static_cast<uint32_t>(length);
+		sqe->buf_index = static_cast<uint16_t>(index);
+		sqe->user_data = static_cast<uint64_t>(index);
+
+		m_sq_array[slot] = slot;
+		__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+		// 立即提交, 在解析当前块的同时进行读取.
+		while (io_uring_enter(m_ring_fd, 1, 0, 0) < 0 && errno == EINTR)
+			;
+	}
+
+	bool async_reader::uring_wait(int index)
+	{
+		block& b = m_blocks[index];
+		while (b.state_ == block::pending)
+		{
+			unsigned head = *m_cq_head;
+			unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+			unsigned mask = *m_cq_mask;
+			for (; head != tail; head++)
+			{
+				const io_uring_cqe* cqe = static_cast<const io_uring_cqe*>(m_cqes) + (head & mask);
+				int completed = static_cast<int>(cqe->user_data);
+				int result = cqe->res;
+				__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+				uring_complete(completed, result);
+			}
+
+			if (b.state_ != block::pending)
+				break;
+
+			if (io_uring_enter(m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			{
+				b.state_ = block::failed;
+				return false;
+			}
+		}
+
+		return b.state_ == block::done;
+	}
+
+	void async_reader::uring_complete(int index, int result)
+	{
+		block& b = m_blocks[index];
+		if (result == -EAGAIN || result == -EINTR)
+		{
+			uring_submit(index);
+			return;
+		}
+		if (result < 0)
+		{
+			b.state_ = block::failed;
+			return;
+		}
+
+		size_t start = read_start(b.filled_, m_direct);
+		if (start + static_cast<size_t>(result) <= b.filled_)
+		{
+			// 没有读到新的数据表示文件在打开后被截断.
+			b.state_ = block::done;
+			return;
+		}
+		b.filled_ = std::min(b.size_, start + static_cast<size_t>(result));
+		if (b.filled_ == b.size_)
+		{
+			b.state_ = block::done;
+			return;
+		}
+
+		// 读取不完整, 继续读取剩余部分.
+		uring_submit(index);
+	}
+
+#else
+
+	bool async_reader::uring_init()
+	{
+		return false;
+	}
+
+	void async_reader::uring_close()
+	{
+	}
+
+	void async_reader::uring_submit(int)
+	{
+	}
+
+	bool async_reader::uring_wait(int)
+	{
+		return false;
+	}
+
+	void async_reader::uring_complete(int, int)
+	{
+	}
+
+#endif
+
+	void async_reader::pool_init()
+	{
+		m_stop = false;
+		size_t threads = std::min<size_t>(m_blocks.size(), 4);
+		for (size_t i = 0; i < threads; i++)
+			m_threads.emplace_back(&async_reader::pool_worker, this);
+	}
+
+	void async_reader::pool_close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+			m_cond.notify_all();
+		}
+		for (auto& t : m_threads)
+			t.join();
+		m_threads.clear();
+		m_queue.clear();
+	}
+
+	void async_reader::pool_worker()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			while (m_queue.empty() && !m_stop)
+				m_cond.wait(lock);
+			if (m_stop)
+				return;
+
+			int index = m_queue.front();
+			m_queue.erase(m_queue.begin());
+			block& b = m_blocks[index];
+			uint8_t* data = b.data_;
+			uint64_t offset = b.offset_;
+			size_t size = b.size_;
+			lock.unlock();
+
+			size_t filled = 0;
+			bool failed = false;
+			while (filled < size)
+			{
+				size_t start = read_start(filled, m_direct);
+				size_t length = size - start;
+				if (m_direct)
+					length = (length + io_alignment - 1) & ~size_t(io_alignment - 1);
+				int64_t n = read_at(m_fd, data + start, length, offset + start);
+				if (n < 0)
+				{
+					failed = true;
+					break;
+				}
+				// 没有读到新的数据表示文件在打开后被截断.
+				if (start + static_cast<size_t>(n) <= filled)
+					break;
+				filled = std::min(size, start + static_cast<size_t>(n));
+			}
+
+			lock.lock();
+			b.filled_ = filled;
+			b.state_ = failed ? block::failed : block::done;
+			m_cond.notify_all();
+		}
+	}
+
+}
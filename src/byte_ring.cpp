@@ -0,0 +1,178 @@
+﻿#include "byte_ring.hpp"
+
+namespace util {
+
+	byte_ring::byte_ring(size_t capacity)
+		: m_buffer(capacity)
+		, m_capacity(capacity)
+		, m_closed(false)
+		, m_read(0)
+		, m_consumer_waiting(false)
+		, m_write(0)
+		, m_watermark(0)
+		, m_producer_waiting(false)
+		, m_reserve(0)
+	{
+	}
+
+	byte_ring::~byte_ring()
+	{
+	}
+
+	uint8_t* byte_ring::prepare(size_t n)
+	{
+		size_t w = m_write.load(std::memory_order_relaxed);
+		size_t r = m_read.load(std::memory_order_acquire);
+
+		if (w >= r)
+		{
+			// 没有绕回, 空闲空间为[w, capacity)和[0, r - 1).
+			if (m_capacity - w >= n)
+			{
+				m_reserve = w;
+				return &m_buffer[w];
+			}
+			// 从头开始写时至少保留1字节, 避免写位置追上读位置后无法区分空和满.
+			if (r > n)
+			{
+				m_reserve = 0;
+				return &m_buffer[0];
+			}
+			return nullptr;
+		}
+
+		// 已经绕回, 空闲空间为[w, r - 1).
+		if (r - w > n)
+		{
+			m_reserve = w;
+			return &m_buffer[w];
+		}
+		return nullptr;
+	}
+
+	void byte_ring::commit(size_t n)
+	{
+		size_t w = m_write.load(std::memory_order_relaxed);
+		if (m_reserve != w)
+		{
+			// 从头开始写, 先记录尾部数据的结束位置.
+			m_watermark.store(w, std::memory_order_relaxed);
+			w = 0;
+		}
+		m_write.store(w + n, std::memory_order_release);
+		notify(m_consumer_waiting);
+	}
+
+	bool byte_ring::wait_space(size_t n)
+	{
+		// 超过一半容量时即使缓冲为空也可能没有足够的连续空间.
+		if (n > m_capacity / 2)
+			return false;
+		if (prepare(n))
+			return true;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_producer_waiting.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while (!prepare(n) && !m_closed)
+			m_cond.wait(lock);
+		m_producer_waiting.store(false);
+		return !m_closed;
+	}
+
+	void byte_ring::close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = true;
+		m_cond.notify_all();
+	}
+
+	const uint8_t* byte_ring::data()
+	{
+		size_t begin = 0;
+		readable(begin);
+		return &m_buffer[begin];
+	}
+
+	size_t byte_ring::size()
+	{
+		size_t begin = 0;
+		return readable(begin);
+	}
+
+	void byte_ring::consume(size_t n)
+	{
+		size_t begin = 0;
+		readable(begin);
+		m_read.store(begin + n, std::memory_order_release);
+		notify(m_producer_waiting);
+	}
+
+	bool byte_ring::wait_data(size_t n)
+	{
+		// 生产者绕回后尾部的数据不会再增加, 只按尾部计算时可能永远等不到n字节.
+		if (available() >= n)
+			return true;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_consumer_waiting.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while (available() < n && !m_closed)
+			m_cond.wait(lock);
+		m_consumer_waiting.store(false);
+		return available() >= n;
+	}
+
+	bool byte_ring::closed() const
+	{
+		return m_closed;
+	}
+
+	size_t byte_ring::capacity() const
+	{
+		return m_capacity;
+	}
+
+	size_t byte_ring::readable(size_t& begin)
+	{
+		size_t r = m_read.load(std::memory_order_relaxed);
+		size_t w = m_write.load(std::memory_order_acquire);
+		if (w >= r)
+		{
+			begin = r;
+			return w - r;
+		}
+
+		// 生产者已经绕回, 先读到m_watermark, 读完后从头开始.
+		size_t watermark = m_watermark.load(std::memory_order_relaxed);
+		if (r == watermark)
+		{
+			m_read.store(0, std::memory_order_release);
+			begin = 0;
+			return w;
+		}
+		begin = r;
+		return watermark - r;
+	}
+
+	size_t byte_ring::available() const
+	{
+		size_t r = m_read.load(std::memory_order_relaxed);
+		size_t w = m_write.load(std::memory_order_acquire);
+		if (w >= r)
+			return w - r;
+		return m_watermark.load(std::memory_order_relaxed) - r + w;
+	}
+
+	void byte_ring::notify(std::atomic<bool>& waiting)
+	{
+		// 只有对方在等待时才使用锁, 与等待方的fence配合避免丢失唤醒.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_cond.notify_all();
+		}
+	}
+
+}
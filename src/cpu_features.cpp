@@ -0,0 +1,78 @@
+﻿#include "cpu_features.hpp"
+#include <cstdint>
+
+#if defined(MPEGTS_X86)
+#	if defined(_MSC_VER)
+#		include <intrin.h>
+#	else
+#		include <cpuid.h>
+#	endif
+#endif
+
+namespace util {
+
+#if defined(MPEGTS_X86)
+	static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+	{
+#if defined(_MSC_VER)
+		int r[4];
+		__cpuidex(r, static_cast<int>(leaf), static_cast<int>(subleaf));
+		for (int i = 0; i < 4; i++)
+			regs[i] = static_cast<uint32_t>(r[i]);
+#else
+		__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	}
+
+	static inline uint64_t xgetbv0()
+	{
+#if defined(_MSC_VER)
+		return _xgetbv(0);
+#else
+		uint32_t eax, edx;
+		__asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+	}
+#endif
+
+	static cpu_features detect_cpu_features()
+	{
+		cpu_features f = { false, false, false, false, false, false };
+
+#if defined(MPEGTS_X86)
+		uint32_t regs[4];
+		cpuid(0, 0, regs);
+		uint32_t max_leaf = regs[0];
+		if (max_leaf < 1)
+			return f;
+
+		cpuid(1, 0, regs);
+		f.sse2 = !!(regs[3] & (1u << 26));
+		f.ssse3 = !!(regs[2] & (1u << 9));
+		f.sse41 = !!(regs[2] & (1u << 19));
+		f.pclmul = !!(regs[2] & (1u << 1));
+
+		// avx/avx512需要操作系统保存对应的寄存器状态.
+		bool osxsave = !!(regs[2] & (1u << 27));
+		uint64_t xcr0 = osxsave ? xgetbv0() : 0;
+		bool os_avx = (xcr0 & 0x6) == 0x6;
+		bool os_avx512 = (xcr0 & 0xe6) == 0xe6;
+
+		if (max_leaf >= 7)
+		{
+			cpuid(7, 0, regs);
+			f.avx2 = os_avx && !!(regs[1] & (1u << 5));
+			f.avx512bw = os_avx512 && !!(regs[1] & (1u << 16)) && !!(regs[1] & (1u << 30));
+		}
+#endif
+
+		return f;
+	}
+
+	const cpu_features& get_cpu_features()
+	{
+		static const cpu_features features = detect_cpu_features();
+		return features;
+	}
+}
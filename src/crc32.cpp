@@ -0,0 +1,241 @@
+﻿#include "crc32.hpp"
+#include "cpu_features.hpp"
+
+#if defined(MPEGTS_X86)
+#	include <immintrin.h>
+#endif
+
+namespace util {
+
+	static const uint32_t static_crc_table[256] = {
+		0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9,
+		0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
+		0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
+		0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd,
+		0x4c11db70, 0x48d0c6c7, 0x4593e01e, 0x4152fda9,
+		0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
+		0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011,
+		0x791d4014, 0x7ddc5da3, 0x709f7b7a, 0x745e66cd,
+		0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
+		0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5,
+		0xbe2b5b58, 0xbaea46ef, 0xb7a96036, 0xb3687d81,
+		0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
+		0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49,
+		0xc7361b4c, 0xc3f706fb, 0xceb42022, 0xca753d95,
+		0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
+		0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d,
+		0x34867077, 0x30476dc0, 0x3d044b19, 0x39c556ae,
+		0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
+		0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16,
+		0x018aeb13, 0x054bf6a4, 0x0808d07d, 0x0cc9cdca,
+		0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
+		0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02,
+		0x5e9f46bf, 0x5a5e5b08, 0x571d7dd1, 0x53dc6066,
+		0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
+		0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e,
+		0xbfa1b04b, 0xbb60adfc, 0xb6238b25, 0xb2e29692,
+		0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
+		0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a,
+		0xe0b41de7, 0xe4750050, 0xe9362689, 0xedf73b3e,
+		0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
+		0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686,
+		0xd5b88683, 0xd1799b34, 0xdc3abded, 0xd8fba05a,
+		0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
+		0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb,
+		0x4f040d56, 0x4bc510e1, 0x46863638, 0x42472b8f,
+		0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
+		0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47,
+		0x36194d42, 0x32d850f5, 0x3f9b762c, 0x3b5a6b9b,
+		0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
+		0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623,
+		0xf12f560e, 0xf5ee4bb9, 0xf8ad6d60, 0xfc6c70d7,
+		0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
+		0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f,
+		0xc423cd6a, 0xc0e2d0dd, 0xcda1f604, 0xc960ebb3,
+		0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
+		0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b,
+		0x9b3660c6, 0x9ff77d71, 0x92b45ba8, 0x9675461f,
+		0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
+		0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640,
+		0x4e8ee645, 0x4a4ffbf2, 0x470cdd2b, 0x43cdc09c,
+		0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
+		0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24,
+		0x119b4be9, 0x155a565e, 0x18197087, 0x1cd86d30,
+		0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
+		0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088,
+		0x2497d08d, 0x2056cd3a, 0x2d15ebe3, 0x29d4f654,
+		0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
+		0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c,
+		0xe3a1cbc1, 0xe760d676, 0xea23f0af, 0xeee2ed18,
+		0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
+		0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0,
+		0x9abc8bd5, 0x9e7d9662, 0x933eb0bb, 0x97ffad0c,
+		0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
+		0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
+	};
+
+	// slicing-by-8查表, crc_tables[k][b]为字节b后跟k个0字节的crc.
+	struct crc32_slicing_tables
+	{
+		crc32_slicing_tables()
+		{
+			for (int b = 0; b < 256; b++)
+				table[0][b] = static_crc_table[b];
+			for (int k = 1; k < 8; k++)
+			{
+				for (int b = 0; b < 256; b++)
+				{
+					uint32_t crc = table[k - 1][b];
+					table[k][b] = (crc << 8) ^ static_crc_table[crc >> 24];
+				}
+			}
+		}
+
+		uint32_t table[8][256];
+	};
+
+	static const crc32_slicing_tables& slicing_tables()
+	{
+		static const crc32_slicing_tables tables;
+		return tables;
+	}
+
+	static inline uint32_t crc32_bytewise(uint32_t crc, const uint8_t* data, size_t len)
+	{
+		for (size_t i = 0; i < len; i++)
+			crc = (crc << 8) ^ static_crc_table[(crc >> 24) ^ data[i]];
+		return crc;
+	}
+
+	static uint32_t crc32_slicing8(uint32_t crc, const uint8_t* data, size_t len)
+	{
+		const uint32_t (*t)[256] = slicing_tables().table;
+
+		for (; len >= 8; len -= 8, data += 8)
+		{
+			uint32_t one = crc ^ ((uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+				(uint32_t)data[2] << 8 | data[3]);
+			crc = t[7][one >> 24] ^ t[6][(one >> 16) & 0xff] ^
+				t[5][(one >> 8) & 0xff] ^ t[4][one & 0xff] ^
+				t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+		}
+
+		return crc32_bytewise(crc, data, len);
+	}
+
+#if defined(MPEGTS_X86)
+
+	// x^n mod P, 用于计算折叠常数.
+	static uint64_t crc32_xpow_mod(int n)
+	{
+		uint64_t r = 1;
+		while (n--)
+		{
+			r <<= 1;
+			if (r & 0x100000000ull)
+				r ^= 0x104c11db7ull;
+		}
+		return r;
+	}
+
+	struct crc32_fold_constants
+	{
+		crc32_fold_constants()
+			: fold128_lo(crc32_xpow_mod(128))
+			, fold128_hi(crc32_xpow_mod(128 + 64))
+			, fold512_lo(crc32_xpow_mod(512))
+			, fold512_hi(crc32_xpow_mod(512 + 64))
+		{}
+
+		uint64_t fold128_lo;
+		uint64_t fold128_hi;
+		uint64_t fold512_lo;
+		uint64_t fold512_hi;
+	};
+
+	static const crc32_fold_constants& fold_constants()
+	{
+		static const crc32_fold_constants constants;
+		return constants;
+	}
+
+	// 将128位累加值A折叠到后面的数据上: A(x) * x^n mod P, 结果不超过95位.
+	MPEGTS_TARGET("pclmul,ssse3")
+	static inline __m128i crc32_fold(__m128i acc, __m128i k)
+	{
+		return _mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x11),
+			_mm_clmulepi64_si128(acc, k, 0x00));
+	}
+
+	// 按多项式的高位在前装载16字节, 即第一个字节位于第127..120位.
+	MPEGTS_TARGET("pclmul,ssse3")
+	static inline __m128i crc32_load(const uint8_t* data, __m128i bswap)
+	{
+		return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), bswap);
+	}
+
+	// 按16字节块做无进位乘法折叠, 最后16字节的累加值和不足16字节的尾部用查表完成.
+	MPEGTS_TARGET("pclmul,ssse3")
+	static uint32_t crc32_pclmul(uint32_t crc, const uint8_t* data, size_t len)
+	{
+		if (len < 64)
+			return crc32_slicing8(crc, data, len);
+
+		const crc32_fold_constants& c = fold_constants();
+		const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+		const __m128i k512 = _mm_set_epi64x(c.fold512_hi, c.fold512_lo);
+		const __m128i k128 = _mm_set_epi64x(c.fold128_hi, c.fold128_lo);
+
+		// 初值与前4个字节异或.
+		__m128i x0 = _mm_xor_si128(crc32_load(data, bswap),
+			_mm_set_epi32(static_cast<int>(crc), 0, 0, 0));
+		__m128i x1 = crc32_load(data + 16, bswap);
+		__m128i x2 = crc32_load(data + 32, bswap);
+		__m128i x3 = crc32_load(data + 48, bswap);
+		data += 64;
+		len -= 64;
+
+		// 4路并行, 每次处理64字节.
+		for (; len >= 64; len -= 64, data += 64)
+		{
+			x0 = _mm_xor_si128(crc32_fold(x0, k512), crc32_load(data, bswap));
+			x1 = _mm_xor_si128(crc32_fold(x1, k512), crc32_load(data + 16, bswap));
+			x2 = _mm_xor_si128(crc32_fold(x2, k512), crc32_load(data + 32, bswap));
+			x3 = _mm_xor_si128(crc32_fold(x3, k512), crc32_load(data + 48, bswap));
+		}
+
+		// 合并为1路.
+		x0 = _mm_xor_si128(crc32_fold(x0, k128), x1);
+		x0 = _mm_xor_si128(crc32_fold(x0, k128), x2);
+		x0 = _mm_xor_si128(crc32_fold(x0, k128), x3);
+
+		for (; len >= 16; len -= 16, data += 16)
+			x0 = _mm_xor_si128(crc32_fold(x0, k128), crc32_load(data, bswap));
+
+		// 剩余的128位多项式A, 以0为初值查表即得 A * x^32 mod P.
+		uint8_t rest[16];
+		_mm_storeu_si128((__m128i*)rest, _mm_shuffle_epi8(x0, bswap));
+		crc = crc32_slicing8(0, rest, sizeof(rest));
+
+		return crc32_slicing8(crc, data, len);
+	}
+
+#endif // MPEGTS_X86
+
+	uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len)
+	{
+		typedef uint32_t (*crc32_fn)(uint32_t, const uint8_t*, size_t);
+		static const crc32_fn crc32_impl =
+#if defined(MPEGTS_X86)
+			(get_cpu_features().pclmul && get_cpu_features().ssse3) ? crc32_pclmul :
+#endif
+			crc32_slicing8;
+
+		return crc32_impl(crc, data, len);
+	}
+
+	uint32_t crc32(const uint8_t* data, size_t len)
+	{
+		return crc32_update(0xffffffff, data, len);
+	}
+}
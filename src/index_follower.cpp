@@ -0,0 +1,412 @@
+﻿#include "index_follower.hpp"
+#include "resync.hpp"
+#include "state_blob.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <thread>
+#include <chrono>
+
+#if defined(_WIN32)
+#	include <sys/types.h>
+#	include <sys/stat.h>
+#else
+#	include <sys/types.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#	include <sys/inotify.h>
+#	include <poll.h>
+#endif
+
+namespace util {
+
+	enum
+	{
+		follow_lock_count = 3,				// 重新同步时需要确认的连续同步字节数.
+		follow_batch_size = 1000,
+		follow_read_size = 1024 * 1024,
+		follow_bootstrap_limit = 16 * 1024 * 1024,	// 读取PAT/PMT最多读取的字节数.
+	};
+
+	static const char follower_state_magic[4] = { 'M', 'T', 'S', 'F' };
+	static const uint32_t follower_state_version = 1;
+
+	static int64_t file_size(const std::string& file)
+	{
+#if defined(_WIN32)
+		struct _stat64 st;
+		if (_stat64(file.c_str(), &st) != 0)
+			return -1;
+#else
+		struct stat st;
+		if (stat(file.c_str(), &st) != 0)
+			return -1;
+#endif
+		return st.st_size;
+	}
+
+	static bool file_seek(FILE* fp, int64_t offset)
+	{
+#if defined(_WIN32)
+		return _fseeki64(fp, offset, SEEK_SET) == 0;
+#else
+		return fseeko(fp, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+	}
+
+	index_follower::index_follower()
+		: m_fp(nullptr)
+		, m_parser(new mpegts_parser)
+		, m_read_offset(0)
+		, m_parsed_offset(0)
+		, m_packet_size(0)
+		, m_resync(false)
+		, m_stop(false)
+		, m_pids(follow_batch_size)
+		, m_flags(follow_batch_size)
+		, m_picts(follow_batch_size)
+		, m_pcrs(follow_batch_size)
+		, m_ptss(follow_batch_size)
+		, m_dtss(follow_batch_size)
+	{
+		m_batch.pid_ = m_pids.data();
+		m_batch.flags_ = m_flags.data();
+		m_batch.pict_type_ = m_picts.data();
+		m_batch.pcr_ = m_pcrs.data();
+		m_batch.pts_ = m_ptss.data();
+		m_batch.dts_ = m_dtss.data();
+	}
+
+	index_follower::~index_follower()
+	{
+		close();
+	}
+
+	bool index_follower::open(const std::string& file, const std::string& index_file)
+	{
+		close();
+
+		m_fp = fopen(file.c_str(), "rb");
+		if (!m_fp)
+		{
+			std::cerr << "Can't open file " << file << std::endl;
+			return false;
+		}
+		m_file = file;
+		m_index_file = index_file;
+		reset();
+
+		// 已有的索引对应的文件没有被截断时, 从索引的位置继续.
+		int64_t size = file_size(file);
+		if (m_builder.load(index_file) && m_builder.indexed_bytes() > 0 &&
+			m_builder.indexed_bytes() <= size && (load_state() || bootstrap()))
+		{
+			m_read_offset = m_parsed_offset = m_builder.indexed_bytes();
+			if (file_seek(m_fp, m_read_offset))
+				return true;
+		}
+
+		// 从头建立.
+		reset();
+		file_seek(m_fp, 0);
+		return true;
+	}
+
+	void index_follower::close()
+	{
+		if (m_fp)
+			fclose(m_fp);
+		m_fp = nullptr;
+	}
+
+	void index_follower::reset()
+	{
+		m_parser.reset(new mpegts_parser);
+		m_builder.clear();
+		m_buffer.clear();
+		m_read_offset = 0;
+		m_parsed_offset = 0;
+		m_packet_size = 0;
+		m_resync = false;
+	}
+
+	bool index_follower::bootstrap()
+	{
+		// 从文件开头读取PAT/PMT, 恢复流信息和包格式.
+		int packet_size = m_builder.packet_size();
+		if (!m_parser->set_packet_size(packet_size))
+			return false;
+		m_packet_size = packet_size;
+
+		std::vector<uint8_t> head(follow_bootstrap_limit);
+		if (!file_seek(m_fp, 0))
+			return false;
+		size_t n = fread(head.data(), 1, head.size(), m_fp);
+		size_t first = 0;
+		detect_packet_size(head.data(), n, &first);
+
+		mpegts_parser probe;
+		probe.set_packet_size(packet_size);
+		for (size_t pos = first; pos + packet_size <= n && !probe.stream_info_ready(); pos += packet_size)
+		{
+			mpegts_info info;
+			probe.do_parser(head.data() + pos, info);
+		}
+		if (!probe.stream_info_ready())
+			return false;
+
+		m_parser->copy_stream_info(probe);
+		m_resync = true;
+		return true;
+	}
+
+	bool index_follower::load_state()
+	{
+		std::string file = m_index_file + ".state";
+		FILE* fp = fopen(file.c_str(), "rb");
+		if (!fp)
+			return false;
+		std::vector<uint8_t> data;
+		uint8_t chunk[64 * 1024];
+		size_t n;
+		while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+			data.insert(data.end(), chunk, chunk + n);
+		fclose(fp);
+
+		// 快照必须与索引记录的位置一致, 否则只使用索引.
+		blob_reader r(data.data(), data.size());
+		char magic[4];
+		std::vector<uint8_t> parser;
+		if (!r.get_raw(magic, sizeof(magic)) ||
+			std::memcmp(magic, follower_state_magic, sizeof(magic)) != 0 ||
+			r.get_u32() != follower_state_version ||
+			r.get_i64() != m_builder.indexed_bytes())
+			return false;
+		bool resync = r.get_u8() != 0;
+		if (!r.get_bytes(parser, data.size()) || r.remaining() ||
+			!m_parser->restore(parser.data(), parser.size()) ||
+			m_parser->packet_size() != m_builder.packet_size())
+		{
+			m_parser.reset(new mpegts_parser);
+			return false;
+		}
+
+		m_packet_size = m_builder.packet_size();
+		m_resync = resync;
+		m_builder.continue_entries();
+		return true;
+	}
+
+	bool index_follower::save_state()
+	{
+		std::vector<uint8_t> parser;
+		m_parser->snapshot(parser);
+
+		std::vector<uint8_t> data;
+		blob_writer w(data);
+		w.put_raw(follower_state_magic, sizeof(follower_state_magic));
+		w.put_u32(follower_state_version);
+		w.put_i64(m_parsed_offset);
+		w.put_u8(m_resync ? 1 : 0);
+		w.put_bytes(parser.data(), parser.size());
+
+		std::string file = m_index_file + ".state";
+		std::string tmp = file + ".tmp";
+		FILE* fp = fopen(tmp.c_str(), "wb");
+		if (!fp)
+		{
+			std::cerr << "Can't create state file " << tmp << std::endl;
+			return false;
+		}
+		bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+		ok = fclose(fp) == 0 && ok;
+#if defined(_WIN32)
+		if (ok)
+			remove(file.c_str());
+#endif
+		if (!ok || rename(tmp.c_str(), file.c_str()) != 0)
+		{
+			std::cerr << "Write state file " << file << " failed" << std::endl;
+			remove(tmp.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	int64_t index_follower::update()
+	{
+		if (!m_fp)
+			return -1;
+
+		int64_t size = file_size(m_file);
+		if (size < 0)
+			return -1;
+
+		// 文件被截断或替换, 重新建立.
+		if (size < m_read_offset)
+		{
+			reset();
+			if (!file_seek(m_fp, 0))
+				return -1;
+		}
+
+		size_t before = m_builder.entry_count();
+		int64_t parsed = m_parsed_offset;
+		while (m_read_offset < size)
+		{
+			size_t want = static_cast<size_t>(std::min<int64_t>(size - m_read_offset, follow_read_size));
+			uint8_t* p = m_buffer.prepare(want);
+			size_t n = fread(p, 1, want, m_fp);
+			m_buffer.commit(n);
+			m_read_offset += n;
+			if (n == 0)
+			{
+				// 到达当前文件末尾, 清除标志后下次可以继续读.
+				clearerr(m_fp);
+				break;
+			}
+
+			size_t used = process(m_buffer.data(), m_buffer.size());
+			m_buffer.consume(used);
+			m_parsed_offset += used;
+		}
+
+		size_t added = m_builder.entry_count() - before;
+		if ((m_parsed_offset != parsed || added) && !save())
+			return -1;
+
+		return static_cast<int64_t>(added);
+	}
+
+	size_t index_follower::process(const uint8_t* data, size_t size)
+	{
+		// 根据开始部分的数据检测包格式, 检测到后跳过开头的无效数据继续解析.
+		size_t pos = 0;
+		if (!m_packet_size)
+		{
+			int detected = detect_packet_size(data, size, &pos);
+			if (!detected && size < follow_bootstrap_limit)
+				return 0;
+			m_packet_size = detected ? detected : ts_packet_188;
+			m_parser->set_packet_size(m_packet_size);
+			m_builder.set_packet_size(m_packet_size);
+		}
+
+		size_t packet_size = m_packet_size;
+		size_t prefix = ts_packet_prefix(m_packet_size);
+		while (size - pos >= packet_size)
+		{
+			if (m_resync)
+			{
+				// 文件还在增长, 数据不足以确认同步时等待更多数据.
+				size_t skipped = 0;
+				bool locked = size - pos > prefix && ts_resync(data + pos + prefix,
+					size - pos - prefix, skipped, follow_lock_count, packet_size);
+				pos += skipped;
+				if (!locked)
+					break;
+				m_resync = false;
+				continue;
+			}
+
+			size_t count = std::min<size_t>((size - pos) / packet_size, follow_batch_size);
+			size_t n = m_parser->do_parser_batch(data + pos, count, m_batch);
+			for (size_t i = 0; i < n; i++)
+			{
+				int64_t offset = m_parsed_offset + static_cast<int64_t>(pos + i * packet_size);
+				m_builder.push(offset, m_pids[i], m_flags[i], m_picts[i], m_pcrs[i], m_ptss[i], m_dtss[i]);
+			}
+			pos += n * packet_size;
+
+			// 第n个包解析失败, 跳过1个字节后重新同步.
+			if (n < count)
+			{
+				pos += 1;
+				m_resync = true;
+			}
+		}
+		return pos;
+	}
+
+	bool index_follower::save()
+	{
+		for (int pid = 0; pid < 0x2000; pid++)
+		{
+			uint8_t type = m_parser->stream_type(static_cast<uint16_t>(pid));
+			if (type)
+				m_builder.set_stream_type(static_cast<uint16_t>(pid), type);
+		}
+		m_builder.set_indexed_bytes(m_parsed_offset, m_read_offset);
+		// 先保存快照再保存索引, 两者位置不一致时快照不会被使用.
+		return save_state() && m_builder.append(m_index_file);
+	}
+
+	bool index_follower::follow(int interval)
+	{
+		m_stop = false;
+		if (update() < 0)
+			return false;
+
+#if defined(__linux__)
+		// 文件被修改时立即更新, 超时后也检查一次, 以防文件被替换后监视失效.
+		int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd >= 0 && inotify_add_watch(fd, m_file.c_str(), IN_MODIFY | IN_CLOSE_WRITE) < 0)
+		{
+			::close(fd);
+			fd = -1;
+		}
+		while (!m_stop)
+		{
+			if (fd >= 0)
+			{
+				struct pollfd pfd = { fd, POLLIN, 0 };
+				if (poll(&pfd, 1, interval) > 0)
+				{
+					char events[4096];
+					while (read(fd, events, sizeof(events)) > 0)
+						;
+				}
+			}
+			else
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+			}
+			if (!m_stop && update() < 0)
+			{
+				if (fd >= 0)
+					::close(fd);
+				return false;
+			}
+		}
+		if (fd >= 0)
+			::close(fd);
+#else
+		while (!m_stop)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+			if (!m_stop && update() < 0)
+				return false;
+		}
+#endif
+		return true;
+	}
+
+	void index_follower::stop()
+	{
+		m_stop = true;
+	}
+
+	int64_t index_follower::indexed_bytes() const
+	{
+		return m_parsed_offset;
+	}
+
+	const index_builder& index_follower::builder() const
+	{
+		return m_builder;
+	}
+
+}
@@ -0,0 +1,187 @@
+﻿#include "mapped_file.hpp"
+
+#if defined(_WIN32)
+#	include <windows.h>
+#else
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+#endif
+
+namespace util {
+
+	mapped_file::mapped_file()
+		: m_data(nullptr)
+		, m_size(0)
+		, m_open(false)
+#if defined(_WIN32)
+		, m_file(INVALID_HANDLE_VALUE)
+		, m_mapping(nullptr)
+#else
+		, m_fd(-1)
+#endif
+	{
+	}
+
+	mapped_file::~mapped_file()
+	{
+		close();
+	}
+
+#if defined(_WIN32)
+
+	bool mapped_file::open(const std::string& file)
+	{
+		close();
+
+		HANDLE h = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (h == INVALID_HANDLE_VALUE)
+			return false;
+		m_file = h;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(h, &size) || static_cast<uint64_t>(size.QuadPart) > SIZE_MAX)
+		{
+			close();
+			return false;
+		}
+
+		m_open = true;
+		m_size = static_cast<size_t>(size.QuadPart);
+		if (m_size == 0)
+			return true;
+
+		m_mapping = CreateFileMappingA(h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!m_mapping)
+		{
+			close();
+			return false;
+		}
+
+		m_data = static_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+		if (!m_data)
+		{
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void mapped_file::close()
+	{
+		if (m_data)
+			UnmapViewOfFile(m_data);
+		if (m_mapping)
+			CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+
+		m_data = nullptr;
+		m_size = 0;
+		m_open = false;
+		m_file = INVALID_HANDLE_VALUE;
+		m_mapping = nullptr;
+	}
+
+	bool mapped_file::advise(map_advice advice, size_t offset, size_t length)
+	{
+		// 顺序访问已经在打开时通过FILE_FLAG_SEQUENTIAL_SCAN指定.
+		return m_open;
+	}
+
+#else
+
+	bool mapped_file::open(const std::string& file)
+	{
+		close();
+
+		m_fd = ::open(file.c_str(), O_RDONLY);
+		if (m_fd < 0)
+			return false;
+
+		struct stat st;
+		if (fstat(m_fd, &st) != 0 || static_cast<uint64_t>(st.st_size) > SIZE_MAX)
+		{
+			close();
+			return false;
+		}
+
+		m_open = true;
+		m_size = static_cast<size_t>(st.st_size);
+		if (m_size == 0)
+			return true;
+
+		void* p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+		if (p == MAP_FAILED)
+		{
+			close();
+			return false;
+		}
+		m_data = static_cast<uint8_t*>(p);
+
+		return true;
+	}
+
+	void mapped_file::close()
+	{
+		if (m_data)
+			munmap(m_data, m_size);
+		if (m_fd >= 0)
+			::close(m_fd);
+
+		m_data = nullptr;
+		m_size = 0;
+		m_open = false;
+		m_fd = -1;
+	}
+
+	bool mapped_file::advise(map_advice advice, size_t offset, size_t length)
+	{
+		if (!m_data || offset >= m_size)
+			return false;
+
+		// madvise要求起始地址按页对齐.
+		static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		size_t begin = offset & ~(page_size - 1);
+		size_t end = (length == 0 || length > m_size - offset) ? m_size : offset + length;
+
+		int flag = MADV_NORMAL;
+		switch (advice)
+		{
+		case map_normal: flag = MADV_NORMAL; break;
+		case map_sequential: flag = MADV_SEQUENTIAL; break;
+		case map_random: flag = MADV_RANDOM; break;
+		case map_willneed: flag = MADV_WILLNEED; break;
+		case map_hugepage:
+#if defined(MADV_HUGEPAGE)
+			flag = MADV_HUGEPAGE;
+			break;
+#else
+			return false;
+#endif
+		}
+
+		return madvise(m_data + begin, end - begin, flag) == 0;
+	}
+
+#endif
+
+	bool mapped_file::is_open() const
+	{
+		return m_open;
+	}
+
+	const uint8_t* mapped_file::data() const
+	{
+		return m_data;
+	}
+
+	size_t mapped_file::size() const
+	{
+		return m_size;
+	}
+
+}
@@ -0,0 +1,236 @@
+﻿#include "mirrored_streambuf.hpp"
+
+#include <cstring>
+#include <stdexcept>
+#include <limits>
+
+#if defined(__linux__)
+#	include <sys/mman.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#	if defined(SYS_memfd_create)
+#		define MPEGTS_MIRRORED_RING 1
+#	endif
+#endif
+
+namespace util {
+
+	mirrored_streambuf::mirrored_streambuf()
+		: m_data(nullptr)
+		, m_capacity(0)
+		, m_mirrored(false)
+		, m_get(0)
+		, m_put(0)
+	{
+	}
+
+	mirrored_streambuf::mirrored_streambuf(mirrored_streambuf&& rhs)
+		: m_data(rhs.m_data)
+		, m_capacity(rhs.m_capacity)
+		, m_mirrored(rhs.m_mirrored)
+		, m_buffer(std::move(rhs.m_buffer))
+		, m_get(rhs.m_get)
+		, m_put(rhs.m_put)
+	{
+		if (!m_mirrored)
+			m_data = m_buffer.empty() ? nullptr : &m_buffer[0];
+		rhs.m_data = nullptr;
+		rhs.m_capacity = 0;
+		rhs.m_mirrored = false;
+		rhs.m_get = rhs.m_put = 0;
+	}
+
+	mirrored_streambuf::~mirrored_streambuf()
+	{
+		unmap_ring();
+	}
+
+	void mirrored_streambuf::clear()
+	{
+		m_get = m_put = 0;
+	}
+
+	void mirrored_streambuf::shrink_to_fit()
+	{
+		// 没有数据时才释放内存, 下次prepare重新分配.
+		if (size() == 0)
+		{
+			unmap_ring();
+			m_buffer.clear();
+			m_buffer.shrink_to_fit();
+			m_data = nullptr;
+			m_capacity = 0;
+			m_get = m_put = 0;
+		}
+	}
+
+	size_t mirrored_streambuf::size() const noexcept
+	{
+		return m_put - m_get;
+	}
+
+	size_t mirrored_streambuf::capacity() const noexcept
+	{
+		return m_capacity;
+	}
+
+	const uint8_t* mirrored_streambuf::data() const noexcept
+	{
+		return m_data + m_get;
+	}
+
+	uint8_t* mirrored_streambuf::prepare(size_t n)
+	{
+		reserve(n);
+		return m_data + m_put;
+	}
+
+	void mirrored_streambuf::commit(size_t n)
+	{
+		size_t space = m_mirrored ? m_capacity - size() : m_capacity - m_put;
+		if (n > space)
+		{
+			std::length_error ex("mirrored_streambuf commit too long");
+			throw ex;
+		}
+
+		m_put += n;
+	}
+
+	void mirrored_streambuf::consume(size_t n)
+	{
+		if (n > size())
+		{
+			std::length_error ex("mirrored_streambuf consume too long");
+			throw ex;
+		}
+
+		m_get += n;
+		if (m_mirrored && m_get >= m_capacity)
+		{
+			// 读位置进入第二份映射, 整体回退一个环长, 数据地址不变.
+			m_get -= m_capacity;
+			m_put -= m_capacity;
+		}
+	}
+
+	bool mirrored_streambuf::mirrored() const noexcept
+	{
+		return m_mirrored;
+	}
+
+	void mirrored_streambuf::reserve(size_t n)
+	{
+		size_t used = size();
+		if (m_mirrored && n <= m_capacity - used)
+			return;
+		if (!m_mirrored && m_data && n <= m_capacity - m_put)
+			return;
+
+		if (n > std::numeric_limits<size_t>::max() / 4 - used)
+		{
+			std::length_error ex("mirrored_streambuf too long");
+			throw ex;
+		}
+
+		// 线性缓冲还有足够空间时, 把数据移到开头即可.
+		if (!m_mirrored && m_data && n <= m_capacity - used)
+		{
+			std::memmove(m_data, m_data + m_get, used);
+			m_get = 0;
+			m_put = used;
+			return;
+		}
+
+		// 空间不足, 分配更大的环并拷贝现有数据, 只在增长时发生.
+		size_t want = (std::max<size_t>)(used + n, (std::max<size_t>)(m_capacity * 2, buffer_delta));
+		std::vector<uint8_t> old;
+		if (used)
+			old.assign(data(), data() + used);
+
+		unmap_ring();
+		if (!map_ring(want))
+		{
+			m_buffer.resize(want);
+			m_data = &m_buffer[0];
+			m_capacity = want;
+		}
+		else
+		{
+			std::vector<uint8_t>().swap(m_buffer);
+		}
+
+		if (used)
+			std::memcpy(m_data, old.data(), used);
+		m_get = 0;
+		m_put = used;
+	}
+
+#if defined(MPEGTS_MIRRORED_RING)
+
+	bool mirrored_streambuf::map_ring(size_t capacity)
+	{
+		size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		capacity = (capacity + page - 1) / page * page;
+
+		int fd = static_cast<int>(syscall(SYS_memfd_create, "mpegts_ring", 0));
+		if (fd < 0)
+			return false;
+		if (ftruncate(fd, static_cast<off_t>(capacity)) != 0)
+		{
+			::close(fd);
+			return false;
+		}
+
+		// 先保留2倍大小的地址空间, 再把同一个memfd固定映射到前后两半.
+		void* base = mmap(nullptr, capacity * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED)
+		{
+			::close(fd);
+			return false;
+		}
+
+		uint8_t* p = static_cast<uint8_t*>(base);
+		if (mmap(p, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+			mmap(p + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		{
+			munmap(base, capacity * 2);
+			::close(fd);
+			return false;
+		}
+
+		// 映射保持对memfd的引用, 可以直接关闭.
+		::close(fd);
+
+		m_data = p;
+		m_capacity = capacity;
+		m_mirrored = true;
+		return true;
+	}
+
+	void mirrored_streambuf::unmap_ring()
+	{
+		if (m_mirrored && m_data)
+			munmap(m_data, m_capacity * 2);
+		if (m_mirrored)
+		{
+			m_data = nullptr;
+			m_capacity = 0;
+			m_mirrored = false;
+		}
+	}
+
+#else
+
+	bool mirrored_streambuf::map_ring(size_t)
+	{
+		return false;
+	}
+
+	void mirrored_streambuf::unmap_ring()
+	{
+	}
+
+#endif
+
+}
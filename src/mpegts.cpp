@@ -1,4 +1,7 @@
 ﻿#include "mpegts.hpp"
+#include "resync.hpp"
+#include "start_code.hpp"
+#include "state_blob.hpp"
 #include <limits>
 #include <iostream>
 #include <cstring>
@@ -113,6 +116,11 @@ namespace util {
 #define PMT_ES_SIZE					5
 #define PES_HEADER_SIZE				6
 #define PES_HEADER_OPTIONAL_SIZE	3
+#define MPEGTS_TS_WRAP				(int64_t(1) << 33)
+// 解码时间与编码时钟(或上一次的时间)相差超过这个范围时认为时间戳跳变.
+#define MUX_MAX_JUMP				(int64_t(10) * PCR_TIME_BASE)
+// 没有设置码率的访问单元也没有时间戳时, 按这个码率根据输出的字节数推算时钟.
+#define MUX_NOMINAL_RATE			(int64_t(8) * 1000 * 1000)
 
 	inline bool ts_get_unitstart(const uint8_t* ts)
 	{
@@ -387,10 +395,22 @@ namespace util {
 
 	inline void tsaf_set_pcrext(uint8_t* ts, uint16_t pcr_ext)
 	{
+		BOOST_ASSERT(pcr_ext < 300);
 		ts[10] |= (pcr_ext >> 8) & 0x1;
 		ts[11] = pcr_ext & 0xff;
 	}
 
+	// pcr为27MHz时钟, 可能为负(解码时间小于复用延迟时), 按33位回绕取正值后再拆分.
+	inline void tsaf_set_pcr_clock(uint8_t* ts, int64_t pcr)
+	{
+		const int64_t wrap = MPEGTS_TS_WRAP * 300;
+		pcr %= wrap;
+		if (pcr < 0)
+			pcr += wrap;
+		tsaf_set_pcr(ts, pcr / 300);
+		tsaf_set_pcrext(ts, static_cast<uint16_t>(pcr % 300));
+	}
+
 	inline void pes_init(uint8_t* pes)
 	{
 		pes[0] = 0x0;
@@ -470,81 +490,6 @@ namespace util {
 		return pes + PES_HEADER_SIZE + PES_HEADER_OPTIONAL_SIZE + pes_get_headerlength(pes);
 	}
 
-	static const uint32_t static_crc_table[256] = {
-		0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9,
-		0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
-		0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
-		0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd,
-		0x4c11db70, 0x48d0c6c7, 0x4593e01e, 0x4152fda9,
-		0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
-		0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011,
-		0x791d4014, 0x7ddc5da3, 0x709f7b7a, 0x745e66cd,
-		0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
-		0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5,
-		0xbe2b5b58, 0xbaea46ef, 0xb7a96036, 0xb3687d81,
-		0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
-		0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49,
-		0xc7361b4c, 0xc3f706fb, 0xceb42022, 0xca753d95,
-		0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
-		0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d,
-		0x34867077, 0x30476dc0, 0x3d044b19, 0x39c556ae,
-		0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
-		0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16,
-		0x018aeb13, 0x054bf6a4, 0x0808d07d, 0x0cc9cdca,
-		0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
-		0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02,
-		0x5e9f46bf, 0x5a5e5b08, 0x571d7dd1, 0x53dc6066,
-		0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
-		0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e,
-		0xbfa1b04b, 0xbb60adfc, 0xb6238b25, 0xb2e29692,
-		0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
-		0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a,
-		0xe0b41de7, 0xe4750050, 0xe9362689, 0xedf73b3e,
-		0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
-		0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686,
-		0xd5b88683, 0xd1799b34, 0xdc3abded, 0xd8fba05a,
-		0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
-		0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb,
-		0x4f040d56, 0x4bc510e1, 0x46863638, 0x42472b8f,
-		0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
-		0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47,
-		0x36194d42, 0x32d850f5, 0x3f9b762c, 0x3b5a6b9b,
-		0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
-		0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623,
-		0xf12f560e, 0xf5ee4bb9, 0xf8ad6d60, 0xfc6c70d7,
-		0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
-		0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f,
-		0xc423cd6a, 0xc0e2d0dd, 0xcda1f604, 0xc960ebb3,
-		0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
-		0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b,
-		0x9b3660c6, 0x9ff77d71, 0x92b45ba8, 0x9675461f,
-		0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
-		0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640,
-		0x4e8ee645, 0x4a4ffbf2, 0x470cdd2b, 0x43cdc09c,
-		0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
-		0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24,
-		0x119b4be9, 0x155a565e, 0x18197087, 0x1cd86d30,
-		0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
-		0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088,
-		0x2497d08d, 0x2056cd3a, 0x2d15ebe3, 0x29d4f654,
-		0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
-		0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c,
-		0xe3a1cbc1, 0xe760d676, 0xea23f0af, 0xeee2ed18,
-		0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
-		0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0,
-		0x9abc8bd5, 0x9e7d9662, 0x933eb0bb, 0x97ffad0c,
-		0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
-		0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
-	};
-
-	uint32_t crc32(const uint8_t* data, size_t len)
-	{
-		uint32_t crc = 0xffffffff;
-		for (int i = 0; i < len; i++)
-			crc = (crc << 8) ^ static_crc_table[(crc >> 24) ^ (data[i])];
-		return crc;
-	}
-
 	const uint8_t ts_log2_tab[256] = {
 			0,0,1,1,2,2,2,2,3,3,3,3,3,3,3,3,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
 			5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
@@ -674,115 +619,47 @@ namespace util {
 		uint64_t m_cache;
 	};
 
-	static inline const uint8_t *find_start_code(const uint8_t * p,
-		const uint8_t *end, uint32_t * state)
+	int detect_packet_size(const uint8_t* data, size_t size, size_t* offset/* = nullptr*/)
 	{
-		int i;
+		// 需要连续确认的包数, 数据不足时按实际能容纳的包数确认.
+		const int lock_count = 8;
+		static const int formats[] = { ts_packet_188, ts_packet_192, ts_packet_204 };
 
-		BOOST_ASSERT(p <= end);
-		if (p >= end)
-			return end;
+		int best_size = 0;
+		size_t best_offset = 0;
+		for (auto packet_size : formats)
+		{
+			int prefix = ts_packet_prefix(packet_size);
+			if (size < static_cast<size_t>(packet_size))
+				continue;
 
-		for (i = 0; i < 3; i++) {
-			uint32_t tmp = *state << 8;
-			*state = tmp + *(p++);
-			if (tmp == 0x100 || p == end)
-				return p;
-		}
+			int count = static_cast<int>(std::min<size_t>(lock_count, (size - prefix) / packet_size));
+			size_t skipped = 0;
+			if (!ts_resync(data + prefix, size - prefix, skipped, count, packet_size))
+				continue;
 
-		while (p < end) {
-			if (p[-1] > 1) p += 3;
-			else if (p[-2]) p += 2;
-			else if (p[-3] | (p[-1] - 1)) p++;
-			else {
-				p++;
-				break;
+			// 取第一个同步位置最靠前的格式, 相同时按188/192/204的顺序优先.
+			if (!best_size || skipped < best_offset)
+			{
+				best_size = packet_size;
+				best_offset = skipped;
 			}
 		}
 
-		p = std::min(p, end) - 4;
-		*state = av_rb32(p);
-
-		return p + 4;
-	}
-
-	static inline void* ts_memmem(const void *haystack, size_t haystack_len,
-		const void *needle, size_t needle_len)
-	{
-		const char *begin = (const char *)haystack;
-		const char *last_possible = begin + haystack_len - needle_len;
-		const char *tail = (const char *)needle;
-		char point;
-
-		/*
-		 * The first occurrence of the empty string is deemed to occur at
-		 * the beginning of the string.
-		 */
-		if (needle_len == 0)
-			return (void *)begin;
-
-		/*
-		 * Sanity check, otherwise the loop might search through the whole
-		 * memory.
-		 */
-		if (haystack_len < needle_len)
-			return NULL;
-
-		point = *tail++;
-		for (; begin <= last_possible; begin++) {
-			if (*begin == point && !memcmp(begin + 1, tail, needle_len - 1))
-				return (void *)begin;
-		}
-
-		return NULL;
+		if (offset)
+			*offset = best_offset;
+		return best_size;
 	}
 
 	mpegts_parser::mpegts_parser()
 	{
-		m_stream_types[0x01] = "MPEG2VIDEO|ISO/IEC 11172-2 Video";	// v
-		m_stream_types[0x02] = "MPEG2VIDEO|ISO/IEC 13818-2 Video";	// v
-		m_stream_types[0x03] = "MP3|ISO/IEC 11172-3 Audio";
-		m_stream_types[0x04] = "MP3|ISO/IEC 13818-3 Audio";
-		m_stream_types[0x05] = "ISO/IEC 13818-1 PRIVATE SECTION";
-		m_stream_types[0x06] = "ISO/IEC 13818-1 PES";
-		m_stream_types[0x07] = "ISO/IEC 13522 MHEG";
-		m_stream_types[0x08] = "ISO/IEC 13818-1 Annex A DSM-CC";
-		m_stream_types[0x09] = "ITU-T Rec.H.222.1";
-		m_stream_types[0x0a] = "ISO/IEC 13818-6 type A";
-		m_stream_types[0x0b] = "ISO/IEC 13818-6 type B";
-		m_stream_types[0x0c] = "ISO/IEC 13818-6 type C";
-		m_stream_types[0x0d] = "ISO/IEC 13818-6 type D";
-		m_stream_types[0x0e] = "ISO/IEC 13818-1 AUXILIARY";
-		m_stream_types[0x0f] = "AAC"; // AAC|ISO/IEC 13818-7 Audio with ADTS transport syntax
-		m_stream_types[0x10] = "MPEG4|ISO/IEC 14496-2 Visual";			// v
-		m_stream_types[0x11] = "LATM|ISO/IEC 14496-3 Audio with the LATM transport syntax as defined in ISO/IEC 14496-3 / AMD 1";
-		m_stream_types[0x12] = "ISO/IEC 14496-1 SL-packetized stream or FlexMux stream carried in PES packets";
-		m_stream_types[0x13] = "ISO/IEC 14496-1 SL-packetized stream or FlexMux stream carried in ISO/IEC14496_sections";
-		m_stream_types[0x14] = "ISO/IEC 13818-6 Synchronized Download Protocol";
-		m_stream_types[0x1b] = "H264";			// v
-		m_stream_types[0x20] = "H264";			// v
-		m_stream_types[0x24] = "HEVC";			// v
-		m_stream_types[0x42] = "CAVS";			// v
-		m_stream_types[0xd1] = "DIRAC";			// v
-		m_stream_types[0xea] = "VC1";			// v
-
-		m_stream_types[0x80] = "PCM_BLURAY";
-		m_stream_types[0x81] = "AC3|DOLBY_AC3_AUDIO";
-		m_stream_types[0x82] = "DTS";
-		m_stream_types[0x83] = "TRUEHD";
-		m_stream_types[0x84] = "EAC3";
-		m_stream_types[0x85] = "DTS";
-		m_stream_types[0x86] = "DTS";
-		m_stream_types[0x8a] = "DTS";
-		m_stream_types[0xa1] = "EAC3";
-		m_stream_types[0xa2] = "DTS";
-		m_stream_types[0x90] = "HDMV_PGS_SUBTITLE";
-
 		m_streams.resize(0x2000, 0);
 		m_pcr_pid = -1;
+		m_packet_size = ts_packet_188;
 		m_has_pat = false;
 		m_matadata.resize(188 * 2);
 		m_cc_pids.resize(0x2000, -1);
+		m_pid_fields.resize(0x2000, parse_all);
 
 		m_packet_count = -1;
 		m_pcr_packet_count = 0;
@@ -791,6 +668,21 @@ namespace util {
 		m_pmt_pid = 4095;
 		m_first_pcr = 0;
 		m_total_bytes = 0;
+		m_psi_version = 1;
+		m_psi_interval = 100 * (PCR_TIME_BASE / 1000);
+		m_last_psi_pcr = -1;
+		m_mux_rate = 0;
+		m_pcr_interval = 40 * (PCR_TIME_BASE / 1000);
+		m_mux_delay = 700 * (PCR_TIME_BASE / 1000);
+		m_cbr_base = 0;
+		m_last_pcr = -1;
+		m_mux_pcr_pid = -1;
+		m_mux_underflows = 0;
+		m_mux_last_dts = -1;
+		m_mux_dts_offset = 0;
+		m_mux_last_clock = m_first_pcr;
+		m_mux_clock_bytes = 0;
+		m_pcr_discontinuity = false;
 	}
 
 	mpegts_parser::~mpegts_parser()
@@ -805,7 +697,6 @@ namespace util {
 			return false;
 
 		// 解析PID等mpegts头信息.
-		const uint8_t* base_ptr = parse_ptr;
 		uint16_t PID = ((parse_ptr[1] & 0x1f) << 8) | parse_ptr[2];
 		bool payload_unit_start_indicator = !!(parse_ptr[1] & 0x40);
 		bool has_payload = !!(parse_ptr[3] & 0x10);
@@ -815,6 +706,14 @@ namespace util {
 		info.pid_ = PID;
 		info.stream_type_ = m_streams[PID];
 
+		// 被过滤的pid只解析ts头, PAT/PMT总是需要解析以维护流信息.
+		if (m_pid_filter[PID] && PID != 0 && !m_pmt_pids[PID])
+		{
+			info.type_ = mpegts_info::filtered;
+			return true;
+		}
+		int fields = m_pid_fields[PID];
+
 		// 跳过这些专用数据包.
 		if (PID == 0x0001 || PID == 0x0002 || PID == 0x0010 || PID == 0x0011 ||
 			PID == 0x0012 || PID == 0x0013 || PID == 0x0014 || PID == 0x001E ||
@@ -826,195 +725,11 @@ namespace util {
 			return true;
 		}
 
-		if (PID == 0)
-		{
-			if (has_adaptation)
-			{
-				unsigned char adaptation_field_length = *(uint8_t*)&parse_ptr[4];
-				parse_ptr += adaptation_field_length + 1;
-			}
-			parse_ptr += 4;
-			if (payload_unit_start_indicator)
-			{
-				uint8_t pointer_field = *parse_ptr;
-				if (pointer_field > 0)
-					parse_ptr += pointer_field;
-				parse_ptr += 1;
-			}
-
-			auto section_ptr = parse_ptr;
-			parse_ptr += 1;	// sikp table id, table id == 0.
-			int section_length = ((parse_ptr[0] & 0x0f) << 8) | parse_ptr[1];
-			parse_ptr += 2;
-			// auto program_number = (parse_ptr[0] << 8) | parse_ptr[1];
-			parse_ptr += 5;
-			if (section_length >= TS_SIZE - TS_HEADER_SIZE)
-			{
-				std::cerr << "parse section_length error, section_length = " << section_length << std::endl;
-				return false;
-			}
-			// skip following
-			// 9 = program_number(16) + reserved(2) +
-			//	   version_number(5) + current_next_indicator(1) +
-			//     section_number(8) + last_section_number(8) + CRC_32(4bytes)
-			for (int n = 0; n < section_length - 9; n += 4)
-			{
-				uint16_t program_number = (parse_ptr[0] << 8) | parse_ptr[1];
-				if (program_number < 0)
-					break;
-				parse_ptr += 2;
-				uint16_t pmt_id = ((parse_ptr[0] & 0x1f) << 8) | parse_ptr[1];
-				BOOST_ASSERT(pmt_id <= 0x1fff);
-				if (pmt_id == PID)
-					break;
-				parse_ptr += 2;
-				if (program_number == 0)
-					continue;
-				m_has_pat = true;
-				m_pmt_pids.set(pmt_id);
-			}
-
-			if (check_crc)
-			{
-				// CRC32.
-				info.crc_ = av_rb32(parse_ptr);
-				auto crc = crc32(section_ptr, parse_ptr - section_ptr);
-				if (crc != info.crc_)
-				{
-					std::cerr << "parse PAT section crc32 error, crc = " << crc
-						<< ", crc in data = " << info.crc_ << std::endl;
-				}
-			}
-
-			// 保存PAT数据包.
-			if (m_matadata.size() == 0)
-				m_matadata.resize(188 * 2);
-			std::memcpy(&m_matadata[0], base_ptr, 188);
-
-			// 设置返回信息.
-			info.type_ = mpegts_info::pat;
-
-			return true;
-		}
-
-		if (m_pmt_pids[PID] && m_has_pat)
+		// PAT和PMT.
+		if (PID == 0 || (m_pmt_pids[PID] && m_has_pat))
 		{
-			if (has_adaptation)
-			{
-				unsigned char adaptation_field_length = *(uint8_t*)&parse_ptr[4];
-				parse_ptr += adaptation_field_length + 1;
-			}
-
-			parse_ptr += 4;
-			if (payload_unit_start_indicator)
-			{
-				uint8_t pointer_field = *parse_ptr;		// pointer_field 只有当ts包是一个PSI时, 才会包含.
-				if (pointer_field > 0)
-					parse_ptr += pointer_field;
-				parse_ptr += 1;
-			}
-
-			auto section_ptr = parse_ptr;
-			uint8_t table_id = *parse_ptr;	// table id == 2.
-			parse_ptr++;
-			uint16_t section_length = ((parse_ptr[0] & 0x0f) << 8) | parse_ptr[1];
-			parse_ptr += 2;		// section_syntax_indicator(1) + '0'(1) + reserved(2) + section_length(12)
-			auto transport_stream_id = (parse_ptr[0] << 8) | parse_ptr[1];
-			parse_ptr += 2;		// transport_stream_id.
-			parse_ptr++;		// reserved, version_number, current_next_indicator.
-			parse_ptr++;		// section_number.
-			parse_ptr++;		// last_section_number.
-			m_pcr_pid = ((parse_ptr[0] & 0x1f) << 8) + parse_ptr[1];
-			parse_ptr += 2;		// reserved(3) + PCR_PID(13).
-			uint16_t program_info_length = ((parse_ptr[0] & 0x0f) << 8) | parse_ptr[1];
-			parse_ptr += 2;		// program_info_length(16).
-			parse_ptr += program_info_length; // skip program_info descriptor.
-
-			// 9 = transport_stream_id(16) + reserved(2) + version_number(5) +
-			//     current_next_indicator(1) + section_number(8) +
-			//     last_section_number(8) + reserved(3) + PCR_PID(13) +
-			//     reserved(4) + program_info_length(12)
-			// 4 = crc32(4)
-			int N1 = section_length - (9 + 4 + program_info_length);
-			if (N1 >= TS_SIZE - TS_HEADER_SIZE || N1 < 0)
-			{
-				std::cerr << "parse N1 error, N1 = " << N1 << std::endl;
-				return false;
-			}
-
-			for (int n = 0; n < N1;)
-			{
-				uint8_t stream_type = *parse_ptr;
-				if (m_stream_types.find(stream_type) != m_stream_types.end())
-				{
-					parse_ptr++;					// stream_type.
-					uint16_t elementary_PID = ((parse_ptr[0] & 0x1F) << 8) | parse_ptr[1];
-					BOOST_ASSERT(elementary_PID <= 0x1fff);
-					parse_ptr += 2;					// reserved + elementary_PID.
-					uint16_t ES_info_length = ((parse_ptr[0] & 0x0F) << 8) | parse_ptr[1];
-					parse_ptr += 2;					// reserved + ES_info_length.
-					parse_ptr += ES_info_length;	// skip ES_info descriptor.
-					n += (5 + ES_info_length);
-
-					// 记录音频和视频的PID.
-					m_streams[elementary_PID] = stream_type;
-					if (stream_type == 0x1b || stream_type == 0x20)
-						m_streams[elementary_PID] = video_h264;
-					else if (stream_type == 0x24)
-						m_streams[elementary_PID] = video_hevc;
-
-					if (stream_type == 0x01 || stream_type == 0x02 ||
-						stream_type == 0x1b || stream_type == 0x20 ||
-						stream_type == 0x10 || stream_type == 0x24 ||
-						stream_type == 0x42 || stream_type == 0xd1 ||
-						stream_type == 0xea)
-					{
-						m_video_elementary_PIDs.set(elementary_PID);
-					}
-					else if (
-						stream_type == 0x03 || stream_type == 0x04 ||
-						stream_type == 0x0f || stream_type == 0x11 ||
-						stream_type == 0x80 || stream_type == 0x81 ||
-						stream_type == 0x82 || stream_type == 0x83 ||
-						stream_type == 0x84 || stream_type == 0x85 ||
-						stream_type == 0x86 || stream_type == 0x8a ||
-						stream_type == 0xa1 || stream_type == 0xa2 ||
-						stream_type == 0x90)
-					{
-						m_audio_elementary_PIDs.set(elementary_PID);
-					}
-					else
-					{
-						std::cerr << "parse mpegts, unexpected stream type, type = "
-							<< (int)stream_type << std::endl;
-					}
-				}
-				else
-				{
-					std::cerr << "parse stream type error, N1 = "
-						<< N1 << ", stream_type = " << (int)stream_type << std::endl;
-					return false;
-				}
-			}
-
-			if (check_crc)
-			{
-				// CRC32.
-				info.crc_ = av_rb32(parse_ptr);
-				auto crc = crc32(section_ptr, parse_ptr - section_ptr);
-				if (crc != info.crc_)
-				{
-					std::cerr << "parse PMT section crc32 error, crc = " << crc
-						<< ", crc in data = " << info.crc_ << std::endl;
-				}
-			}
-
-			// 保存PMT数据包到matadata中.
-			std::memcpy(&m_matadata[188], base_ptr, 188);
-
-			info.type_ = mpegts_info::pmt;
-
-			return true;
+			info.type_ = PID == 0 ? mpegts_info::pat : mpegts_info::pmt;
+			return do_parse_psi(parse_ptr, info, check_crc);
 		}
 
 		if (has_payload)
@@ -1031,8 +746,8 @@ namespace util {
 				pes_headerlength = payload[8];
 				int pes_length = (payload[4] << 8) | payload[5];
 				// int stream_id = payload[3];
-				bool has_pts = !!(payload[7] & 0x80);
-				bool has_dts = (payload[7] & 0xc0) == 0xc0;
+				bool has_pts = (fields & parse_pts) && !!(payload[7] & 0x80);
+				bool has_dts = (fields & parse_pts) && (payload[7] & 0xc0) == 0xc0;
 				uint64_t pts = 0, dts = 0;
 
 				if (has_pts)
@@ -1070,7 +785,7 @@ namespace util {
 			info.payload_end_ = payload + payload_size;
 		}
 
-		if (m_pcr_pid == PID)
+		if (m_pcr_pid == PID && (fields & parse_pcr))
 		{
 			if (/*(parse_ptr[3] & 0x20)*/ has_adaptation && // adaptation.
 				(parse_ptr[5] & 0x10) &&
@@ -1120,7 +835,7 @@ namespace util {
 		}
 #endif
 
-		if (has_payload && info.is_video_)
+		if (has_payload && info.is_video_ && (fields & parse_pict_type))
 		{
 			auto has_found_type = m_type_pids[PID];
 			const uint8_t* ptr = info.payload_begin_;
@@ -1145,16 +860,276 @@ namespace util {
 		return true;
 	}
 
+	// section最大长度, PAT/PMT为1024, 私有section为4096.
+	enum { max_section_size = 4096 };
+
+	inline bool mpegts_parser::do_parse_psi(const uint8_t* parse_ptr, mpegts_info& info, bool check_crc)
+	{
+		bool payload_unit_start_indicator = !!(parse_ptr[1] & 0x40);
+		bool has_payload = !!(parse_ptr[3] & 0x10);
+		bool has_adaptation = !!(parse_ptr[3] & 0x20);
+		if (!has_payload)
+			return true;
+
+		const uint8_t* ptr = parse_ptr + TS_HEADER_SIZE;
+		const uint8_t* end = parse_ptr + TS_SIZE;
+		if (has_adaptation)
+			ptr += parse_ptr[4] + 1;
+		if (ptr >= end)
+		{
+			std::cerr << "parse psi adaptation_field_length error, length = " << (int)parse_ptr[4] << std::endl;
+			return false;
+		}
+
+		auto& state = m_psi_sections[info.pid_];
+		bool continuous = state.cc_ != -1 && ((state.cc_ + 1) & 0xf) == info.cc_;
+		state.cc_ = info.cc_;
+
+		if (!payload_unit_start_indicator)
+		{
+			// 跨包section的后续部分, cc不连续时丢弃已接收的数据.
+			if (state.need_ == 0)
+				return true;
+			if (!continuous)
+			{
+				state.need_ = 0;
+				state.buffer_.clear();
+				return true;
+			}
+			return do_append_section(state, ptr, end, info, check_crc);
+		}
+
+		// pointer_field 只有当ts包是一个PSI时, 才会包含.
+		uint8_t pointer_field = *ptr++;
+		if (ptr + pointer_field > end)
+		{
+			std::cerr << "parse psi pointer_field error, pointer_field = " << (int)pointer_field << std::endl;
+			return false;
+		}
+
+		// pointer_field之前是上一个section的剩余部分.
+		bool ret = true;
+		if (state.need_ && continuous && pointer_field)
+			ret = do_append_section(state, ptr, ptr + pointer_field, info, check_crc);
+		state.need_ = 0;
+		state.buffer_.clear();
+		ptr += pointer_field;
+
+		// 一个包中可以有多个section, 0xff为填充字节.
+		while (ptr < end && *ptr != 0xff)
+		{
+			if (end - ptr < PSI_HEADER_SIZE)
+			{
+				// section头也被分割了, 先保存, 收到后续数据再确定长度.
+				state.buffer_.assign(ptr, end);
+				state.need_ = PSI_HEADER_SIZE;
+				break;
+			}
+
+			size_t section_size = PSI_HEADER_SIZE + psi_get_length(ptr);
+			if (section_size > max_section_size)
+			{
+				std::cerr << "parse section_length error, section_length = "
+					<< section_size - PSI_HEADER_SIZE << std::endl;
+				return false;
+			}
+
+			if (ptr + section_size > end)
+			{
+				state.buffer_.assign(ptr, end);
+				state.need_ = section_size;
+				break;
+			}
+
+			// 完整的section直接在ts包中解析, 不需要复制.
+			if (!do_parse_section(state, ptr, section_size, parse_ptr, info, check_crc))
+				ret = false;
+			ptr += section_size;
+		}
+
+		return ret;
+	}
+
+	inline bool mpegts_parser::do_append_section(psi_section& state, const uint8_t* ptr, const uint8_t* end,
+		mpegts_info& info, bool check_crc)
+	{
+		while (ptr < end && state.buffer_.size() < state.need_)
+		{
+			size_t n = std::min<size_t>(end - ptr, state.need_ - state.buffer_.size());
+			state.buffer_.insert(state.buffer_.end(), ptr, ptr + n);
+			ptr += n;
+
+			// 收齐section头后得到section的实际长度.
+			if (state.need_ == PSI_HEADER_SIZE && state.buffer_.size() == PSI_HEADER_SIZE)
+			{
+				state.need_ = PSI_HEADER_SIZE + psi_get_length(&state.buffer_[0]);
+				if (state.need_ > max_section_size)
+				{
+					std::cerr << "parse section_length error, section_length = "
+						<< state.need_ - PSI_HEADER_SIZE << std::endl;
+					state.need_ = 0;
+					state.buffer_.clear();
+					return false;
+				}
+			}
+		}
+
+		if (state.buffer_.size() < state.need_)
+			return true;
+
+		bool ret = do_parse_section(state, &state.buffer_[0], state.need_, nullptr, info, check_crc);
+		state.need_ = 0;
+		state.buffer_.clear();
+		return ret;
+	}
+
+	bool mpegts_parser::do_parse_section(psi_section& state, const uint8_t* section, size_t size,
+		const uint8_t* packet, mpegts_info& info, bool check_crc)
+	{
+		// table_id(8) + section_length(16) + table_id_extension(16) + version_number(8) +
+		// section_number(8) + last_section_number(8) + ... + CRC_32(32).
+		if (size < PSI_HEADER_SIZE_SYNTAX1 + PSI_CRC_SIZE)
+		{
+			std::cerr << "parse section size error, size = " << size << std::endl;
+			return false;
+		}
+
+		uint8_t table_id = section[0];
+		if ((info.pid_ == 0 && table_id != 0) || (info.pid_ != 0 && table_id != 2))
+			return true;	// 不是PAT/PMT的section.
+
+		// current_next_indicator为0表示尚未生效的表.
+		if (!(section[5] & 0x01))
+			return true;
+
+		// 版本号和CRC都与上次相同, 表没有变化, 不必重新解析.
+		uint8_t version = (section[5] >> 1) & 0x1f;
+		uint8_t section_number = section[6];
+		uint32_t crc_in_data = av_rb32(section + size - PSI_CRC_SIZE);
+		info.crc_ = crc_in_data;
+		int64_t key = (static_cast<int64_t>(version) << 32) | crc_in_data;
+		if (state.versions_.size() > section_number && state.versions_[section_number] == key)
+			return true;
+
+		if (check_crc)
+		{
+			auto crc = crc32(section, size - PSI_CRC_SIZE);
+			if (crc != crc_in_data)
+			{
+				std::cerr << "parse " << (table_id == 0 ? "PAT" : "PMT") << " section crc32 error, crc = "
+					<< crc << ", crc in data = " << crc_in_data << std::endl;
+				return true;
+			}
+		}
+
+		bool ret = table_id == 0 ?
+			parse_pat_section(section, size) :
+			parse_pmt_section(section, size);
+		if (!ret)
+			return false;
+
+		if (state.versions_.size() <= section_number)
+			state.versions_.resize(section_number + 1, -1);
+		state.versions_[section_number] = key;
+
+		// 保存PAT/PMT数据包, 只保存完整包含在一个ts包中的section.
+		if (packet)
+		{
+			if (m_matadata.size() == 0)
+				m_matadata.resize(188 * 2);
+			std::memcpy(&m_matadata[table_id == 0 ? 0 : 188], packet, 188);
+		}
+
+		return true;
+	}
+
+	bool mpegts_parser::parse_pat_section(const uint8_t* section, size_t size)
+	{
+		const uint8_t* ptr = section + PAT_HEADER_SIZE;
+		const uint8_t* end = section + size - PSI_CRC_SIZE;
+
+		for (; ptr + PAT_PROGRAM_SIZE <= end; ptr += PAT_PROGRAM_SIZE)
+		{
+			uint16_t program_number = (ptr[0] << 8) | ptr[1];
+			uint16_t pmt_id = ((ptr[2] & 0x1f) << 8) | ptr[3];
+			if (pmt_id == 0)
+				break;
+			// program_number为0时是network PID.
+			if (program_number == 0)
+				continue;
+			m_has_pat = true;
+			m_pmt_pids.set(pmt_id);
+		}
+
+		return true;
+	}
+
+	bool mpegts_parser::parse_pmt_section(const uint8_t* section, size_t size)
+	{
+		const uint8_t* end = section + size - PSI_CRC_SIZE;
+		if (size < PMT_HEADER_SIZE + PSI_CRC_SIZE)
+		{
+			std::cerr << "parse PMT section size error, size = " << size << std::endl;
+			return false;
+		}
+
+		m_pcr_pid = ((section[8] & 0x1f) << 8) + section[9];
+		uint16_t program_info_length = pmt_get_desclength(section);
+		const uint8_t* ptr = section + PMT_HEADER_SIZE + program_info_length; // skip program_info descriptor.
+		if (ptr > end)
+		{
+			std::cerr << "parse program_info_length error, program_info_length = "
+				<< program_info_length << std::endl;
+			return false;
+		}
+
+		while (ptr + PMT_ES_SIZE <= end)
+		{
+			uint8_t stream_type = ptr[0];
+			uint16_t elementary_PID = ((ptr[1] & 0x1F) << 8) | ptr[2];
+			uint16_t ES_info_length = ((ptr[3] & 0x0F) << 8) | ptr[4];
+			ptr += PMT_ES_SIZE + ES_info_length;	// skip ES_info descriptor.
+			if (ptr > end)
+			{
+				std::cerr << "parse ES_info_length error, ES_info_length = " << ES_info_length << std::endl;
+				return false;
+			}
+
+			const auto& traits = stream_traits(stream_type);
+			if (traits.kind == stream_kind_unknown)
+			{
+				std::cerr << "parse stream type error, stream_type = " << (int)stream_type << std::endl;
+				continue;
+			}
+
+			// 记录音频和视频的PID.
+			m_streams[elementary_PID] = traits.codec;
+			if (traits.kind == stream_kind_video)
+				m_video_elementary_PIDs.set(elementary_PID);
+			else if (traits.kind == stream_kind_audio)
+				m_audio_elementary_PIDs.set(elementary_PID);
+			else
+			{
+				std::cerr << "parse mpegts, unexpected stream type, type = "
+					<< (int)stream_type << std::endl;
+			}
+		}
+
+		return true;
+	}
+
+	// 一个ts包的payload最多184字节, 起始码之间至少间隔3字节.
+	enum { max_start_codes = (TS_SIZE - TS_HEADER_SIZE) / 3 + 1 };
+
 	inline void mpegts_parser::do_parse_h264(const uint8_t* ptr, const uint8_t* end, mpegts_info& info)
 	{
-		uint32_t state = -1;
+		uint32_t offsets[max_start_codes];
+		size_t count = find_start_codes(ptr, end - ptr, offsets, max_start_codes);
 		int nalu_type;
-		while (ptr < end)
+		for (size_t i = 0; i < count; i++)
 		{
-			ptr = find_start_code(ptr, end, &state);
-			if ((state & 0xFFFFFF00) != 0x100)
-				break;
-			nalu_type = state & 0x1F;
+			const uint8_t* nal = ptr + offsets[i];
+			nalu_type = *nal & 0x1F;
 			enum {
 				NAL_UNIT_TYPE_UNKNOWN = 0,
 				NAL_UNIT_TYPE_SLICE = 1,
@@ -1180,7 +1155,7 @@ namespace util {
 #ifndef DISABLE_PARSE_PICT_TYPE
 				else
 				{
-					bitstream bs(ptr, static_cast<int>(end - ptr));
+					bitstream bs(nal + 1, static_cast<int>(end - nal - 1));
 					bs.read_ue(); // skip first_mb_in_slice.
 					auto slice_type = bs.read_ue();
 					info.pict_type_ = ts_h264_golomb_to_pict_type[slice_type % 5];
@@ -1193,15 +1168,16 @@ namespace util {
 
 	inline void mpegts_parser::do_parse_hevc(const uint8_t* ptr, const uint8_t* end, mpegts_info& info)
 	{
-		uint32_t state = -1;
+		uint32_t offsets[max_start_codes];
+		size_t count = find_start_codes(ptr, end - ptr, offsets, max_start_codes);
 		int nalu_type;
 
-		while (ptr < end)
+		for (size_t i = 0; i < count; i++)
 		{
-			ptr = find_start_code(ptr, end, &state);
-			if (--ptr + 2 >= end)
+			const uint8_t* nal = ptr + offsets[i];
+			if (nal + 2 >= end)
 				break;
-			nalu_type = (*ptr >> 1) & 0x3f;
+			nalu_type = (*nal >> 1) & 0x3f;
 			if (nalu_type >= 16 && nalu_type <= 23)
 			{
 				info.type_ = mpegts_info::idr;
@@ -1214,15 +1190,17 @@ namespace util {
 
 	inline void mpegts_parser::do_parse_mpeg2(const uint8_t* ptr, const uint8_t* end, mpegts_info& info)
 	{
-		while (ptr < end)
+		uint32_t offsets[max_start_codes];
+		size_t count = find_start_codes(ptr, end - ptr, offsets, max_start_codes);
+
+		for (size_t i = 0; i < count; i++)
 		{
-			ptr = (uint8_t*)ts_memmem(ptr, end - ptr, "\000\000\001", 3);
-			if (!ptr)
-				break;
+			const uint8_t* code = ptr + offsets[i];
 
-			if (ptr[3] == 0x00)
+			// picture_start_code, picture_coding_type位于其后第2个字节.
+			if (code[0] == 0x00 && code + 2 < end)
 			{
-				info.pict_type_ = (ptr[5] & 0x38) >> 3;
+				info.pict_type_ = (code[2] & 0x38) >> 3;
 
 				if (info.pict_type_ == av_picture_type_i)
 				{
@@ -1237,42 +1215,175 @@ namespace util {
 					break;
 				}
 			}
-
-			ptr += 3;
 		}
 	}
 
-	bool mpegts_parser::do_parser(const uint8_t* parse_ptr, mpegts_info& info, bool check_crc/* = false*/)
+	inline void mpegts_parser::check_continuity(const mpegts_info& info)
 	{
-		bool ret = do_internal_parser(parse_ptr, info);
-
 #if CONTINUITY_CHECK
 		// 检查cc的连续性.
-		if (ret)
+		if (info.pid_ < 0 || info.pid_ >= 0x2000)
+			return;
+		if (info.cc_ != m_cc_pids[info.pid_] + 1)
 		{
-			if (info.pid_ < 0 || info.pid_ >= 0x2000)
-				return ret;
-			if (info.cc_ != m_cc_pids[info.pid_] + 1)
+			if (m_cc_pids[info.pid_] == -1) // first set cc.
+				m_cc_pids[info.pid_] = info.cc_;
+			else
 			{
-				if (m_cc_pids[info.pid_] == -1) // first set cc.
-					m_cc_pids[info.pid_] = info.cc_;
-				else
+				if (m_cc_pids[info.pid_] != 0xf || info.cc_ != 0x0)
 				{
-					if (m_cc_pids[info.pid_] != 0xf || info.cc_ != 0x0)
-					{
-						std::cerr << "Continuity check failed for pid " << info.pid_ <<
-							" expected " << (int)m_cc_pids[info.pid_] + 1 <<
-							", got " << info.cc_ << std::endl;
-					}
+					std::cerr << "Continuity check failed for pid " << info.pid_ <<
+						" expected " << (int)m_cc_pids[info.pid_] + 1 <<
+						", got " << info.cc_ << std::endl;
 				}
 			}
-			m_cc_pids[info.pid_] = info.cc_;
 		}
+		m_cc_pids[info.pid_] = info.cc_;
+#else
+		(void)info;
 #endif
+	}
+
+	void mpegts_parser::set_pid_filter(const std::vector<uint16_t>& pids, pid_filter_mode mode)
+	{
+		clear_pid_filter();
+		if (mode == pid_filter_none)
+			return;
+
+		for (auto pid : pids)
+		{
+			if (pid < 0x2000)
+				m_pid_filter.set(pid);
+		}
+
+		// 白名单即过滤掉名单之外的所有pid.
+		if (mode == pid_filter_whitelist)
+			m_pid_filter.flip();
+	}
+
+	void mpegts_parser::clear_pid_filter()
+	{
+		m_pid_filter.reset();
+	}
+
+	void mpegts_parser::set_pid_fields(uint16_t pid, int fields)
+	{
+		if (pid < 0x2000)
+			m_pid_fields[pid] = static_cast<uint8_t>(fields);
+	}
+
+	bool mpegts_parser::set_packet_size(int packet_size)
+	{
+		if (packet_size != ts_packet_188 &&
+			packet_size != ts_packet_192 &&
+			packet_size != ts_packet_204)
+			return false;
+
+		m_packet_size = packet_size;
+		return true;
+	}
+
+	int mpegts_parser::packet_size() const
+	{
+		return m_packet_size;
+	}
+
+	bool mpegts_parser::do_parser(const uint8_t* parse_ptr, mpegts_info& info, bool check_crc/* = false*/)
+	{
+		if (m_packet_size == ts_packet_192)
+		{
+			info.arrival_time_ = ts_packet_traits<ts_packet_192>::arrival_time(parse_ptr);
+			parse_ptr += ts_packet_traits<ts_packet_192>::prefix;
+		}
+
+		bool ret = do_internal_parser(parse_ptr, info, check_crc);
+		if (ret)
+			check_continuity(info);
 
 		return ret;
 	}
 
+	size_t mpegts_parser::do_parser_batch(const uint8_t* buf, size_t n_packets, mpegts_batch& batch, bool check_crc/* = false*/)
+	{
+		// 按包格式实例化解析循环, 使包间隔和前缀在编译期确定.
+		switch (m_packet_size)
+		{
+		case ts_packet_192:
+			return do_parser_batch_impl<ts_packet_traits<ts_packet_192>>(buf, n_packets, batch, check_crc);
+		case ts_packet_204:
+			return do_parser_batch_impl<ts_packet_traits<ts_packet_204>>(buf, n_packets, batch, check_crc);
+		default:
+			return do_parser_batch_impl<ts_packet_traits<ts_packet_188>>(buf, n_packets, batch, check_crc);
+		}
+	}
+
+	template <typename Traits>
+	size_t mpegts_parser::do_parser_batch_impl(const uint8_t* buf, size_t n_packets, mpegts_batch& batch, bool check_crc)
+	{
+		const uint8_t* packet_ptr = buf;
+		mpegts_info info;
+		size_t n = 0;
+
+		for (; n < n_packets; n++, packet_ptr += Traits::size)
+		{
+			const uint8_t* parse_ptr = packet_ptr + Traits::prefix;
+
+			// 复用同一个info, 只重置会被解析过程写入的字段.
+			info.pict_type_ = av_picture_type_none;
+			info.type_ = mpegts_info::reserve;
+			info.pcr_ = -1;
+			info.pts_ = -1;
+			info.dts_ = -1;
+			info.is_video_ = false;
+			info.is_audio_ = false;
+			info.payload_begin_ = nullptr;
+			info.payload_end_ = nullptr;
+
+			if (!do_internal_parser(parse_ptr, info, check_crc))
+				break;
+			check_continuity(info);
+
+			if (batch.pid_)
+				batch.pid_[n] = static_cast<uint16_t>(info.pid_);
+			if (batch.flags_)
+			{
+				batch.flags_[n] = (info.start_ ? mpegts_batch::flag_start : 0) |
+					(info.is_video_ ? mpegts_batch::flag_video : 0) |
+					(info.is_audio_ ? mpegts_batch::flag_audio : 0) |
+					(info.type_ == mpegts_info::idr ? mpegts_batch::flag_idr : 0);
+			}
+			if (batch.type_)
+				batch.type_[n] = static_cast<uint8_t>(info.type_);
+			if (batch.cc_)
+				batch.cc_[n] = static_cast<uint8_t>(info.cc_);
+			if (batch.pict_type_)
+				batch.pict_type_[n] = static_cast<uint8_t>(info.pict_type_);
+			if (batch.pcr_)
+				batch.pcr_[n] = info.pcr_;
+			if (batch.pts_)
+				batch.pts_[n] = info.pts_;
+			if (batch.dts_)
+				batch.dts_[n] = info.dts_;
+			if (batch.arrival_time_)
+				batch.arrival_time_[n] = Traits::arrival_time(packet_ptr);
+			if (batch.payload_begin_ || batch.payload_end_)
+			{
+				uint8_t begin = TS_SIZE, end = TS_SIZE;
+				if (info.payload_begin_)
+				{
+					begin = static_cast<uint8_t>(info.payload_begin_ - parse_ptr);
+					end = static_cast<uint8_t>(info.payload_end_ - parse_ptr);
+				}
+				if (batch.payload_begin_)
+					batch.payload_begin_[n] = begin;
+				if (batch.payload_end_)
+					batch.payload_end_[n] = end;
+			}
+		}
+
+		return n;
+	}
+
 	std::vector<uint8_t>& mpegts_parser::matadata()
 	{
 		return m_matadata;
@@ -1285,13 +1396,240 @@ namespace util {
 
 	uint16_t mpegts_parser::stream_type(const std::string& name) const
 	{
-		for (const auto& t : m_stream_types)
+		return stream_type_by_name(name.c_str());
+	}
+
+	void mpegts_parser::copy_stream_info(const mpegts_parser& other)
+	{
+		m_packet_size = other.m_packet_size;
+		m_pid_filter = other.m_pid_filter;
+		m_pid_fields = other.m_pid_fields;
+
+		m_streams = other.m_streams;
+		m_video_elementary_PIDs = other.m_video_elementary_PIDs;
+		m_audio_elementary_PIDs = other.m_audio_elementary_PIDs;
+		m_pmt_pids = other.m_pmt_pids;
+		m_has_pat = other.m_has_pat;
+		m_pcr_pid = other.m_pcr_pid;
+		m_matadata = other.m_matadata;
+
+		// 只保留已解析的版本, 未完成的section和cc与输入位置相关.
+		m_psi_sections.clear();
+		for (const auto& s : other.m_psi_sections)
+			m_psi_sections[s.first].versions_ = s.second.versions_;
+	}
+
+	bool mpegts_parser::stream_info_ready() const
+	{
+		if (!m_has_pat)
+			return false;
+
+		for (size_t pid = 0; pid < m_pmt_pids.size(); pid++)
+		{
+			if (!m_pmt_pids[pid])
+				continue;
+
+			auto found = m_psi_sections.find(static_cast<uint16_t>(pid));
+			if (found == m_psi_sections.end())
+				return false;
+			const auto& versions = found->second.versions_;
+			if (std::find_if(versions.begin(), versions.end(),
+				[](int64_t v) { return v != -1; }) == versions.end())
+				return false;
+		}
+
+		return true;
+	}
+
+	bool mpegts_parser::frame_type_pending(uint16_t pid) const
+	{
+		return !m_type_pids[pid & 0x1fff];
+	}
+
+	bool mpegts_parser::is_psi_pid(uint16_t pid) const
+	{
+		return pid == 0 || (m_has_pat && m_pmt_pids[pid & 0x1fff]);
+	}
+
+	namespace {
+
+		const char parser_state_magic[4] = { 'M', 'T', 'P', 'S' };
+		const uint32_t parser_state_version = 1;
+
+		// 位集合按值变化的位置保存, 通常只有几段.
+		void put_bits(blob_writer& w, const std::bitset<0x2000>& bits)
+		{
+			std::vector<uint16_t> edges;
+			bool last = false;
+			for (size_t i = 0; i < bits.size(); i++)
+			{
+				if (bits[i] != last)
+				{
+					edges.push_back(static_cast<uint16_t>(i));
+					last = bits[i];
+				}
+			}
+			w.put_u16(static_cast<uint16_t>(edges.size()));
+			for (auto e : edges)
+				w.put_u16(e);
+		}
+
+		bool get_bits(blob_reader& r, std::bitset<0x2000>& bits)
+		{
+			bits.reset();
+			size_t count = r.get_u16();
+			size_t pos = 0;
+			bool value = false;
+			for (size_t i = 0; i < count && r.ok(); i++)
+			{
+				size_t edge = r.get_u16();
+				if (edge < pos || edge >= bits.size())
+					return false;
+				for (; pos < edge; pos++)
+					bits[pos] = value;
+				value = !value;
+			}
+			for (; pos < bits.size(); pos++)
+				bits[pos] = value;
+			return r.ok();
+		}
+
+		// 每个pid一个字节的表, 只保存与默认值不同的项.
+		template <typename T>
+		void put_table(blob_writer& w, const std::vector<T>& table, T value)
+		{
+			uint16_t count = 0;
+			for (auto v : table)
+				count += v != value;
+			w.put_u16(count);
+			for (size_t pid = 0; pid < table.size(); pid++)
+			{
+				if (table[pid] == value)
+					continue;
+				w.put_u16(static_cast<uint16_t>(pid));
+				w.put_u8(static_cast<uint8_t>(table[pid]));
+			}
+		}
+
+		template <typename T>
+		bool get_table(blob_reader& r, std::vector<T>& table, T value)
+		{
+			table.assign(0x2000, value);
+			size_t count = r.get_u16();
+			for (size_t i = 0; i < count && r.ok(); i++)
+			{
+				uint16_t pid = r.get_u16();
+				uint8_t v = r.get_u8();
+				if (pid >= table.size())
+					return false;
+				table[pid] = static_cast<T>(v);
+			}
+			return r.ok();
+		}
+	}
+
+	void mpegts_parser::snapshot(std::vector<uint8_t>& out) const
+	{
+		out.clear();
+		blob_writer w(out);
+		w.put_raw(parser_state_magic, sizeof(parser_state_magic));
+		w.put_u32(parser_state_version);
+
+		w.put_u32(static_cast<uint32_t>(m_packet_size));
+		w.put_u8(m_has_pat ? 1 : 0);
+		w.put_u16(static_cast<uint16_t>(m_pcr_pid));
+
+		put_bits(w, m_video_elementary_PIDs);
+		put_bits(w, m_audio_elementary_PIDs);
+		put_bits(w, m_pmt_pids);
+		put_bits(w, m_type_pids);
+		put_bits(w, m_pid_filter);
+		put_table(w, m_cc_pids, static_cast<int8_t>(-1));
+		put_table(w, m_pid_fields, static_cast<uint8_t>(parse_all));
+		put_table(w, m_streams, static_cast<uint8_t>(0));
+		w.put_bytes(m_matadata.data(), m_matadata.size());
+
+		w.put_u16(static_cast<uint16_t>(m_psi_sections.size()));
+		for (const auto& s : m_psi_sections)
+		{
+			const psi_section& state = s.second;
+			w.put_u16(s.first);
+			w.put_u8(static_cast<uint8_t>(state.cc_));
+			w.put_u32(static_cast<uint32_t>(state.need_));
+			w.put_bytes(state.buffer_.data(), state.buffer_.size());
+			w.put_u16(static_cast<uint16_t>(state.versions_.size()));
+			for (auto v : state.versions_)
+				w.put_i64(v);
+		}
+	}
+
+	bool mpegts_parser::restore(const uint8_t* data, size_t size)
+	{
+		blob_reader r(data, size);
+		char magic[4];
+		if (!r.get_raw(magic, sizeof(magic)) ||
+			std::memcmp(magic, parser_state_magic, sizeof(magic)) != 0 ||
+			r.get_u32() != parser_state_version)
+		{
+			std::cerr << "invalid parser state" << std::endl;
+			return false;
+		}
+
+		// 先全部读入临时变量, 数据完整后再替换当前状态.
+		int packet_size = static_cast<int>(r.get_u32());
+		bool has_pat = r.get_u8() != 0;
+		int16_t pcr_pid = static_cast<int16_t>(r.get_u16());
+
+		std::bitset<0x2000> video, audio, pmt, type, filter;
+		std::vector<int8_t> cc;
+		std::vector<uint8_t> fields, streams, matadata;
+		std::map<uint16_t, psi_section> sections;
+		bool ok = get_bits(r, video) && get_bits(r, audio) && get_bits(r, pmt) &&
+			get_bits(r, type) && get_bits(r, filter) &&
+			get_table(r, cc, static_cast<int8_t>(-1)) &&
+			get_table(r, fields, static_cast<uint8_t>(parse_all)) &&
+			get_table(r, streams, static_cast<uint8_t>(0)) &&
+			r.get_bytes(matadata, 188 * 2) &&
+			// 保存PAT和PMT各一个包, 写入时只在为空时分配.
+			(matadata.empty() || matadata.size() == 188 * 2);
+
+		size_t count = r.get_u16();
+		for (size_t i = 0; ok && i < count; i++)
+		{
+			uint16_t pid = r.get_u16();
+			psi_section& state = sections[pid];
+			state.cc_ = static_cast<int8_t>(r.get_u8());
+			state.need_ = r.get_u32();
+			ok = r.get_bytes(state.buffer_, max_section_size) && state.need_ <= max_section_size &&
+				state.buffer_.size() <= state.need_;
+			size_t versions = r.get_u16();
+			if (versions > 256)
+				ok = false;
+			for (size_t k = 0; ok && k < versions; k++)
+				state.versions_.push_back(r.get_i64());
+		}
+
+		if (!ok || !r.ok() || r.remaining() ||
+			(packet_size != ts_packet_188 && packet_size != ts_packet_192 && packet_size != ts_packet_204))
 		{
-			if (t.second == name)
-				return t.first;
+			std::cerr << "invalid parser state" << std::endl;
+			return false;
 		}
 
-		return 0;
+		m_packet_size = packet_size;
+		m_has_pat = has_pat;
+		m_pcr_pid = pcr_pid;
+		m_video_elementary_PIDs = video;
+		m_audio_elementary_PIDs = audio;
+		m_pmt_pids = pmt;
+		m_type_pids = type;
+		m_pid_filter = filter;
+		m_cc_pids.swap(cc);
+		m_pid_fields.swap(fields);
+		m_streams.swap(streams);
+		m_matadata.swap(matadata);
+		m_psi_sections.swap(sections);
+		return true;
 	}
 
 	bool mpegts_parser::init_streams(const std::vector<stream_info>& streams)
@@ -1315,44 +1653,61 @@ namespace util {
 
 			p.stream_type_ = s.stream_type_;
 
-			if (p.stream_type_ == 0x01 ||
-				p.stream_type_ == 0x02 ||
-				p.stream_type_ == 0x03 ||
-				p.stream_type_ == 0x04 ||
-				p.stream_type_ == 0x05 ||
-				p.stream_type_ == 0x06 ||
-				p.stream_type_ == 0x07 ||
-				p.stream_type_ == 0x08 ||
-				p.stream_type_ == 0x09 ||
-				p.stream_type_ == 0x0a ||
-				p.stream_type_ == 0x0b ||
-				p.stream_type_ == 0x0c ||
-				p.stream_type_ == 0x0d ||
-				p.stream_type_ == 0x0e ||
-				p.stream_type_ == 0x0f ||
-				p.stream_type_ == 0x10 ||
-				p.stream_type_ == 0x11 ||
-				p.stream_type_ == 0x12 ||
-				p.stream_type_ == 0x13 ||
-				p.stream_type_ == 0x14 ||
-				p.stream_type_ == 0x1b ||
-				p.stream_type_ == 0x20 ||
-				p.stream_type_ == 0x24 ||
-				p.stream_type_ == 0x42 ||
-				p.stream_type_ == 0xd1 ||
-				p.stream_type_ == 0xea)
-			{
-				// stream type is ok.
-			}
-			else
+			if (p.stream_type_ < 0 || p.stream_type_ > 0xff ||
+				!stream_traits(static_cast<uint8_t>(p.stream_type_)).muxable)
 			{
 				return false;
 			}
 		}
 
+		// 与PMT中的PCR_PID一致, 有视频时为视频pid, 否则为第一个流.
+		m_mux_pcr_pid = -1;
+		for (auto& s : m_mpegts)
+		{
+			if (m_mux_pcr_pid == -1 || s.second.is_video_)
+				m_mux_pcr_pid = s.first;
+		}
+
+		// 流信息变化, 重新生成PAT/PMT, 已经开始编码时更新版本号并立即插入.
+		m_psi_packets.clear();
+		if (m_packet_count != -1)
+			m_psi_version = (m_psi_version + 1) & 0x1f;
+		m_last_psi_pcr = -1;
+
 		return true;
 	}
 
+	void mpegts_parser::set_psi_interval(int milliseconds)
+	{
+		m_psi_interval = static_cast<int64_t>(milliseconds) * (PCR_TIME_BASE / 1000);
+	}
+
+	void mpegts_parser::set_mux_rate(int64_t bits_per_second)
+	{
+		m_mux_rate = bits_per_second > 0 ? bits_per_second : 0;
+	}
+
+	void mpegts_parser::set_pcr_interval(int milliseconds)
+	{
+		milliseconds = (std::max)(1, (std::min)(milliseconds, 40));
+		m_pcr_interval = static_cast<int64_t>(milliseconds) * (PCR_TIME_BASE / 1000);
+	}
+
+	void mpegts_parser::set_mux_delay(int milliseconds)
+	{
+		m_mux_delay = static_cast<int64_t>((std::max)(0, milliseconds)) * (PCR_TIME_BASE / 1000);
+	}
+
+	void mpegts_parser::set_stream_buffer(uint16_t pid, size_t bytes)
+	{
+		m_tstd[pid].size_ = bytes;
+	}
+
+	int64_t mpegts_parser::mux_underflows() const
+	{
+		return m_mux_underflows;
+	}
+
 	void mpegts_parser::add_pat(uint8_t* ts)
 	{
 		// TS HEADER.
@@ -1360,7 +1715,7 @@ namespace util {
 		ts_set_transportpriority(ts);
 		ts_set_payload(ts);
 		ts_set_unitstart(ts);
-		ts_set_cc(ts, m_pat_count++);
+		ts_set_cc(ts, 0);	// 插入时再设置.
 		// ts_set_adaptation(ts, 0); // PAT不添加adaptation.
 
 		// TS SECTION.
@@ -1377,7 +1732,7 @@ namespace util {
 		psi_set_length(section, static_cast<uint16_t>(section_size));
 		psi_set_number(section, 1); // program_number.
 
-		psi_set_version(section, 1);
+		psi_set_version(section, m_psi_version);
 		psi_set_current(section);
 		psi_set_section(section, 0);
 		psi_set_lastsection(section, 0);
@@ -1401,7 +1756,7 @@ namespace util {
 		ts_set_transportpriority(ts);
 		ts_set_payload(ts);
 		ts_set_unitstart(ts);
-		ts_set_cc(ts, m_pmt_count++);
+		ts_set_cc(ts, 0);
 		// ts_set_adaptation(ts, 0); // PMT不添加adaptation.
 
 		// TS SECTION.
@@ -1418,7 +1773,7 @@ namespace util {
 		auto section_size = stream_size * 5 + 9 + 4;
 		psi_set_length(section, static_cast<uint16_t>(section_size));
 		psi_set_number(section, 1);	// transport_stream_id.
-		psi_set_version(section, 1);
+		psi_set_version(section, m_psi_version);
 		psi_set_current(section);
 		psi_set_section(section, 0);
 		psi_set_lastsection(section, 0);
@@ -1445,6 +1800,12 @@ namespace util {
 	}
 
 	bool mpegts_parser::mux_stream(const mpegts_info& info)
+	{
+		mpegts_span span = { info.payload_begin_, static_cast<size_t>(info.payload_end_ - info.payload_begin_) };
+		return mux_stream(info, &span, 1);
+	}
+
+	bool mpegts_parser::mux_stream(const mpegts_info& info, const mpegts_span* nals, size_t count, int flags)
 	{
 		// 查询是否在编码容器当中.
 		auto found = m_mpegts.find(info.pid_);
@@ -1455,24 +1816,110 @@ namespace util {
 
 		auto& cur_stream = found->second;
 
+		// 需要插入起始码或AUD时生成新的片段列表, 插入的数据都是静态常量.
+		uint8_t codec = stream_traits(static_cast<uint8_t>(cur_stream.stream_type_)).codec;
+		bool h264 = codec == video_h264;
+		bool hevc = codec == video_hevc;
+		if ((flags & mux_nal_aud) && !h264 && !hevc)
+			flags &= ~mux_nal_aud;
+		if (flags)
+		{
+			static const uint8_t start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+			static const uint8_t h264_aud[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+			static const uint8_t hevc_aud[] = { 0x00, 0x00, 0x00, 0x01, 0x46, 0x01, 0x50 };
+
+			m_mux_spans.clear();
+			if (flags & mux_nal_aud)
+			{
+				// 第一个NAL已经是AUD时不再插入.
+				const mpegts_span* first = count ? &nals[0] : nullptr;
+				const uint8_t* nal = first ? first->data_ : nullptr;
+				size_t size = first ? first->size_ : 0;
+				if (!(flags & mux_nal_annexb))
+				{
+					// 跳过片段开头的起始码.
+					while (size > 1 && nal[0] == 0)
+					{
+						nal++;
+						size--;
+					}
+					if (size > 1 && nal[0] == 1)
+					{
+						nal++;
+						size--;
+					}
+					else
+						size = 0;
+				}
+				bool has_aud = size > 0 && (h264 ? (nal[0] & 0x1f) == 9 : ((nal[0] >> 1) & 0x3f) == 35);
+				if (!has_aud)
+				{
+					mpegts_span aud = { h264 ? h264_aud : hevc_aud, h264 ? sizeof(h264_aud) : sizeof(hevc_aud) };
+					m_mux_spans.push_back(aud);
+				}
+			}
+			for (size_t i = 0; i < count; i++)
+			{
+				if (flags & mux_nal_annexb)
+				{
+					mpegts_span sc = { start_code, sizeof(start_code) };
+					m_mux_spans.push_back(sc);
+				}
+				m_mux_spans.push_back(nals[i]);
+			}
+			nals = m_mux_spans.data();
+			count = m_mux_spans.size();
+		}
+
 		bool write_pat_pmt = false;
 		bool write_pcr = true;
-		bool only_audio = false;
-
-		// 判断是否添加pat pmt, 如果只有音频, 那就按pcr一样
-		// 的规则插入pat pmt包.
 		auto stream_size = m_mpegts.size();
-		if (stream_size == 1 && info.is_audio_)
-			only_audio = true;
 
 		// 如果是开始编码，那就必须插入pcr, pat, pmt.
-		if (m_packet_count == -1)
+		bool start = m_packet_count == -1;
+		if (start)
 		{
 			write_pat_pmt = true;
 			write_pcr = true;
 			m_packet_count = 0;
 		}
 
+		// 记录最近的时间戳, 之后没有时间戳的访问单元从这里按字节数推算时钟.
+		if (info.dts_ != -1 || info.pts_ != -1)
+		{
+			m_mux_last_clock = (info.dts_ != -1 ? info.dts_ : info.pts_) * 300;
+			m_mux_clock_bytes = m_total_bytes;
+		}
+
+		// 固定码率时根据解码时间和T-STD缓冲模型确定发送时间, 之前用空包填充.
+		int64_t decode_time = -1;
+		size_t total = 0;
+		if (m_mux_rate)
+		{
+			for (size_t i = 0; i < count; i++)
+				total += nals[i].size_;
+			decode_time = mux_decode_time(info);
+			if (start)
+			{
+				m_cbr_base = (decode_time != -1 ? decode_time : 0) - m_mux_delay;
+			}
+			else if (decode_time != -1)
+			{
+				// 向前跳变时不能用空包填充到新的时间, 向后跳变时所有访问单元都会迟到.
+				int64_t now = cbr_clock(m_total_bytes);
+				if (decode_time - now > m_mux_delay + MUX_MAX_JUMP || now - decode_time > MUX_MAX_JUMP)
+					mux_rebase(decode_time);
+			}
+			if (decode_time == -1)
+				decode_time = mux_clock(info) + m_mux_delay;
+			mux_pace(cur_stream, decode_time, total);
+		}
+
+		// 按pcr时间间隔重复插入pat pmt, 时间大幅回退(如回绕)时也立即插入.
+		int64_t now = mux_clock(info);
+		if (psi_due(now))
+			write_pat_pmt = true;
+
 		// 如果有音视频, 且此次写入的是音频, 则不写入pcr.
 		if (info.is_audio_ && stream_size > 1)
 		{
@@ -1481,154 +1928,339 @@ namespace util {
 
 		// 插入pat/pmt包.
 		if (write_pat_pmt)
-		{
-			// 添加PAT包.
-			auto pat_data = m_mpegts_data.prepare(188);
-			add_pat(pat_data);
-			m_mpegts_data.commit(188);
+			write_psi(now);
 
-			// 添加PMT包.
-			auto pmt_data = m_mpegts_data.prepare(188);
-			add_pmt(pmt_data);
-			m_mpegts_data.commit(188);
+		write_pes(cur_stream, info, nals, count, write_pcr);
 
-			// 更新字节数.
-			m_total_bytes += (188 * 2);
-			m_packet_count += 2;
+		// 最后一个字节在解码时间之后到达, 码率不足.
+		if (m_mux_rate)
+		{
+			auto& buffer = m_tstd[info.pid_];
+			if (mux_clock(info) > decode_time)
+				m_mux_underflows++;
+			buffer.fill_ += total;
+			buffer.units_.push_back(std::make_pair(decode_time, total));
 		}
 
-		bool unitstart = true;
-		const uint8_t* begin = info.payload_begin_;
-		const uint8_t* end = info.payload_end_;
-		for (; begin != end;)
+		return true;
+	}
+
+	void mpegts_parser::write_psi(int64_t now)
+	{
+		// PAT/PMT只在流信息变化后生成一次, 每次插入只修改连续计数.
+		if (m_psi_packets.empty())
 		{
-			// 以188为1个TS包写入流.
-			auto ts = m_mpegts_data.prepare(188);
+			m_psi_packets.resize(TS_SIZE * 2);
+			add_pat(&m_psi_packets[0]);
+			add_pmt(&m_psi_packets[TS_SIZE]);
+		}
 
-			// TS HEADER.
-			ts_set_pid(ts, 0);
-			ts_set_transportpriority(ts);
-			ts_set_payload(ts);
-			ts_set_cc(ts, cur_stream.cc_++);
-			if (unitstart)
-				ts_set_unitstart(ts);	// 设置为起始包.
-
-			if (write_pcr)
+		// 固定码率时PAT/PMT连续写入2个包, 之前检查pcr间隔.
+		if (pcr_due(2))
+			write_pcr_packet();
+
+		auto ts = m_mpegts_data.prepare(TS_SIZE * 2);
+		memcpy(ts, m_psi_packets.data(), TS_SIZE * 2);
+		ts_set_cc(ts, m_pat_count++);
+		ts_set_cc(ts + TS_SIZE, m_pmt_count++);
+		m_mpegts_data.commit(TS_SIZE * 2);
+
+		// 更新字节数.
+		m_total_bytes += TS_SIZE * 2;
+		m_packet_count += 2;
+		m_last_psi_pcr = now;
+	}
+
+	int64_t mpegts_parser::mux_clock(const mpegts_info& info) const
+	{
+		// 固定码率时由输出的字节数决定.
+		if (m_mux_rate)
+			return cbr_clock(m_total_bytes);
+
+		// 优先使用dts, 没有dts时使用pts, 都没有时从上一个时间戳按名义码率推算.
+		if (info.dts_ != -1)
+			return info.dts_ * 300;
+		if (info.pts_ != -1)
+			return info.pts_ * 300;
+		return m_mux_last_clock +
+			av_rescale(m_total_bytes - m_mux_clock_bytes + 11, 8 * PCR_TIME_BASE, MUX_NOMINAL_RATE);
+	}
+
+	int64_t mpegts_parser::cbr_clock(int64_t bytes) const
+	{
+		return m_cbr_base + av_rescale(bytes, 8 * PCR_TIME_BASE, m_mux_rate);
+	}
+
+	bool mpegts_parser::psi_due(int64_t now) const
+	{
+		if (m_last_psi_pcr == -1)
+			return true;
+
+		// 非固定码率时now为各pid自己的解码时间, 按33位回绕取差值, 交错的pid之间
+		// 小的回退是正常的, 只有大幅回退(时间戳跳变)时才立即插入. 没有时间戳的
+		// 访问单元由mux_clock按名义码率推算, 与输出的数据量成比例, 不会每次都插入.
+		const int64_t wrap = MPEGTS_TS_WRAP * 300;
+		int64_t diff = (now - m_last_psi_pcr) % wrap;
+		if (diff > wrap / 2)
+			diff -= wrap;
+		else if (diff < -wrap / 2)
+			diff += wrap;
+		return diff < -MUX_MAX_JUMP || (m_psi_interval > 0 && diff >= m_psi_interval);
+	}
+
+	bool mpegts_parser::pcr_due(int packets) const
+	{
+		// 再写packets个包之后下一个pcr会超过间隔时立即写入.
+		return m_mux_rate && (m_last_pcr == -1 ||
+			cbr_clock(m_total_bytes + packets * TS_SIZE + 11) - m_last_pcr > m_pcr_interval);
+	}
+
+	int64_t mpegts_parser::mux_decode_time(const mpegts_info& info)
+	{
+		int64_t ts = info.dts_ != -1 ? info.dts_ : info.pts_;
+		if (ts == -1)
+			return -1;
+
+		// 取与上一个解码时间最接近的展开值, 各pid的解码时间交错时不会误判回绕.
+		int64_t t = (ts & (MPEGTS_TS_WRAP - 1)) + m_mux_dts_offset;
+		if (m_mux_last_dts != -1)
+		{
+			if (m_mux_last_dts - t > MPEGTS_TS_WRAP / 2)
 			{
-				write_pcr = false;
-
-				ts_set_adaptation(ts, 7);	// 写入pcr信息.
-				// auto afc = ts_adaptation_field(ts);
-				// *afc = 0b00100000;		// only PCR_flag.
-				tsaf_set_discontinuity(ts);
-				tsaf_set_randomaccess(ts);
-				tsaf_set_streampriority(ts);
-
-				int64_t pcr = 0;
-				if (info.dts_ != -1)
-					pcr = info.dts_ * 300;
-				else
-					pcr = av_rescale(m_total_bytes + 11, 8 * PCR_TIME_BASE, 1) + m_first_pcr;
-				int64_t pcr_low = pcr % 300, pcr_high = pcr / 300;
-				tsaf_set_pcr(ts, pcr_high);
-				tsaf_set_pcrext(ts, static_cast<uint16_t>(pcr_low));
+				m_mux_dts_offset += MPEGTS_TS_WRAP;
+				t += MPEGTS_TS_WRAP;
+			}
+			else if (t - m_mux_last_dts > MPEGTS_TS_WRAP / 2 && m_mux_dts_offset >= MPEGTS_TS_WRAP)
+			{
+				m_mux_dts_offset -= MPEGTS_TS_WRAP;
+				t -= MPEGTS_TS_WRAP;
 			}
+		}
+		m_mux_last_dts = t;
+		return t * 300;
+	}
+
+	void mpegts_parser::mux_rebase(int64_t decode_time)
+	{
+		m_cbr_base += decode_time - m_mux_delay - cbr_clock(m_total_bytes);
+		for (auto& b : m_tstd)
+		{
+			b.second.units_.clear();
+			b.second.fill_ = 0;
+		}
 
-			// 数据写入位置.
-			auto payload = ts_payload(ts);
+		// 立即按新的时钟写入pcr和PAT/PMT.
+		m_last_pcr = -1;
+		m_last_psi_pcr = -1;
+		m_pcr_discontinuity = true;
+	}
 
-			// 如果是关键帧, 则开始写入PES.
-			if (info.pict_type_ == av_picture_type_i && unitstart)
+	void mpegts_parser::mux_pace(const mpegts_info& stream, int64_t decode_time, size_t size)
+	{
+		auto& buffer = m_tstd[stream.pid_];
+		if (buffer.size_ == 0)
+		{
+			// 没有指定时按常用的级别估计: 音频3584字节(BSn), mpeg2视频MP@ML的VBV,
+			// 其它视频按h264 level 4的CPB.
+			uint8_t codec = stream_traits(static_cast<uint8_t>(stream.stream_type_)).codec;
+			if (stream.is_audio_)
+				buffer.size_ = 3584;
+			else if (codec == video_mpeg2 || codec == video_mpeg1)
+				buffer.size_ = 1835008 / 8;
+			else
+				buffer.size_ = 25000000 / 8;
+		}
+
+		// 不早于解码时间前m_mux_delay发送, 否则输入快于实时的时候输出会无限超前.
+		pad_until(decode_time - m_mux_delay);
+
+		// 缓冲中放不下时, 等待之前的访问单元到达解码时间被移出.
+		while (true)
+		{
+			int64_t now = cbr_clock(m_total_bytes);
+			while (!buffer.units_.empty() && buffer.units_.front().first <= now)
 			{
-				int stream_id = -1;
-				if (info.is_video_)
-				{
-					if (cur_stream.stream_type_ == video_dirac)
-						stream_id = 0xfd;
-					else
-						stream_id = 0xe0;
-				}
-				else
-				{
-					if (cur_stream.stream_type_ == audio_mpeg2||
-						cur_stream.stream_type_ == audio_mpeg1||
-						cur_stream.stream_type_ == audio_aac||
-						cur_stream.stream_type_ == audio_aac_latm)
-						stream_id = 0xc0;
-					else if (cur_stream.stream_type_ == audio_ac3)
-						stream_id = 0xfd;
-					else
-						stream_id = 0xfc;
-				}
+				buffer.fill_ -= buffer.units_.front().second;
+				buffer.units_.pop_front();
+			}
+			if (buffer.units_.empty() || buffer.fill_ + size <= buffer.size_)
+				break;
+			pad_until(buffer.units_.front().first);
+		}
+	}
 
-				auto pes = ts_payload(ts);
-				pes_init(pes);
-				int pes_header_length = 0;
-				if (info.dts_ != -1)
-					pes_header_length += 5;
-				if (info.pts_ != -1)
-					pes_header_length += 5;
-				pes_set_streamid(pes, stream_id);
-				// total pes length = PES_HEADER_SIZE + PES_HEADER_OPTIONAL_SIZE
-				//					  + pes_header_length + pes_length.
-				pes_set_length(pes, 0);
-				pes_set_headerlength(pes, pes_header_length);
-				if (info.dts_ != -1)
-					pes_set_dts(pes, info.dts_);
-				if (info.pts_ != -1)
-					pes_set_pts(pes, info.pts_);
-				payload = pes_payload(pes);
+	void mpegts_parser::pad_until(int64_t time)
+	{
+		while (cbr_clock(m_total_bytes) < time)
+		{
+			int64_t now = cbr_clock(m_total_bytes);
+			if (pcr_due())
+			{
+				write_pcr_packet();
+			}
+			else if (psi_due(now))
+			{
+				write_psi(now);
 			}
+			else
+			{
+				// 空包.
+				auto ts = m_mpegts_data.prepare(TS_SIZE);
+				ts[0] = 0x47;
+				ts[1] = 0x1f;
+				ts[2] = 0xff;
+				ts[3] = 0x10;
+				memset(ts + TS_HEADER_SIZE, 0xff, TS_SIZE - TS_HEADER_SIZE);
+				m_mpegts_data.commit(TS_SIZE);
+				m_total_bytes += TS_SIZE;
+				m_packet_count++;
+			}
+		}
+	}
 
-			auto header_len = payload - ts;
-			auto payload_size = end - begin;
-			auto len = TS_SIZE - header_len;
-			if (len > payload_size)
-				len = payload_size;
-			auto stuffing_len = TS_SIZE - header_len - len;
-			if (stuffing_len > 0)
+	void mpegts_parser::write_pcr_packet()
+	{
+		// 只有适配域的包, 连续计数与上一个包相同.
+		auto& stream = m_mpegts[m_mux_pcr_pid];
+		auto ts = m_mpegts_data.prepare(TS_SIZE);
+		ts[0] = 0x47;
+		ts[1] = (m_mux_pcr_pid >> 8) & 0x1f;
+		ts[2] = m_mux_pcr_pid & 0xff;
+		ts[3] = 0x20 | ((stream.cc_ - 1) & 0xf);
+		ts[4] = TS_SIZE - TS_HEADER_SIZE - 1;
+		ts[5] = 0;
+		int64_t pcr = cbr_clock(m_total_bytes + 11);
+		tsaf_set_pcr_clock(ts, pcr);
+		if (m_pcr_discontinuity)
+			ts[5] |= 0x80;
+		m_pcr_discontinuity = false;
+		memset(ts + TS_HEADER_SIZE_PCR, 0xff, TS_SIZE - TS_HEADER_SIZE_PCR);
+		m_mpegts_data.commit(TS_SIZE);
+		m_total_bytes += TS_SIZE;
+		m_packet_count++;
+		m_last_pcr = pcr;
+	}
+
+	void mpegts_parser::write_pes(mpegts_info& stream, const mpegts_info& info,
+		const mpegts_span* spans, size_t count, bool write_pcr)
+	{
+		size_t total = 0;
+		for (size_t i = 0; i < count; i++)
+			total += spans[i].size_;
+
+		// 只有dts时作为pts写入, 与pts相同时不写dts.
+		int64_t pts = info.pts_ != -1 ? info.pts_ : info.dts_;
+		int64_t dts = info.dts_ != pts ? info.dts_ : -1;
+		size_t pes_header_length = (pts != -1 ? 5 : 0) + (dts != -1 ? 5 : 0);
+		size_t pes_size = PES_HEADER_SIZE + PES_HEADER_OPTIONAL_SIZE + pes_header_length;
+
+		// PES_packet_length为其后的字节数, 超过16位时置0(只允许用于视频).
+		size_t pes_length = PES_HEADER_OPTIONAL_SIZE + pes_header_length + total;
+		if (pes_length > 0xffff)
+			pes_length = 0;
+
+		bool key = info.pict_type_ == av_picture_type_i;
+		uint8_t stream_id = stream_traits(static_cast<uint8_t>(stream.stream_type_)).stream_id;
+
+		size_t index = 0;
+		size_t offset = 0;
+		size_t left = total;
+		bool first = true;
+		do
+		{
+			// 固定码率时按间隔在pcr pid上写入pcr, 其它pid需要时插入单独的pcr包.
+			if (m_mux_rate && info.pid_ != m_mux_pcr_pid && pcr_due())
+				write_pcr_packet();
+
+			// 先计算出这个包的布局, 然后每个字节只写一次.
+			bool pcr = m_mux_rate ? info.pid_ == m_mux_pcr_pid && pcr_due() : first && write_pcr;
+			bool rai = first && key;
+			bool af = pcr || rai;
+			size_t af_length = pcr ? 7 : (rai ? 1 : 0);
+			size_t len = TS_SIZE - TS_HEADER_SIZE - (af ? 1 + af_length : 0) - (first ? pes_size : 0);
+			if (left < len)
 			{
-				if (ts_has_adaptation(ts))
-				{
-					// stuffing already present: increase its size.
-					auto afc_len = ts_get_adaptation_length(ts);
-					memmove(ts + 4 + afc_len + stuffing_len,
-						ts + 4 + afc_len,
-						header_len - (4 + afc_len));
-					ts[4] += stuffing_len;
-					memset(ts + 4 + afc_len, 0xff, stuffing_len);
-				}
+				// 不足一个包, 剩余空间用适配域填充.
+				size_t stuffing = len - left;
+				if (af)
+					af_length += stuffing;
 				else
+					af_length = stuffing - 1;
+				af = true;
+				len = left;
+			}
+
+			// TS HEADER.
+			uint8_t* ts = m_mpegts_data.prepare(TS_SIZE);
+			ts[0] = 0x47;
+			ts[1] = ((info.pid_ >> 8) & 0x1f) | (first ? 0x40 : 0);
+			ts[2] = info.pid_ & 0xff;
+			ts[3] = 0x10 | (stream.cc_++ & 0xf);
+
+			uint8_t* p = ts + TS_HEADER_SIZE;
+			if (af)
+			{
+				ts[3] |= 0x20;
+				ts[4] = static_cast<uint8_t>(af_length);
+				size_t used = 0;
+				if (af_length)
 				{
-					// add stuffing.
-					memmove(ts + 4 + stuffing_len, ts + 4, header_len - 4);
-					ts[3] |= 0x20;
-					ts[4] = stuffing_len - 1;
-					if (stuffing_len >= 2)
+					ts[5] = 0;
+					used = 1;
+					if (rai)
+						tsaf_set_randomaccess(ts);
+					if (pcr)
 					{
-						ts[5] = 0x00;
-						memset(ts + 6, 0xff, stuffing_len - 2);
+						int64_t pcr_value = m_mux_rate ? cbr_clock(m_total_bytes + 11) : mux_clock(info);
+						if (m_mux_rate)
+							m_last_pcr = pcr_value;
+						tsaf_set_pcr_clock(ts, pcr_value);
+						if (m_pcr_discontinuity)
+							ts[5] |= 0x80;
+						m_pcr_discontinuity = false;
+						used += 6;
 					}
+					memset(ts + 5 + used, 0xff, af_length - used);
 				}
+				p += 1 + af_length;
 			}
 
-			if (payload_size == len)
+			if (first)
 			{
-				memcpy(ts + TS_SIZE - len, begin, len - 1);
-				ts[TS_SIZE - 1] = 0xff;
+				pes_init(p);
+				pes_set_streamid(p, stream_id);
+				pes_set_length(p, static_cast<uint16_t>(pes_length));
+				p[6] = info.is_video_ ? 0x84 : 0x80;	// data_alignment_indicator.
+				p[7] = 0;
+				p[8] = static_cast<uint8_t>(pes_header_length);
+				if (dts != -1)
+					pes_set_dts(p, dts);
+				if (pts != -1)
+					pes_set_pts(p, pts);
+				p += pes_size;
 			}
-			else
+
+			// 从各个片段中依次拷贝负载.
+			left -= len;
+			while (len)
 			{
-				memcpy(ts + TS_SIZE - len, begin, len);
+				size_t k = (std::min)(len, spans[index].size_ - offset);
+				memcpy(p, spans[index].data_ + offset, k);
+				p += k;
+				len -= k;
+				offset += k;
+				if (offset == spans[index].size_)
+				{
+					index++;
+					offset = 0;
+				}
 			}
 
-			begin += len;
-			m_mpegts_data.commit(188);
+			m_mpegts_data.commit(TS_SIZE);
+			m_total_bytes += TS_SIZE;
 			m_packet_count++;
-			unitstart = false;
-		}
-
-		return false;
+			first = false;
+		} while (left);
 	}
 
 	size_t mpegts_parser::mpegts_size() const
@@ -1642,12 +2274,21 @@ namespace util {
 		m_mpegts_data.consume(size);
 	}
 
+	mpegts_span mpegts_parser::mpegts_output() const
+	{
+		mpegts_span span = { m_mpegts_data.data(), m_mpegts_data.size() };
+		return span;
+	}
+
+	void mpegts_parser::release_mpegts(size_t n)
+	{
+		m_mpegts_data.consume(n);
+	}
+
 	std::string mpegts_parser::stream_name(uint16_t pid) const
 	{
-		auto found = m_stream_types.find(m_streams[pid]);
-		if (found != m_stream_types.end())
-			return std::string(found->second);
-		return "";
+		const char* name = stream_traits(m_streams[pid]).name;
+		return name ? std::string(name) : std::string();
 	}
 
 	byte_streambuf::byte_streambuf()
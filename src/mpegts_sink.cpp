@@ -0,0 +1,206 @@
+﻿#include "mpegts_sink.hpp"
+
+#include <iostream>
+
+#if defined(_WIN32)
+#	include <io.h>
+#else
+#	include <sys/types.h>
+#	include <sys/socket.h>
+#	include <sys/uio.h>
+#	include <unistd.h>
+#	include <errno.h>
+#endif
+
+namespace util {
+
+	enum { ts_size = 188 };
+
+	// 每次系统调用最多提交的片段数, 小于IOV_MAX.
+	enum { max_iov = 64 };
+
+	mpegts_sink::mpegts_sink(int fd, size_t datagram_packets)
+		: m_fd(fd)
+		, m_datagram_size(datagram_packets * ts_size)
+	{
+	}
+
+	mpegts_sink::~mpegts_sink()
+	{
+	}
+
+	int64_t mpegts_sink::write(mpegts_parser& parser)
+	{
+		mpegts_span span = parser.mpegts_output();
+		if (span.size_ == 0)
+			return 0;
+		int64_t n = write(&span, 1);
+		if (n > 0)
+			parser.release_mpegts(static_cast<size_t>(n));
+		return n;
+	}
+
+	int64_t mpegts_sink::write(const mpegts_span* spans, size_t count)
+	{
+		if (m_datagram_size)
+			return write_datagram(spans, count);
+		return write_stream(spans, count);
+	}
+
+	int mpegts_sink::fd() const
+	{
+		return m_fd;
+	}
+
+#if defined(_WIN32)
+
+	int64_t mpegts_sink::write_stream(const mpegts_span* spans, size_t count)
+	{
+		int64_t total = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			const uint8_t* p = spans[i].data_;
+			size_t left = spans[i].size_;
+			while (left)
+			{
+				int n = _write(m_fd, p, static_cast<unsigned>((std::min<size_t>)(left, 1 << 30)));
+				if (n <= 0)
+					return total ? total : -1;
+				p += n;
+				left -= n;
+				total += n;
+			}
+		}
+		return total;
+	}
+
+	int64_t mpegts_sink::write_datagram(const mpegts_span*, size_t)
+	{
+		std::cerr << "mpegts_sink: datagram output is not supported on this platform" << std::endl;
+		return -1;
+	}
+
+#else
+
+	int64_t mpegts_sink::write_stream(const mpegts_span* spans, size_t count)
+	{
+		int64_t total = 0;
+		size_t index = 0;
+		size_t skip = 0;	// spans[index]中已写出的字节数.
+		while (index < count)
+		{
+			struct iovec iov[max_iov];
+			int iovcnt = 0;
+			size_t want = 0;
+			for (size_t i = index; i < count && iovcnt < max_iov; i++)
+			{
+				size_t off = i == index ? skip : 0;
+				if (spans[i].size_ == off)
+					continue;
+				iov[iovcnt].iov_base = const_cast<uint8_t*>(spans[i].data_ + off);
+				iov[iovcnt].iov_len = spans[i].size_ - off;
+				want += iov[iovcnt].iov_len;
+				iovcnt++;
+			}
+			if (iovcnt == 0)
+				break;
+
+			ssize_t n = ::writev(m_fd, iov, iovcnt);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				return total ? total : -1;
+			}
+			total += n;
+
+			// 前进到第一个未写完的片段.
+			size_t left = static_cast<size_t>(n);
+			while (index < count && left >= spans[index].size_ - skip)
+			{
+				left -= spans[index].size_ - skip;
+				skip = 0;
+				index++;
+			}
+			skip += left;
+			if (static_cast<size_t>(n) < want)
+				break;
+		}
+		return total;
+	}
+
+	int64_t mpegts_sink::write_datagram(const mpegts_span* spans, size_t count)
+	{
+		int64_t total = 0;
+		size_t index = 0;
+		size_t skip = 0;
+		while (index < count)
+		{
+			// 从片段中收集一个数据报, 数据报可以跨越片段边界.
+			struct iovec iov[max_iov];
+			int iovcnt = 0;
+			size_t size = 0;
+			size_t i = index, off = skip;
+			while (i < count && size < m_datagram_size && iovcnt < max_iov)
+			{
+				size_t k = (std::min)(spans[i].size_ - off, m_datagram_size - size);
+				if (k)
+				{
+					iov[iovcnt].iov_base = const_cast<uint8_t*>(spans[i].data_ + off);
+					iov[iovcnt].iov_len = k;
+					iovcnt++;
+					size += k;
+				}
+				off += k;
+				if (off == spans[i].size_)
+				{
+					i++;
+					off = 0;
+				}
+			}
+			// 只发送完整的ts包.
+			size -= size % ts_size;
+			if (size == 0)
+				break;
+			if (size < m_datagram_size)
+			{
+				size_t left = size;
+				for (int j = 0; j < iovcnt; j++)
+				{
+					iov[j].iov_len = (std::min)(iov[j].iov_len, left);
+					left -= iov[j].iov_len;
+				}
+			}
+
+			struct msghdr msg = {};
+			msg.msg_iov = iov;
+			msg.msg_iovlen = iovcnt;
+			ssize_t n = ::sendmsg(m_fd, &msg, 0);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				return total ? total : -1;
+			}
+			total += size;
+
+			// 数据报整体发送, 前进size字节.
+			size_t left = size;
+			while (index < count && left >= spans[index].size_ - skip)
+			{
+				left -= spans[index].size_ - skip;
+				skip = 0;
+				index++;
+			}
+			skip += left;
+		}
+		return total;
+	}
+
+#endif
+
+}
@@ -0,0 +1,273 @@
+﻿#include "parallel_scan.hpp"
+#include "resync.hpp"
+
+#include <bitset>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <algorithm>
+
+namespace util {
+
+	enum
+	{
+		scan_lock_count = 3,				// 重新同步时需要确认的连续同步字节数.
+		scan_batch_size = 1000,
+		scan_min_chunk = 4 * 1024 * 1024,	// 分段太小时线程调度的开销超过解析.
+		scan_bootstrap_limit = 16 * 1024 * 1024,	// 预先解析PAT/PMT最多读取的字节数.
+	};
+
+	// 每个分段的解析结果, 合并时处理跨分段的状态.
+	struct scan_chunk
+	{
+		scan_chunk()
+			: begin_(0)
+			, end_(0)
+			, packets_(0)
+			, skipped_bytes_(0)
+			, cc_errors_(0)
+			, first_cc_(0x2000, -1)
+			, last_cc_(0x2000, -1)
+		{}
+
+		size_t begin_;
+		size_t end_;
+		std::vector<scan_event> events_;
+		uint64_t packets_;
+		uint64_t skipped_bytes_;
+		uint64_t cc_errors_;
+		// 每个pid在分段中的第一个和最后一个cc.
+		std::vector<int8_t> first_cc_;
+		std::vector<int8_t> last_cc_;
+		// 在分段中出现过起始包的pid, 以及分段结束时仍在查找帧类型的pid.
+		std::bitset<0x2000> started_;
+		std::bitset<0x2000> pending_;
+		std::unique_ptr<mpegts_parser> parser_;
+	};
+
+	// 从pos开始重新同步, 数据末尾不足以确认多个同步字节时只需要1个,
+	// 返回false表示剩余数据中没有同步位置.
+	static bool scan_resync(const uint8_t* data, size_t size, size_t& pos, size_t packet_size, size_t prefix)
+	{
+		size_t skipped = 0;
+		bool locked = size - pos > prefix && ts_resync(data + pos + prefix,
+			size - pos - prefix, skipped, scan_lock_count, packet_size);
+		if (!locked)
+		{
+			size_t tail = 0;
+			locked = size - pos - skipped > prefix && ts_resync(data + pos + skipped + prefix,
+				size - pos - skipped - prefix, tail, 1, packet_size);
+			skipped = locked ? skipped + tail : size - pos;
+		}
+		pos += skipped;
+		return locked;
+	}
+
+	static void scan_one(const mpegts_parser& init, const uint8_t* data, size_t size, scan_chunk& chunk)
+	{
+		chunk.parser_.reset(new mpegts_parser);
+		mpegts_parser& p = *chunk.parser_;
+		p.copy_stream_info(init);
+
+		size_t packet_size = p.packet_size();
+		size_t prefix = ts_packet_prefix(p.packet_size());
+
+		std::vector<uint16_t> pids(scan_batch_size);
+		std::vector<uint8_t> flags(scan_batch_size);
+		std::vector<uint8_t> picts(scan_batch_size);
+		std::vector<int64_t> pcrs(scan_batch_size), ptss(scan_batch_size), dtss(scan_batch_size);
+		mpegts_batch batch;
+		batch.pid_ = pids.data();
+		batch.flags_ = flags.data();
+		batch.pict_type_ = picts.data();
+		batch.pcr_ = pcrs.data();
+		batch.pts_ = ptss.data();
+		batch.dts_ = dtss.data();
+
+		bool first_video = true;
+		bool first_audio = true;
+		bool resync = false;
+		size_t pos = chunk.begin_;
+
+		// 只解析起始位置在分段内的包, 最后一个包可以超出分段结束位置.
+		while (pos < chunk.end_ && size - pos >= packet_size)
+		{
+			if (resync)
+			{
+				size_t from = pos;
+				bool locked = scan_resync(data, size, pos, packet_size, prefix);
+				chunk.skipped_bytes_ += pos - from;
+				if (!locked)
+					break;
+				resync = false;
+				continue;
+			}
+
+			size_t count = std::min<size_t>((size - pos) / packet_size,
+				(chunk.end_ - pos + packet_size - 1) / packet_size);
+			count = std::min<size_t>(count, scan_batch_size);
+			size_t n = p.do_parser_batch(data + pos, count, batch);
+
+			for (size_t i = 0; i < n; i++)
+			{
+				const uint8_t* ts = data + pos + i * packet_size + prefix;
+				uint16_t pid = pids[i];
+
+				// 没有payload的包cc不增加, 相同的cc为重复包.
+				if ((ts[3] & 0x10) && pid != 0x1fff)
+				{
+					int8_t cc = ts[3] & 0x0f;
+					int8_t last = chunk.last_cc_[pid];
+					if (last == -1)
+						chunk.first_cc_[pid] = cc;
+					else if (cc != last && cc != ((last + 1) & 0x0f))
+						chunk.cc_errors_++;
+					chunk.last_cc_[pid] = cc;
+				}
+
+				uint8_t f = flags[i];
+				bool is_video = !!(f & mpegts_batch::flag_video);
+				bool is_audio = !!(f & mpegts_batch::flag_audio);
+				bool keep = pcrs[i] != -1;
+
+				if (is_video)
+				{
+					if (f & mpegts_batch::flag_start)
+						chunk.started_.set(pid);
+					else if (!chunk.started_[pid])
+						f |= scan_event::flag_head;
+					keep = keep || (f & (mpegts_batch::flag_start | mpegts_batch::flag_idr)) ||
+						picts[i] != av_picture_type_none;
+				}
+				if ((is_video && first_video) || (is_audio && first_audio))
+				{
+					f |= scan_event::flag_first;
+					keep = true;
+					if (is_video)
+						first_video = false;
+					else
+						first_audio = false;
+				}
+
+				if (keep)
+				{
+					scan_event e = { static_cast<int64_t>(pos + i * packet_size), pid, f, picts[i], pcrs[i], ptss[i], dtss[i] };
+					chunk.events_.push_back(e);
+				}
+			}
+
+			chunk.packets_ += n;
+			pos += n * packet_size;
+
+			// 第n个包解析失败, 跳过1个字节后重新同步.
+			if (n < count)
+			{
+				pos += 1;
+				chunk.skipped_bytes_ += 1;
+				resync = true;
+			}
+		}
+
+		for (size_t pid = 0; pid < 0x2000; pid++)
+			chunk.pending_[pid] = p.frame_type_pending(static_cast<uint16_t>(pid));
+	}
+
+	bool parallel_scan(mpegts_parser& parser, const uint8_t* data, size_t size,
+		int threads, scan_result& result)
+	{
+		size_t packet_size = parser.packet_size();
+		size_t prefix = ts_packet_prefix(parser.packet_size());
+		if (threads < 1)
+			threads = 1;
+
+		// 预先解析PAT/PMT, 第一个分段之后的分段从这些流信息开始.
+		mpegts_parser bootstrap;
+		bootstrap.copy_stream_info(parser);
+		{
+			size_t limit = std::min<size_t>(size, scan_bootstrap_limit);
+			size_t pos = 0;
+			mpegts_info info;
+			while (pos + packet_size <= limit && !bootstrap.stream_info_ready())
+			{
+				if (bootstrap.do_parser(data + pos, info))
+				{
+					pos += packet_size;
+					continue;
+				}
+				pos += 1;
+				if (!scan_resync(data, limit, pos, packet_size, prefix))
+					break;
+			}
+		}
+
+		// 按大小均分后对齐到同步字节, 分段数多于线程数以平衡负载.
+		size_t count = std::max<size_t>(1, std::min<size_t>(threads * 4, size / scan_min_chunk));
+		std::vector<scan_chunk> chunks(count);
+		for (size_t i = 1; i < count; i++)
+		{
+			size_t pos = std::max(size / count * i, chunks[i - 1].begin_);
+			if (!scan_resync(data, size, pos, packet_size, prefix))
+				pos = size;
+			chunks[i].begin_ = pos;
+			chunks[i - 1].end_ = pos;
+		}
+		chunks[count - 1].end_ = size;
+
+		std::atomic<size_t> next(0);
+		auto worker = [&]()
+		{
+			for (size_t i = next++; i < count; i = next++)
+				scan_one(i == 0 ? parser : bootstrap, data, size, chunks[i]);
+		};
+		std::vector<std::thread> pool;
+		for (int i = 1; i < threads && static_cast<size_t>(i) < count; i++)
+			pool.emplace_back(worker);
+		worker();
+		for (auto& t : pool)
+			t.join();
+
+		// 按文件顺序合并. 分段开始时帧类型的查找状态取决于前面的分段, 前一个
+		// 分段已经确定帧类型时, 顺序解析不会在这个pid的起始包之前查找关键帧.
+		std::bitset<0x2000> pending;
+		pending.set();
+		std::vector<int8_t> last_cc(0x2000, -1);
+
+		result.events_.clear();
+		result.packets_ = 0;
+		result.skipped_bytes_ = 0;
+		result.cc_errors_ = 0;
+		for (auto& chunk : chunks)
+		{
+			for (auto e : chunk.events_)
+			{
+				if ((e.flags_ & scan_event::flag_head) && !pending[e.pid_])
+				{
+					e.flags_ &= ~mpegts_batch::flag_idr;
+					e.pict_type_ = av_picture_type_none;
+				}
+				result.events_.push_back(e);
+			}
+
+			for (size_t pid = 0; pid < 0x2000; pid++)
+			{
+				if (chunk.started_[pid] || pending[pid])
+					pending[pid] = chunk.pending_[pid];
+
+				int8_t first = chunk.first_cc_[pid];
+				if (first != -1 && last_cc[pid] != -1 &&
+					first != last_cc[pid] && first != ((last_cc[pid] + 1) & 0x0f))
+					chunk.cc_errors_++;
+				if (chunk.last_cc_[pid] != -1)
+					last_cc[pid] = chunk.last_cc_[pid];
+			}
+
+			result.packets_ += chunk.packets_;
+			result.skipped_bytes_ += chunk.skipped_bytes_;
+			result.cc_errors_ += chunk.cc_errors_;
+		}
+
+		parser.copy_stream_info(*chunks[count - 1].parser_);
+		return true;
+	}
+
+}
@@ -0,0 +1,332 @@
+﻿#include "pes_assembler.hpp"
+#include "state_blob.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+namespace util {
+
+	enum
+	{
+		ts_size = 188,
+		ts_header_size = 4,
+		pes_header_size = 6,			// packet_start_code_prefix, stream_id, PES_packet_length.
+		pes_header_optional_size = 3,	// 标志位和PES_header_data_length.
+		max_pes_size = 0x10000 * 64,	// 恢复状态时允许的未完成负载大小.
+	};
+
+	static const char assembler_state_magic[4] = { 'M', 'T', 'P', 'A' };
+	static const uint32_t assembler_state_version = 1;
+
+	pes_assembler::pes_assembler()
+		: m_contiguous(false)
+	{
+		m_slots.resize(0x2000, -1);
+	}
+
+	pes_assembler::pes_assembler(handler_type handler)
+		: m_handler(std::move(handler))
+		, m_contiguous(false)
+	{
+		m_slots.resize(0x2000, -1);
+	}
+
+	pes_assembler::~pes_assembler()
+	{
+	}
+
+	void pes_assembler::set_handler(handler_type handler)
+	{
+		m_handler = std::move(handler);
+	}
+
+	void pes_assembler::set_contiguous(bool contiguous)
+	{
+		m_contiguous = contiguous;
+	}
+
+	bool pes_assembler::contiguous() const
+	{
+		return m_contiguous;
+	}
+
+	void pes_assembler::push(const uint8_t* ts, const mpegts_info& info)
+	{
+		if (!info.is_video_ && !info.is_audio_)
+			return;
+
+		do_push(ts, static_cast<uint16_t>(info.pid_), info.start_, info.payload_begin_, info.payload_end_,
+			info.is_video_, info.is_audio_, info.type_ == mpegts_info::idr, info.stream_type_,
+			info.pts_, info.dts_);
+	}
+
+	void pes_assembler::push_batch(const uint8_t* buf, size_t n_packets, int packet_size, const mpegts_batch& batch)
+	{
+		size_t prefix = ts_packet_prefix(packet_size);
+		for (size_t i = 0; i < n_packets; i++)
+		{
+			uint8_t flags = batch.flags_[i];
+			bool is_video = !!(flags & mpegts_batch::flag_video);
+			bool is_audio = !!(flags & mpegts_batch::flag_audio);
+			if (!is_video && !is_audio)
+				continue;
+
+			const uint8_t* ts = buf + i * packet_size + prefix;
+			do_push(ts, batch.pid_[i], !!(flags & mpegts_batch::flag_start),
+				ts + batch.payload_begin_[i], ts + batch.payload_end_[i],
+				is_video, is_audio, !!(flags & mpegts_batch::flag_idr), -1,
+				batch.pts_ ? batch.pts_[i] : -1, batch.dts_ ? batch.dts_[i] : -1);
+		}
+	}
+
+	void pes_assembler::detach()
+	{
+		for (auto& s : m_states)
+		{
+			if (!s.active_ || s.spans_.empty())
+				continue;
+
+			// 包括之前detach过的数据一起拷贝, 然后交换缓冲.
+			m_scratch.clear();
+			for (const auto& span : s.spans_)
+				m_scratch.insert(m_scratch.end(), span.data_, span.data_ + span.size_);
+			s.owned_.swap(m_scratch);
+
+			pes_span span = { s.owned_.data(), s.owned_.size() };
+			s.spans_.assign(1, span);
+		}
+	}
+
+	void pes_assembler::flush()
+	{
+		for (auto& s : m_states)
+		{
+			if (s.active_)
+				do_emit(s);
+		}
+	}
+
+	void pes_assembler::reset()
+	{
+		std::fill(m_slots.begin(), m_slots.end(), -1);
+		m_states.clear();
+	}
+
+	void pes_assembler::snapshot(std::vector<uint8_t>& out) const
+	{
+		out.clear();
+		blob_writer w(out);
+		w.put_raw(assembler_state_magic, sizeof(assembler_state_magic));
+		w.put_u32(assembler_state_version);
+
+		w.put_u16(static_cast<uint16_t>(m_states.size()));
+		for (const auto& s : m_states)
+		{
+			w.put_u16(s.pid_);
+			w.put_u8(static_cast<uint8_t>(s.cc_));
+			w.put_u8(s.active_ ? 1 : 0);
+			if (!s.active_)
+				continue;
+
+			const pes_unit& unit = s.unit_;
+			w.put_u64(s.need_);
+			w.put_u8(unit.stream_id_);
+			w.put_u32(static_cast<uint32_t>(unit.stream_type_));
+			w.put_u8((unit.is_video_ ? 1 : 0) | (unit.is_audio_ ? 2 : 0) |
+				(unit.is_key_ ? 4 : 0) | (unit.discontinuity_ ? 8 : 0));
+			w.put_i64(unit.pts_);
+			w.put_i64(unit.dts_);
+			w.put_u32(static_cast<uint32_t>(s.size_));
+			for (const auto& span : s.spans_)
+				w.put_raw(span.data_, span.size_);
+		}
+	}
+
+	bool pes_assembler::restore(const uint8_t* data, size_t size)
+	{
+		blob_reader r(data, size);
+		char magic[4];
+		if (!r.get_raw(magic, sizeof(magic)) ||
+			std::memcmp(magic, assembler_state_magic, sizeof(magic)) != 0 ||
+			r.get_u32() != assembler_state_version)
+		{
+			std::cerr << "invalid pes assembler state" << std::endl;
+			return false;
+		}
+
+		// 负载恢复到owned_中, 不引用data.
+		std::vector<pes_state> states(r.get_u16());
+		std::vector<int16_t> slots(0x2000, -1);
+		bool ok = r.ok();
+		for (size_t i = 0; ok && i < states.size(); i++)
+		{
+			pes_state& s = states[i];
+			s.pid_ = r.get_u16() & 0x1fff;
+			s.cc_ = static_cast<int8_t>(r.get_u8());
+			s.active_ = r.get_u8() != 0;
+			ok = r.ok() && slots[s.pid_] < 0;
+			slots[s.pid_] = static_cast<int16_t>(i);
+			if (!ok || !s.active_)
+				continue;
+
+			pes_unit& unit = s.unit_;
+			s.need_ = static_cast<size_t>(r.get_u64());
+			unit.pid_ = s.pid_;
+			unit.stream_id_ = r.get_u8();
+			unit.stream_type_ = static_cast<int32_t>(r.get_u32());
+			uint8_t flags = r.get_u8();
+			unit.is_video_ = !!(flags & 1);
+			unit.is_audio_ = !!(flags & 2);
+			unit.is_key_ = !!(flags & 4);
+			unit.discontinuity_ = !!(flags & 8);
+			unit.pts_ = r.get_i64();
+			unit.dts_ = r.get_i64();
+			s.size_ = r.get_u32();
+			ok = s.size_ <= max_pes_size && (!s.need_ || s.size_ <= s.need_);
+			if (ok)
+			{
+				s.owned_.resize(s.size_);
+				ok = r.get_raw(s.owned_.data(), s.size_);
+			}
+			if (ok && s.size_)
+			{
+				pes_span span = { s.owned_.data(), s.owned_.size() };
+				s.spans_.assign(1, span);
+			}
+		}
+
+		if (!ok || !r.ok() || r.remaining())
+		{
+			std::cerr << "invalid pes assembler state" << std::endl;
+			return false;
+		}
+
+		m_states.swap(states);
+		m_slots.swap(slots);
+		return true;
+	}
+
+	pes_assembler::pes_state& pes_assembler::state(uint16_t pid)
+	{
+		int16_t& slot = m_slots[pid & 0x1fff];
+		if (slot < 0)
+		{
+			slot = static_cast<int16_t>(m_states.size());
+			m_states.push_back(pes_state());
+			m_states.back().pid_ = pid;
+		}
+		return m_states[slot];
+	}
+
+	void pes_assembler::do_push(const uint8_t* ts, uint16_t pid, bool start, const uint8_t* begin, const uint8_t* end,
+		bool is_video, bool is_audio, bool is_key, int stream_type, int64_t pts, int64_t dts)
+	{
+		// 没有payload的包cc不增加.
+		if (!(ts[3] & 0x10))
+			return;
+
+		pes_state& s = state(pid);
+		int cc = ts[3] & 0x0f;
+		if (s.cc_ != -1)
+		{
+			// 重复包直接丢弃.
+			if (cc == s.cc_ && !start)
+				return;
+			if (cc != ((s.cc_ + 1) & 0x0f))
+				s.unit_.discontinuity_ = true;
+		}
+		s.cc_ = cc;
+
+		if (start)
+		{
+			if (s.active_)
+				do_emit(s);
+
+			const uint8_t* pes = ts + ts_header_size;
+			if (ts[3] & 0x20)
+				pes += 1 + ts[4];
+			if (pes + pes_header_size + pes_header_optional_size > ts + ts_size ||
+				pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01)
+			{
+				std::cerr << "parse pes header error, pid = " << pid << std::endl;
+				return;
+			}
+
+			size_t pes_length = (pes[4] << 8) | pes[5];
+			size_t header_length = pes_header_size + pes_header_optional_size + pes[8];
+
+			s.active_ = true;
+			s.need_ = pes_length + pes_header_size > header_length ?
+				pes_length + pes_header_size - header_length : 0;
+			s.size_ = 0;
+			s.spans_.clear();
+			s.owned_.clear();
+
+			pes_unit& unit = s.unit_;
+			unit.pid_ = pid;
+			unit.stream_id_ = pes[3];
+			unit.stream_type_ = stream_type;
+			unit.is_video_ = is_video;
+			unit.is_audio_ = is_audio;
+			unit.is_key_ = false;
+			unit.discontinuity_ = false;
+			unit.pts_ = pts;
+			unit.dts_ = dts;
+		}
+		else if (!s.active_)
+		{
+			// 还没有收到起始包.
+			return;
+		}
+
+		if (is_key)
+			s.unit_.is_key_ = true;
+		do_append(s, begin, end);
+	}
+
+	void pes_assembler::do_append(pes_state& s, const uint8_t* begin, const uint8_t* end)
+	{
+		if (end <= begin)
+			return;
+
+		size_t size = end - begin;
+		if (s.need_ && s.size_ + size > s.need_)
+			size = s.need_ - s.size_;
+
+		pes_span span = { begin, size };
+		s.spans_.push_back(span);
+		s.size_ += size;
+
+		// 指定了PES_packet_length时收齐即可输出, 不需要等待下一个起始包.
+		if (s.need_ && s.size_ >= s.need_)
+			do_emit(s);
+	}
+
+	void pes_assembler::do_emit(pes_state& s)
+	{
+		pes_unit& unit = s.unit_;
+		unit.spans_ = s.spans_.data();
+		unit.span_count_ = s.spans_.size();
+		unit.size_ = s.size_;
+		unit.data_ = nullptr;
+		if (s.need_ && s.size_ < s.need_)
+			unit.discontinuity_ = true;
+
+		if (m_contiguous)
+		{
+			m_buffer.clear();
+			for (const auto& span : s.spans_)
+				m_buffer.insert(m_buffer.end(), span.data_, span.data_ + span.size_);
+			unit.data_ = m_buffer.data();
+		}
+
+		if (m_handler)
+			m_handler(unit);
+
+		s.active_ = false;
+		s.spans_.clear();
+		s.owned_.clear();
+	}
+
+}
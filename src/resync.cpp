@@ -0,0 +1,136 @@
+﻿#include "resync.hpp"
+#include "cpu_features.hpp"
+
+#if defined(MPEGTS_X86)
+#	include <immintrin.h>
+#endif
+
+namespace util {
+
+	// 检查[first, last]范围内的候选位置, 返回第一个同步位置, 找不到时返回last + 1.
+	static size_t resync_scalar(const uint8_t* data, size_t first, size_t last,
+		int lock_count, size_t packet_size)
+	{
+		for (size_t pos = first; pos <= last; pos++)
+		{
+			if (data[pos] != 0x47)
+				continue;
+
+			int n = 1;
+			while (n < lock_count && data[pos + n * packet_size] == 0x47)
+				n++;
+			if (n == lock_count)
+				return pos;
+		}
+
+		return last + 1;
+	}
+
+#if defined(MPEGTS_X86)
+
+	static inline int ts_ctz(uint32_t v)
+	{
+#if defined(_MSC_VER)
+		unsigned long n;
+		_BitScanForward(&n, v);
+		return static_cast<int>(n);
+#else
+		return __builtin_ctz(v);
+#endif
+	}
+
+	// 每次检查16个候选位置, 各候选位置后续的同步字节由跨步加载的比较结果相与得到.
+	// 内联到avx2的实现中处理尾部, 以vex编码避免sse/avx切换的开销.
+	MPEGTS_TARGET("sse2")
+	static inline bool resync_step16(const uint8_t* data, size_t& pos, size_t last,
+		int lock_count, size_t packet_size)
+	{
+		const __m128i sync = _mm_set1_epi8(0x47);
+
+		for (; pos + 16 <= last + 1; pos += 16)
+		{
+			const uint8_t* p = data + pos;
+			uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), sync)));
+			for (int n = 1; n < lock_count && mask; n++)
+			{
+				p += packet_size;
+				mask &= static_cast<uint32_t>(_mm_movemask_epi8(
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), sync)));
+			}
+			if (mask)
+			{
+				pos += ts_ctz(mask);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	MPEGTS_TARGET("sse2")
+	static size_t resync_sse2(const uint8_t* data, size_t first, size_t last,
+		int lock_count, size_t packet_size)
+	{
+		size_t pos = first;
+		if (resync_step16(data, pos, last, lock_count, packet_size))
+			return pos;
+		return resync_scalar(data, pos, last, lock_count, packet_size);
+	}
+
+	MPEGTS_TARGET("avx2")
+	static size_t resync_avx2(const uint8_t* data, size_t first, size_t last,
+		int lock_count, size_t packet_size)
+	{
+		const __m256i sync = _mm256_set1_epi8(0x47);
+		size_t pos = first;
+
+		for (; pos + 32 <= last + 1; pos += 32)
+		{
+			const uint8_t* p = data + pos;
+			uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), sync)));
+			for (int n = 1; n < lock_count && mask; n++)
+			{
+				p += packet_size;
+				mask &= static_cast<uint32_t>(_mm256_movemask_epi8(
+					_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), sync)));
+			}
+			if (mask)
+				return pos + ts_ctz(mask);
+		}
+
+		if (resync_step16(data, pos, last, lock_count, packet_size))
+			return pos;
+		return resync_scalar(data, pos, last, lock_count, packet_size);
+	}
+
+#endif // MPEGTS_X86
+
+	bool ts_resync(const uint8_t* data, size_t size, size_t& skipped,
+		int lock_count/* = 3*/, size_t packet_size/* = 188*/)
+	{
+		if (lock_count < 1)
+			lock_count = 1;
+
+		// 最后一个可以确认的候选位置, 需要保证最后一个同步字节在data范围之内.
+		size_t window = (lock_count - 1) * packet_size + 1;
+		if (size < window)
+		{
+			skipped = 0;
+			return false;
+		}
+		size_t last = size - window;
+
+		typedef size_t (*resync_fn)(const uint8_t*, size_t, size_t, int, size_t);
+		static const resync_fn resync_impl =
+#if defined(MPEGTS_X86)
+			get_cpu_features().avx2 ? resync_avx2 :
+			get_cpu_features().sse2 ? resync_sse2 :
+#endif
+			resync_scalar;
+
+		skipped = resync_impl(data, 0, last, lock_count, packet_size);
+		return skipped <= last;
+	}
+}
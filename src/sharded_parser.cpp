@@ -0,0 +1,215 @@
+﻿#include "sharded_parser.hpp"
+
+#include <cstring>
+
+#if defined(_WIN32)
+#	include <windows.h>
+#elif defined(__linux__)
+#	include <pthread.h>
+#	include <sched.h>
+#endif
+
+namespace util {
+
+	static void set_thread_affinity(std::thread& t, int cpu)
+	{
+		if (cpu < 0)
+			return;
+#if defined(_WIN32)
+		SetThreadAffinityMask(t.native_handle(), DWORD_PTR(1) << cpu);
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#else
+		(void)t;
+#endif
+	}
+
+	sharded_parser::sharded_parser()
+		: m_packet_size(ts_packet_188)
+		, m_stop(false)
+		, m_psi_ready(false)
+		, m_next_video(0)
+		, m_next_other(0)
+	{
+		m_routes.resize(0x2000, -1);
+	}
+
+	sharded_parser::~sharded_parser()
+	{
+		stop();
+	}
+
+	bool sharded_parser::set_packet_size(int packet_size)
+	{
+		if (!m_workers.empty() || !m_psi.set_packet_size(packet_size))
+			return false;
+		m_packet_size = packet_size;
+		return true;
+	}
+
+	int sharded_parser::packet_size() const
+	{
+		return m_packet_size;
+	}
+
+	bool sharded_parser::start(int workers, size_t capacity, handler_type handler,
+		const std::vector<int>& cpus/* = std::vector<int>()*/)
+	{
+		if (!m_workers.empty() || workers < 1 || capacity < 1)
+			return false;
+
+		m_handler = std::move(handler);
+		m_stop = false;
+		for (int i = 0; i < workers; i++)
+		{
+			m_workers.emplace_back(new worker(capacity));
+			m_workers.back()->parser_.set_packet_size(m_packet_size);
+		}
+
+		for (int i = 0; i < workers; i++)
+		{
+			auto& w = *m_workers[i];
+			w.thread_ = std::thread(&sharded_parser::do_work, this, i);
+			if (!cpus.empty())
+				set_thread_affinity(w.thread_, cpus[i % cpus.size()]);
+		}
+
+		return true;
+	}
+
+	size_t sharded_parser::dispatch(const uint8_t* buf, size_t n_packets, int64_t pos)
+	{
+		if (m_workers.empty())
+			return 0;
+
+		size_t prefix = ts_packet_prefix(m_packet_size);
+		for (size_t i = 0; i < n_packets; i++)
+		{
+			const uint8_t* packet = buf + i * m_packet_size;
+			const uint8_t* ts = packet + prefix;
+			if (ts[0] != 0x47)
+				return i;
+
+			uint16_t pid = ((ts[1] & 0x1f) << 8) | ts[2];
+			int64_t packet_pos = pos + static_cast<int64_t>(i * m_packet_size);
+
+			// PAT/PMT由分发线程解析以确定流类型, 同时发送给所有工作线程.
+			if (m_psi.is_psi_pid(pid))
+			{
+				mpegts_info info;
+				m_psi.do_parser(packet, info);
+				for (size_t w = 0; w < m_workers.size(); w++)
+					do_push(static_cast<int>(w), packet, packet_pos);
+
+				// 流信息确定之前的包都发给了0号工作线程, 处理完这些包以后再按
+				// 流类型分配, 保证每个pid的包按顺序处理.
+				if (!m_psi_ready && m_psi.stream_info_ready())
+				{
+					drain();
+					m_psi_ready = true;
+				}
+				continue;
+			}
+
+			do_push(do_route(pid), packet, packet_pos);
+		}
+
+		return n_packets;
+	}
+
+	void sharded_parser::drain()
+	{
+		for (auto& w : m_workers)
+		{
+			spin_backoff backoff;
+			while (!w->ring_.empty())
+				backoff.wait();
+		}
+	}
+
+	void sharded_parser::stop()
+	{
+		m_stop = true;
+		for (auto& w : m_workers)
+		{
+			if (w->thread_.joinable())
+				w->thread_.join();
+		}
+		m_workers.clear();
+	}
+
+	int sharded_parser::worker_of(uint16_t pid) const
+	{
+		return m_routes[pid & 0x1fff];
+	}
+
+	void sharded_parser::do_push(int index, const uint8_t* packet, int64_t pos)
+	{
+		auto& ring = m_workers[index]->ring_;
+
+		// 队列满时等待, 对输入形成反压.
+		slot* s = ring.alloc();
+		if (!s)
+		{
+			spin_backoff backoff;
+			while (!(s = ring.alloc()))
+				backoff.wait();
+		}
+
+		s->pos_ = pos;
+		std::memcpy(s->data_, packet, m_packet_size);
+		ring.push();
+	}
+
+	int sharded_parser::do_route(uint16_t pid)
+	{
+		if (!m_psi_ready)
+			return 0;
+
+		int16_t& route = m_routes[pid];
+		if (route >= 0)
+			return route;
+
+		// 视频流的解析开销最大, 单独从0号开始轮流分配, 使每个线程的视频pid
+		// 数量均衡, 其它pid从最后一个线程开始反向分配.
+		int workers = static_cast<int>(m_workers.size());
+		if (stream_traits(m_psi.stream_type(pid)).kind == stream_kind_video)
+			route = static_cast<int16_t>(m_next_video++ % workers);
+		else
+			route = static_cast<int16_t>(workers - 1 - m_next_other++ % workers);
+		return route;
+	}
+
+	void sharded_parser::do_work(int index)
+	{
+		auto& w = *m_workers[index];
+		spin_backoff backoff;
+
+		while (true)
+		{
+			slot* s = w.ring_.front();
+			if (!s)
+			{
+				// 停止时处理完队列中剩余的包.
+				if (m_stop.load(std::memory_order_acquire))
+				{
+					if (!w.ring_.front())
+						break;
+					continue;
+				}
+				backoff.wait();
+				continue;
+			}
+			backoff.reset();
+
+			mpegts_info info;
+			if (w.parser_.do_parser(s->data_, info) && m_handler)
+				m_handler(index, s->data_, s->pos_, info);
+			w.ring_.pop();
+		}
+	}
+
+}
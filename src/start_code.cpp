@@ -0,0 +1,164 @@
+﻿#include "start_code.hpp"
+#include "cpu_features.hpp"
+
+#if defined(MPEGTS_X86)
+#	include <immintrin.h>
+#endif
+
+namespace util {
+
+	// 以i表示起始码中01所在的位置, 检查[first, last]范围内的i, 找到时记录i + 1.
+	static size_t start_codes_scalar(const uint8_t* data, size_t first, size_t last,
+		uint32_t* offsets, size_t count, size_t max_count)
+	{
+		size_t i = first;
+		while (i <= last && count < max_count)
+		{
+			if (data[i] > 1)
+				i += 3;
+			else if (data[i - 1])
+				i += 2;
+			else if (data[i] == 1 && data[i - 2] == 0)
+			{
+				offsets[count++] = static_cast<uint32_t>(i + 1);
+				i += 3;
+			}
+			else
+				i++;
+		}
+
+		return count;
+	}
+
+#if defined(MPEGTS_X86)
+
+	static inline int ts_ctz64(uint64_t v)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long n;
+		_BitScanForward64(&n, v);
+		return static_cast<int>(n);
+#elif defined(_MSC_VER)
+		unsigned long n;
+		if (_BitScanForward(&n, static_cast<uint32_t>(v)))
+			return static_cast<int>(n);
+		_BitScanForward(&n, static_cast<uint32_t>(v >> 32));
+		return static_cast<int>(n) + 32;
+#else
+		return __builtin_ctzll(v);
+#endif
+	}
+
+	static inline size_t start_codes_collect(uint64_t mask, size_t base,
+		uint32_t* offsets, size_t count, size_t max_count)
+	{
+		while (mask && count < max_count)
+		{
+			offsets[count++] = static_cast<uint32_t>(base + ts_ctz64(mask) + 1);
+			mask &= mask - 1;
+		}
+
+		return count;
+	}
+
+	// 同时比较i, i-1, i-2三个错开的加载结果, 三个掩码相与即为起始码的位置.
+	// 内联到avx2/avx512的实现中处理尾部, 以vex编码避免sse/avx切换的开销.
+	MPEGTS_TARGET("sse2")
+	static inline size_t start_codes_step16(const uint8_t* data, size_t& i, size_t last,
+		uint32_t* offsets, size_t count, size_t max_count)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i one = _mm_set1_epi8(1);
+
+		for (; i + 16 <= last + 1 && count < max_count; i += 16)
+		{
+			__m128i v0 = _mm_loadu_si128((const __m128i*)(data + i));
+			uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v0, one)));
+			if (!mask)
+				continue;
+			__m128i v1 = _mm_loadu_si128((const __m128i*)(data + i - 1));
+			__m128i v2 = _mm_loadu_si128((const __m128i*)(data + i - 2));
+			mask &= static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(v1, v2), zero)));
+			count = start_codes_collect(mask, i, offsets, count, max_count);
+		}
+
+		return count;
+	}
+
+	MPEGTS_TARGET("sse2")
+	static size_t start_codes_sse2(const uint8_t* data, size_t first, size_t last,
+		uint32_t* offsets, size_t count, size_t max_count)
+	{
+		size_t i = first;
+		count = start_codes_step16(data, i, last, offsets, count, max_count);
+		return start_codes_scalar(data, i, last, offsets, count, max_count);
+	}
+
+	MPEGTS_TARGET("avx2")
+	static size_t start_codes_avx2(const uint8_t* data, size_t first, size_t last,
+		uint32_t* offsets, size_t count, size_t max_count)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i one = _mm256_set1_epi8(1);
+		size_t i = first;
+
+		for (; i + 32 <= last + 1 && count < max_count; i += 32)
+		{
+			__m256i v0 = _mm256_loadu_si256((const __m256i*)(data + i));
+			uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, one)));
+			if (!mask)
+				continue;
+			__m256i v1 = _mm256_loadu_si256((const __m256i*)(data + i - 1));
+			__m256i v2 = _mm256_loadu_si256((const __m256i*)(data + i - 2));
+			mask &= static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_or_si256(v1, v2), zero)));
+			count = start_codes_collect(mask, i, offsets, count, max_count);
+		}
+
+		count = start_codes_step16(data, i, last, offsets, count, max_count);
+		return start_codes_scalar(data, i, last, offsets, count, max_count);
+	}
+
+	MPEGTS_TARGET("avx512f,avx512bw")
+	static size_t start_codes_avx512(const uint8_t* data, size_t first, size_t last,
+		uint32_t* offsets, size_t count, size_t max_count)
+	{
+		const __m512i zero = _mm512_setzero_si512();
+		const __m512i one = _mm512_set1_epi8(1);
+		size_t i = first;
+
+		for (; i + 64 <= last + 1 && count < max_count; i += 64)
+		{
+			__m512i v0 = _mm512_loadu_si512((const void*)(data + i));
+			uint64_t mask = _mm512_cmpeq_epi8_mask(v0, one);
+			if (!mask)
+				continue;
+			__m512i v1 = _mm512_loadu_si512((const void*)(data + i - 1));
+			__m512i v2 = _mm512_loadu_si512((const void*)(data + i - 2));
+			mask &= _mm512_cmpeq_epi8_mask(_mm512_or_si512(v1, v2), zero);
+			count = start_codes_collect(mask, i, offsets, count, max_count);
+		}
+
+		count = start_codes_step16(data, i, last, offsets, count, max_count);
+		return start_codes_scalar(data, i, last, offsets, count, max_count);
+	}
+
+#endif // MPEGTS_X86
+
+	size_t find_start_codes(const uint8_t* data, size_t size, uint32_t* offsets, size_t max_count)
+	{
+		// 01至少位于第3个字节, 并且后面至少还有1个字节.
+		if (size < 4 || !max_count)
+			return 0;
+
+		typedef size_t (*start_codes_fn)(const uint8_t*, size_t, size_t, uint32_t*, size_t, size_t);
+		static const start_codes_fn start_codes_impl =
+#if defined(MPEGTS_X86)
+			get_cpu_features().avx512bw ? start_codes_avx512 :
+			get_cpu_features().avx2 ? start_codes_avx2 :
+			get_cpu_features().sse2 ? start_codes_sse2 :
+#endif
+			start_codes_scalar;
+
+		return start_codes_impl(data, 2, size - 2, offsets, 0, max_count);
+	}
+}
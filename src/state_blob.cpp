@@ -0,0 +1,134 @@
+﻿#include "state_blob.hpp"
+
+#include <cstring>
+
+namespace util {
+
+	blob_writer::blob_writer(std::vector<uint8_t>& out)
+		: m_out(out)
+	{
+	}
+
+	void blob_writer::put_u8(uint8_t v)
+	{
+		m_out.push_back(v);
+	}
+
+	void blob_writer::put_u16(uint16_t v)
+	{
+		m_out.push_back(static_cast<uint8_t>(v));
+		m_out.push_back(static_cast<uint8_t>(v >> 8));
+	}
+
+	void blob_writer::put_u32(uint32_t v)
+	{
+		for (int i = 0; i < 4; i++)
+			m_out.push_back(static_cast<uint8_t>(v >> (i * 8)));
+	}
+
+	void blob_writer::put_u64(uint64_t v)
+	{
+		for (int i = 0; i < 8; i++)
+			m_out.push_back(static_cast<uint8_t>(v >> (i * 8)));
+	}
+
+	void blob_writer::put_i64(int64_t v)
+	{
+		put_u64(static_cast<uint64_t>(v));
+	}
+
+	void blob_writer::put_bytes(const uint8_t* data, size_t size)
+	{
+		put_u32(static_cast<uint32_t>(size));
+		put_raw(data, size);
+	}
+
+	void blob_writer::put_raw(const void* data, size_t size)
+	{
+		const uint8_t* p = static_cast<const uint8_t*>(data);
+		m_out.insert(m_out.end(), p, p + size);
+	}
+
+	blob_reader::blob_reader(const uint8_t* data, size_t size)
+		: m_data(data)
+		, m_size(size)
+		, m_pos(0)
+		, m_ok(true)
+	{
+	}
+
+	uint64_t blob_reader::get(size_t n)
+	{
+		if (!m_ok || m_size - m_pos < n)
+		{
+			m_ok = false;
+			return 0;
+		}
+
+		uint64_t v = 0;
+		for (size_t i = 0; i < n; i++)
+			v |= static_cast<uint64_t>(m_data[m_pos + i]) << (i * 8);
+		m_pos += n;
+		return v;
+	}
+
+	uint8_t blob_reader::get_u8()
+	{
+		return static_cast<uint8_t>(get(1));
+	}
+
+	uint16_t blob_reader::get_u16()
+	{
+		return static_cast<uint16_t>(get(2));
+	}
+
+	uint32_t blob_reader::get_u32()
+	{
+		return static_cast<uint32_t>(get(4));
+	}
+
+	uint64_t blob_reader::get_u64()
+	{
+		return get(8);
+	}
+
+	int64_t blob_reader::get_i64()
+	{
+		return static_cast<int64_t>(get(8));
+	}
+
+	bool blob_reader::get_bytes(std::vector<uint8_t>& out, size_t max_size)
+	{
+		size_t size = get_u32();
+		if (size > max_size)
+			m_ok = false;
+		if (!m_ok)
+			return false;
+		out.resize(size);
+		return get_raw(out.data(), size);
+	}
+
+	bool blob_reader::get_raw(void* data, size_t size)
+	{
+		if (!m_ok || m_size - m_pos < size)
+		{
+			m_ok = false;
+			return false;
+		}
+		if (size)
+			std::memcpy(data, m_data + m_pos, size);
+		m_pos += size;
+		return true;
+	}
+
+	size_t blob_reader::remaining() const
+	{
+		return m_size - m_pos;
+	}
+
+	bool blob_reader::ok() const
+	{
+		return m_ok;
+	}
+
+}
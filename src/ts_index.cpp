@@ -0,0 +1,538 @@
+﻿#include "ts_index.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+namespace util {
+
+	static const char index_magic[4] = { 'M', 'T', 'S', 'I' };
+
+	// 33位时间戳的范围.
+	static const int64_t pts_wrap = int64_t(1) << 33;
+
+	// 增量保存时每个section至少预留的条目数.
+	static const uint64_t min_capacity = 1024;
+
+	inline int64_t entry_time(const index_entry& e)
+	{
+		return e.dts_ != -1 ? e.dts_ : e.pts_;
+	}
+
+	static bool file_seek(FILE* fp, uint64_t offset)
+	{
+#if defined(_WIN32)
+		return _fseeki64(fp, static_cast<int64_t>(offset), SEEK_SET) == 0;
+#else
+		return fseeko(fp, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+	}
+
+	// 从from的offset处复制count个条目到to, from为nullptr时写入空条目.
+	static bool copy_entries(FILE* from, uint64_t offset, uint64_t count, FILE* to)
+	{
+		index_entry buffer[1024];
+		memset(buffer, 0, sizeof(buffer));
+		if (from && !file_seek(from, offset))
+			return false;
+		while (count > 0)
+		{
+			size_t n = static_cast<size_t>(std::min<uint64_t>(count, 1024));
+			if (from && fread(buffer, sizeof(index_entry), n, from) != n)
+				return false;
+			if (fwrite(buffer, sizeof(index_entry), n, to) != n)
+				return false;
+			count -= n;
+		}
+		return true;
+	}
+
+	index_builder::index_builder()
+		: m_packet_size(ts_packet_188)
+		, m_last_pcr(-1)
+		, m_indexed_bytes(0)
+		, m_source_size(0)
+	{
+	}
+
+	index_builder::~index_builder()
+	{
+	}
+
+	void index_builder::set_packet_size(int packet_size)
+	{
+		m_packet_size = packet_size;
+	}
+
+	void index_builder::set_stream_type(uint16_t pid, uint8_t stream_type)
+	{
+		m_pids[pid].stream_type_ = stream_type;
+	}
+
+	void index_builder::push(int64_t pos, const mpegts_info& info)
+	{
+		uint8_t flags = (info.start_ ? mpegts_batch::flag_start : 0) |
+			(info.is_video_ ? mpegts_batch::flag_video : 0) |
+			(info.is_audio_ ? mpegts_batch::flag_audio : 0) |
+			(info.type_ == mpegts_info::idr ? mpegts_batch::flag_idr : 0);
+		if (info.is_video_ && info.start_)
+		{
+			auto& state = m_pids[static_cast<uint16_t>(info.pid_)];
+			if (!state.stream_type_)
+				state.stream_type_ = static_cast<uint8_t>(info.stream_type_);
+		}
+		push(pos, static_cast<uint16_t>(info.pid_), flags, static_cast<uint8_t>(info.pict_type_),
+			info.pcr_, info.pts_, info.dts_);
+	}
+
+	void index_builder::push(int64_t pos, uint16_t pid, uint8_t flags, uint8_t pict_type,
+		int64_t pcr, int64_t pts, int64_t dts)
+	{
+		if (pcr != -1)
+			m_last_pcr = pcr;
+		if (!(flags & mpegts_batch::flag_video))
+			return;
+
+		auto& state = m_pids[pid];
+		if (flags & mpegts_batch::flag_start)
+		{
+			// 没有时间戳的访问单元无法用于定位.
+			if (pts == -1 && dts == -1)
+				return;
+
+			index_entry e;
+			memset(&e, 0, sizeof(e));
+			e.pos_ = pos;
+			e.pts_ = pts != -1 ? unwrap(pts, state.last_pts_, state.pts_offset_) : -1;
+			e.dts_ = dts != -1 ? unwrap(dts, state.last_dts_, state.dts_offset_) : -1;
+			e.pcr_ = m_last_pcr;
+			e.flags_ = (flags & mpegts_batch::flag_idr) ? index_key : 0;
+			e.pict_type_ = pict_type;
+			state.entries_.push_back(e);
+			state.resumed_ = false;
+			return;
+		}
+
+		// 帧类型可能在访问单元后面的包中才确定.
+		if (state.entries_.empty() || state.resumed_)
+			return;
+		auto& e = state.entries_.back();
+		if (flags & mpegts_batch::flag_idr)
+			e.flags_ |= index_key;
+		if (e.pict_type_ == av_picture_type_none)
+			e.pict_type_ = pict_type;
+	}
+
+	void index_builder::set_indexed_bytes(int64_t bytes, int64_t source_size)
+	{
+		m_indexed_bytes = bytes;
+		m_source_size = source_size;
+	}
+
+	bool index_builder::save(const std::string& file)
+	{
+		return write_file(file, false);
+	}
+
+	bool index_builder::append(const std::string& file)
+	{
+		bool relayout = file != m_file;
+		for (auto& p : m_pids)
+		{
+			const pid_state& state = p.second;
+			uint64_t count = state.base_ + state.entries_.size();
+			if (count != 0 && (state.offset_ == 0 || count > state.capacity_))
+				relayout = true;
+		}
+		if (relayout)
+		{
+			if (!write_file(file, true))
+				return false;
+			trim_entries();
+			return true;
+		}
+
+		FILE* fp = fopen(file.c_str(), "r+b");
+		if (!fp)
+		{
+			std::cerr << "Can't open index file " << file << std::endl;
+			return false;
+		}
+
+		// 先写入条目再修改section表和索引头, 读取方看到的count_范围内总是完整的条目.
+		// 上一次写入的最后一个条目的帧类型可能已经补充, 需要重写.
+		std::vector<index_section> sections;
+		bool ok = true;
+		for (auto& p : m_pids)
+		{
+			pid_state& state = p.second;
+			uint64_t count = state.base_ + state.entries_.size();
+			if (count == 0)
+				continue;
+			uint64_t first = state.written_ > state.base_ ? state.written_ - 1 : state.base_;
+			size_t n = static_cast<size_t>(count - first);
+			if (ok)
+				ok = file_seek(fp, state.offset_ + first * sizeof(index_entry)) &&
+					fwrite(&state.entries_[first - state.base_], sizeof(index_entry), n, fp) == n;
+
+			index_section s;
+			memset(&s, 0, sizeof(s));
+			s.pid_ = p.first;
+			s.stream_type_ = state.stream_type_;
+			s.offset_ = state.offset_;
+			s.count_ = count;
+			s.capacity_ = state.capacity_;
+			sections.push_back(s);
+		}
+
+		index_header h = make_header(sections.size());
+		if (ok)
+			ok = file_seek(fp, sizeof(index_header)) &&
+				fwrite(sections.data(), sizeof(index_section), sections.size(), fp) == sections.size();
+		if (ok)
+			ok = file_seek(fp, 0) && fwrite(&h, sizeof(h), 1, fp) == 1;
+		ok = fclose(fp) == 0 && ok;
+		if (!ok)
+		{
+			std::cerr << "Write index file " << file << " failed" << std::endl;
+			// 写入失败时section表的状态不确定, 下一次重新写入整个文件. 已经丢弃的
+			// 条目在上一次写入的范围之前, 没有被修改.
+			for (auto& p : m_pids)
+				p.second.capacity_ = 0;
+			return false;
+		}
+
+		for (auto& p : m_pids)
+			p.second.written_ = p.second.base_ + p.second.entries_.size();
+		trim_entries();
+		return true;
+	}
+
+	bool index_builder::load(const std::string& file)
+	{
+		ts_index index;
+		if (!index.open(file))
+			return false;
+
+		clear();
+		m_packet_size = index.header().packet_size_;
+		m_indexed_bytes = index.header().indexed_bytes_;
+		m_source_size = index.header().source_size_;
+		m_last_pcr = index.header().last_pcr_;
+		for (size_t i = 0; i < index.section_count(); i++)
+		{
+			const index_section& s = index.section(i);
+			auto& state = m_pids[s.pid_];
+			state.stream_type_ = s.stream_type_;
+			if (s.count_ == 0)
+				continue;
+
+			const index_entry& last = index.entries(s)[s.count_ - 1];
+			state.entries_.assign(1, last);
+			state.base_ = s.count_ - 1;
+			state.offset_ = s.offset_;
+			state.capacity_ = std::max(s.capacity_, s.count_);
+			state.written_ = s.count_;
+
+			// 恢复展开回绕的状态.
+			state.resumed_ = true;
+			if (last.pts_ != -1)
+			{
+				state.last_pts_ = last.pts_ & (pts_wrap - 1);
+				state.pts_offset_ = last.pts_ - state.last_pts_;
+			}
+			if (last.dts_ != -1)
+			{
+				state.last_dts_ = last.dts_ & (pts_wrap - 1);
+				state.dts_offset_ = last.dts_ - state.last_dts_;
+			}
+		}
+		m_file = file;
+
+		return true;
+	}
+
+	int64_t index_builder::indexed_bytes() const
+	{
+		return m_indexed_bytes;
+	}
+
+	int index_builder::packet_size() const
+	{
+		return m_packet_size;
+	}
+
+	void index_builder::continue_entries()
+	{
+		for (auto& p : m_pids)
+			p.second.resumed_ = false;
+	}
+
+	void index_builder::clear()
+	{
+		m_pids.clear();
+		m_last_pcr = -1;
+		m_indexed_bytes = 0;
+		m_source_size = 0;
+		m_file.clear();
+	}
+
+	size_t index_builder::entry_count() const
+	{
+		size_t n = 0;
+		for (auto& p : m_pids)
+			n += static_cast<size_t>(p.second.base_ + p.second.entries_.size());
+		return n;
+	}
+
+	index_header index_builder::make_header(size_t section_count) const
+	{
+		index_header h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic_, index_magic, sizeof(h.magic_));
+		h.version_ = index_version;
+		h.header_size_ = sizeof(index_header);
+		h.entry_size_ = sizeof(index_entry);
+		h.packet_size_ = m_packet_size;
+		h.section_count_ = static_cast<uint32_t>(section_count);
+		h.source_size_ = m_source_size;
+		h.indexed_bytes_ = m_indexed_bytes;
+		h.last_pcr_ = m_last_pcr;
+		return h;
+	}
+
+	bool index_builder::write_file(const std::string& file, bool spare)
+	{
+		std::vector<index_section> sections;
+		for (auto& p : m_pids)
+		{
+			uint64_t count = p.second.base_ + p.second.entries_.size();
+			if (count == 0)
+				continue;
+			index_section s;
+			memset(&s, 0, sizeof(s));
+			s.pid_ = p.first;
+			s.stream_type_ = p.second.stream_type_;
+			s.count_ = count;
+			s.capacity_ = spare ? std::max<uint64_t>(count * 2, min_capacity) : 0;
+			sections.push_back(s);
+		}
+		uint64_t offset = sizeof(index_header) + sections.size() * sizeof(index_section);
+		for (auto& s : sections)
+		{
+			s.offset_ = offset;
+			offset += std::max(s.count_, s.capacity_) * sizeof(index_entry);
+		}
+
+		index_header h = make_header(sections.size());
+
+		// 已经丢弃的条目从之前的文件中复制.
+		FILE* old = nullptr;
+		for (auto& p : m_pids)
+		{
+			if (p.second.base_ != 0 && !old)
+			{
+				old = fopen(m_file.c_str(), "rb");
+				if (!old)
+				{
+					std::cerr << "Can't open index file " << m_file << std::endl;
+					return false;
+				}
+			}
+		}
+
+		std::string tmp = file + ".tmp";
+		FILE* fp = fopen(tmp.c_str(), "wb");
+		if (!fp)
+		{
+			std::cerr << "Can't create index file " << tmp << std::endl;
+			if (old)
+				fclose(old);
+			return false;
+		}
+
+		bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+		if (ok && !sections.empty())
+			ok = fwrite(sections.data(), sizeof(index_section), sections.size(), fp) == sections.size();
+		for (auto& s : sections)
+		{
+			const pid_state& state = m_pids.find(s.pid_)->second;
+			if (ok && state.base_ != 0)
+				ok = copy_entries(old, state.offset_, state.base_, fp);
+			if (ok)
+				ok = fwrite(state.entries_.data(), sizeof(index_entry), state.entries_.size(), fp) ==
+					state.entries_.size();
+			if (ok && s.capacity_ > s.count_)
+				ok = copy_entries(nullptr, 0, s.capacity_ - s.count_, fp);
+		}
+		ok = fclose(fp) == 0 && ok;
+		if (old)
+			fclose(old);
+
+#if defined(_WIN32)
+		if (ok)
+			remove(file.c_str());
+#endif
+		if (!ok || rename(tmp.c_str(), file.c_str()) != 0)
+		{
+			std::cerr << "Write index file " << file << " failed" << std::endl;
+			remove(tmp.c_str());
+			return false;
+		}
+
+		for (auto& s : sections)
+		{
+			pid_state& state = m_pids.find(s.pid_)->second;
+			state.offset_ = s.offset_;
+			state.capacity_ = std::max(s.count_, s.capacity_);
+			state.written_ = s.count_;
+		}
+		m_file = file;
+
+		return true;
+	}
+
+	void index_builder::trim_entries()
+	{
+		for (auto& p : m_pids)
+		{
+			auto& entries = p.second.entries_;
+			if (entries.size() <= 1)
+				continue;
+			p.second.base_ += entries.size() - 1;
+			entries.erase(entries.begin(), entries.end() - 1);
+			entries.shrink_to_fit();
+		}
+	}
+
+	int64_t index_builder::unwrap(int64_t ts, int64_t& last, int64_t& offset)
+	{
+		// 比上一个小超过半个范围时认为发生了回绕.
+		if (last != -1)
+		{
+			if (ts < last && last - ts > pts_wrap / 2)
+				offset += pts_wrap;
+			else if (ts > last && ts - last > pts_wrap / 2 && offset >= pts_wrap)
+				offset -= pts_wrap;
+		}
+		last = ts;
+		return ts + offset;
+	}
+
+	ts_index::ts_index()
+		: m_header(nullptr)
+		, m_sections(nullptr)
+	{
+	}
+
+	ts_index::~ts_index()
+	{
+	}
+
+	bool ts_index::open(const std::string& file)
+	{
+		close();
+		if (!m_file.open(file))
+			return false;
+
+		const uint8_t* data = m_file.data();
+		size_t size = m_file.size();
+		const index_header* h = reinterpret_cast<const index_header*>(data);
+		if (size < sizeof(index_header) || memcmp(h->magic_, index_magic, sizeof(h->magic_)) != 0 ||
+			h->version_ != index_version || h->header_size_ != sizeof(index_header) ||
+			h->entry_size_ != sizeof(index_entry) ||
+			(size - sizeof(index_header)) / sizeof(index_section) < h->section_count_)
+		{
+			std::cerr << "Invalid index file " << file << std::endl;
+			close();
+			return false;
+		}
+
+		const index_section* sections = reinterpret_cast<const index_section*>(data + sizeof(index_header));
+		for (uint32_t i = 0; i < h->section_count_; i++)
+		{
+			const index_section& s = sections[i];
+			if (s.offset_ > size || (size - s.offset_) / sizeof(index_entry) < s.count_ ||
+				s.offset_ % sizeof(int64_t) != 0)
+			{
+				std::cerr << "Invalid index file " << file << std::endl;
+				close();
+				return false;
+			}
+		}
+
+		m_file.advise(map_random);
+		m_header = h;
+		m_sections = sections;
+		return true;
+	}
+
+	void ts_index::close()
+	{
+		m_file.close();
+		m_header = nullptr;
+		m_sections = nullptr;
+	}
+
+	bool ts_index::is_open() const
+	{
+		return m_header != nullptr;
+	}
+
+	const index_header& ts_index::header() const
+	{
+		return *m_header;
+	}
+
+	size_t ts_index::section_count() const
+	{
+		return m_header ? m_header->section_count_ : 0;
+	}
+
+	const index_section& ts_index::section(size_t i) const
+	{
+		return m_sections[i];
+	}
+
+	const index_section* ts_index::find_section(uint16_t pid) const
+	{
+		for (size_t i = 0; i < section_count(); i++)
+		{
+			if (m_sections[i].pid_ == pid)
+				return &m_sections[i];
+		}
+		return nullptr;
+	}
+
+	const index_entry* ts_index::entries(const index_section& section) const
+	{
+		return reinterpret_cast<const index_entry*>(m_file.data() + section.offset_);
+	}
+
+	const index_entry* ts_index::seek(uint16_t pid, int64_t time, bool key_only) const
+	{
+		const index_section* s = find_section(pid);
+		if (!s || s->count_ == 0)
+			return nullptr;
+
+		// 解码时间随文件位置单调递增.
+		const index_entry* first = entries(*s);
+		const index_entry* last = first + s->count_;
+		const index_entry* it = std::upper_bound(first, last, time,
+			[](int64_t t, const index_entry& e) { return t < entry_time(e); });
+		if (it == first)
+			return nullptr;
+		--it;
+
+		if (key_only)
+		{
+			while (it != first && !(it->flags_ & index_key))
+				--it;
+			if (!(it->flags_ & index_key))
+				return nullptr;
+		}
+		return it;
+	}
+
+}
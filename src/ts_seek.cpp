@@ -0,0 +1,206 @@
+﻿#include "ts_seek.hpp"
+#include "resync.hpp"
+
+#include <vector>
+
+namespace util {
+
+	enum
+	{
+		seek_lock_count = 3,			// 重新同步时需要确认的连续同步字节数.
+		seek_window = 256 * 1024,		// 范围小于这个大小时顺序解析.
+	};
+
+	enum seek_mode
+	{
+		seek_mode_pts,
+		seek_mode_pcr,
+	};
+
+	// 找到的时间点, time_为用于比较的时间(pts模式下为解码时间).
+	struct seek_point
+	{
+		int64_t pos_;
+		int64_t time_;
+		bool key_;
+	};
+
+	// 从from开始解析到包起始位置不小于to为止, 按顺序记录时间点, 最多max_points个.
+	// 到达to时如果最后一帧的帧类型还没有确定, 继续解析直到确定.
+	static void seek_scan(const mpegts_parser& init, const uint8_t* data, size_t size,
+		size_t from, size_t to, seek_mode mode, uint16_t pid,
+		std::vector<seek_point>& points, size_t max_points, seek_result& result)
+	{
+		mpegts_parser p;
+		p.copy_stream_info(init);
+		size_t packet_size = p.packet_size();
+		size_t prefix = ts_packet_prefix(p.packet_size());
+
+		result.probes_++;
+		points.clear();
+
+		bool resync = true;
+		bool open = false;	// 最后一帧的帧类型还没有确定.
+		size_t pos = from;
+		while (size - pos >= packet_size)
+		{
+			if (resync)
+			{
+				size_t skipped = 0;
+				bool locked = size - pos > prefix && ts_resync(data + pos + prefix,
+					size - pos - prefix, skipped, seek_lock_count, packet_size);
+				if (!locked)
+				{
+					size_t tail = 0;
+					locked = size - pos - skipped > prefix && ts_resync(data + pos + skipped + prefix,
+						size - pos - skipped - prefix, tail, 1, packet_size);
+					skipped = locked ? skipped + tail : size - pos;
+				}
+				pos += skipped;
+				if (!locked)
+					break;
+				resync = false;
+				continue;
+			}
+
+			if (pos >= to && !open)
+				break;
+
+			mpegts_info info;
+			if (!p.do_parser(data + pos, info))
+			{
+				pos += 1;
+				resync = true;
+				continue;
+			}
+
+			if (mode == seek_mode_pcr)
+			{
+				if (info.pcr_ != -1 && pos < to)
+				{
+					seek_point pt = { static_cast<int64_t>(pos), info.pcr_, false };
+					points.push_back(pt);
+					if (points.size() >= max_points)
+						break;
+				}
+			}
+			else if (info.pid_ == pid && info.is_video_)
+			{
+				if (info.start_)
+				{
+					if (pos >= to)
+						break;
+					open = false;
+					if (info.pts_ != -1 || info.dts_ != -1)
+					{
+						if (points.size() >= max_points)
+							break;
+						seek_point pt = { static_cast<int64_t>(pos), info.dts_ != -1 ? info.dts_ : info.pts_, false };
+						points.push_back(pt);
+						open = true;
+					}
+				}
+				if (open)
+				{
+					if (info.type_ == mpegts_info::idr)
+						points.back().key_ = true;
+					if (info.pict_type_ != av_picture_type_none || info.type_ == mpegts_info::idr)
+						open = false;
+				}
+			}
+
+			pos += packet_size;
+		}
+	}
+
+	static bool seek_impl(const mpegts_parser& parser, const uint8_t* data, size_t size,
+		uint16_t pid, int64_t target, seek_mode mode, bool key_only, seek_result& result)
+	{
+		// pcr_为毫秒, 回绕周期为2^33/90毫秒.
+		const int64_t wrap = mode == seek_mode_pcr ? (int64_t(1) << 33) / 90 : int64_t(1) << 33;
+		std::vector<seek_point> points;
+
+		result = seek_result();
+		seek_scan(parser, data, size, 0, size, mode, pid, points, 1, result);
+		if (points.empty())
+			return false;
+
+		// 相对第一个时间戳展开回绕.
+		int64_t t0 = points[0].time_;
+		auto unwrap = [&](int64_t t) { return t0 + ((t - t0) % wrap + wrap) % wrap; };
+		int64_t goal = unwrap(target);
+		if (goal - t0 > wrap / 2)
+			return false;	// 目标在第一个时间戳之前.
+
+		size_t lo = static_cast<size_t>(points[0].pos_);
+		size_t hi = size;
+		int64_t t_lo = t0;
+		while (hi - lo > seek_window)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			seek_scan(parser, data, size, mid, hi, mode, pid, points, 1, result);
+			if (points.empty())
+			{
+				hi = mid;
+				continue;
+			}
+
+			int64_t t = unwrap(points[0].time_);
+			if (t >= t_lo && t <= goal)
+			{
+				lo = static_cast<size_t>(points[0].pos_);
+				t_lo = t;
+			}
+			else
+			{
+				// 时间超过目标, 或发生了回退.
+				hi = mid;
+			}
+		}
+
+		// 在剩余范围中顺序查找, 关键帧在范围之前时向前逐步扩大范围.
+		size_t end = hi;
+		size_t from = lo;
+		size_t step = seek_window;
+		while (true)
+		{
+			seek_scan(parser, data, size, from, end, mode, pid, points, static_cast<size_t>(-1), result);
+			const seek_point* found = nullptr;
+			int64_t last = t_lo;
+			for (auto& pt : points)
+			{
+				int64_t t = unwrap(pt.time_);
+				if (from >= lo && (t < last || t > goal))
+					break;
+				last = t;
+				if (!key_only || pt.key_)
+					found = &pt;
+			}
+			if (found)
+			{
+				result.pos_ = found->pos_;
+				result.time_ = found->time_;
+				return true;
+			}
+			if (!key_only || from == 0)
+				return false;
+
+			end = from;
+			from = from > step ? from - step : 0;
+			step *= 2;
+		}
+	}
+
+	bool seek_to_pts(const mpegts_parser& parser, const uint8_t* data, size_t size,
+		uint16_t pid, int64_t pts, bool key_only, seek_result& result)
+	{
+		return seek_impl(parser, data, size, pid, pts, seek_mode_pts, key_only, result);
+	}
+
+	bool seek_to_pcr(const mpegts_parser& parser, const uint8_t* data, size_t size,
+		int64_t pcr, seek_result& result)
+	{
+		return seek_impl(parser, data, size, 0, pcr, seek_mode_pcr, false, result);
+	}
+
+}
@@ -0,0 +1,353 @@
+﻿#include "udp_source.hpp"
+
+#include <iostream>
+#include <cstring>
+
+#if !defined(_WIN32)
+#	include <sys/types.h>
+#	include <sys/socket.h>
+#	include <sys/uio.h>
+#	include <sys/time.h>
+#	include <netinet/in.h>
+#	include <arpa/inet.h>
+#	include <poll.h>
+#	include <unistd.h>
+#	include <errno.h>
+#endif
+
+namespace util {
+
+	enum
+	{
+		rtp_header_size = 12,
+		rtp_version = 2,
+		control_size = 64,					// 每个数据报的cmsg缓冲, 只需要容纳时间戳.
+		receive_buffer = 8 * 1024 * 1024,	// 尽量大的socket接收缓冲, 避免处理不及时丢包.
+	};
+
+	udp_source::udp_source(size_t batch, size_t slab_size)
+		: m_fd(-1)
+		, m_port(0)
+		, m_batch(batch ? batch : 1)
+		, m_slab_size(slab_size)
+		, m_count(0)
+		, m_last_seq(-1)
+		, m_received(0)
+		, m_rtp_lost(0)
+		, m_rtp_reordered(0)
+		, m_truncated(0)
+	{
+		m_slabs.resize(m_batch * m_slab_size);
+		m_control.resize(m_batch * control_size);
+		m_datagrams.resize(m_batch);
+
+#if !defined(_WIN32)
+		// 缓冲和cmsg空间一次分配, 每次接收只需要恢复被内核修改的长度.
+#	if defined(__linux__)
+		m_headers.resize(m_batch * sizeof(mmsghdr));
+		mmsghdr* headers = reinterpret_cast<mmsghdr*>(m_headers.data());
+#	else
+		m_headers.resize(m_batch * sizeof(msghdr));
+#	endif
+		m_iovecs.resize(m_batch * sizeof(iovec));
+		iovec* iov = reinterpret_cast<iovec*>(m_iovecs.data());
+		for (size_t i = 0; i < m_batch; i++)
+		{
+			iov[i].iov_base = m_slabs.data() + i * m_slab_size;
+			iov[i].iov_len = m_slab_size;
+#	if defined(__linux__)
+			msghdr& msg = headers[i].msg_hdr;
+#	else
+			msghdr& msg = reinterpret_cast<msghdr*>(m_headers.data())[i];
+#	endif
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov[i];
+			msg.msg_iovlen = 1;
+			msg.msg_control = m_control.data() + i * control_size;
+			msg.msg_controllen = control_size;
+		}
+#endif
+	}
+
+	udp_source::~udp_source()
+	{
+		close();
+	}
+
+#if defined(_WIN32)
+
+	bool udp_source::open(const std::string&, uint16_t, const std::string&)
+	{
+		std::cerr << "udp_source: not supported on this platform" << std::endl;
+		return false;
+	}
+
+	void udp_source::close()
+	{
+	}
+
+	int udp_source::receive(int)
+	{
+		return -1;
+	}
+
+#else
+
+	bool udp_source::open(const std::string& address, uint16_t port, const std::string& interface)
+	{
+		close();
+
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		if (!address.empty() && inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+		{
+			std::cerr << "udp_source: invalid address " << address << std::endl;
+			return false;
+		}
+		bool multicast = IN_MULTICAST(ntohl(addr.sin_addr.s_addr));
+
+		m_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (m_fd < 0)
+		{
+			std::cerr << "udp_source: socket failed, " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		// 多个进程可以同时接收同一个组播.
+		int on = 1;
+		setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		int size = receive_buffer;
+		setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+#if defined(SO_TIMESTAMPNS)
+		setsockopt(m_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+#elif defined(SO_TIMESTAMP)
+		setsockopt(m_fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+#endif
+
+		if (bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+		{
+			std::cerr << "udp_source: bind " << address << ":" << port << " failed, " << strerror(errno) << std::endl;
+			close();
+			return false;
+		}
+
+		if (multicast)
+		{
+			ip_mreq mreq;
+			memset(&mreq, 0, sizeof(mreq));
+			mreq.imr_multiaddr = addr.sin_addr;
+			mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+			if (!interface.empty() && inet_pton(AF_INET, interface.c_str(), &mreq.imr_interface) != 1)
+			{
+				std::cerr << "udp_source: invalid interface " << interface << std::endl;
+				close();
+				return false;
+			}
+			if (setsockopt(m_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0)
+			{
+				std::cerr << "udp_source: join " << address << " failed, " << strerror(errno) << std::endl;
+				close();
+				return false;
+			}
+		}
+
+		socklen_t len = sizeof(addr);
+		if (getsockname(m_fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0)
+			m_port = ntohs(addr.sin_port);
+		m_last_seq = -1;
+		return true;
+	}
+
+	void udp_source::close()
+	{
+		if (m_fd >= 0)
+			::close(m_fd);
+		m_fd = -1;
+		m_count = 0;
+	}
+
+	static int64_t arrival_time(msghdr& msg)
+	{
+		for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+		{
+			if (c->cmsg_level != SOL_SOCKET)
+				continue;
+#if defined(SCM_TIMESTAMPNS)
+			if (c->cmsg_type == SCM_TIMESTAMPNS)
+			{
+				timespec ts;
+				memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+				return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+			}
+#endif
+#if defined(SCM_TIMESTAMP)
+			if (c->cmsg_type == SCM_TIMESTAMP)
+			{
+				timeval tv;
+				memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+				return static_cast<int64_t>(tv.tv_sec) * 1000000000 + tv.tv_usec * 1000;
+			}
+#endif
+		}
+		return -1;
+	}
+
+	int udp_source::receive(int timeout)
+	{
+		m_count = 0;
+		if (m_fd < 0)
+			return -1;
+
+		pollfd pfd = { m_fd, POLLIN, 0 };
+		int r = poll(&pfd, 1, timeout);
+		if (r < 0)
+			return errno == EINTR ? 0 : -1;
+		if (r == 0)
+			return 0;
+
+#if defined(__linux__)
+		// 一次系统调用取出所有已到达的数据报, 最多m_batch个.
+		mmsghdr* headers = reinterpret_cast<mmsghdr*>(m_headers.data());
+		for (size_t i = 0; i < m_batch; i++)
+			headers[i].msg_hdr.msg_controllen = control_size;
+		int n = recvmmsg(m_fd, headers, static_cast<unsigned>(m_batch), MSG_DONTWAIT, nullptr);
+		if (n < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+#else
+		msghdr* headers = reinterpret_cast<msghdr*>(m_headers.data());
+		std::vector<size_t> lengths(m_batch);
+		int n = 0;
+		for (; n < static_cast<int>(m_batch); n++)
+		{
+			headers[n].msg_controllen = control_size;
+			ssize_t len = recvmsg(m_fd, &headers[n], MSG_DONTWAIT);
+			if (len < 0)
+				break;
+			lengths[n] = static_cast<size_t>(len);
+		}
+		if (n == 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+#endif
+
+		for (int i = 0; i < n; i++)
+		{
+#if defined(__linux__)
+			msghdr& msg = headers[i].msg_hdr;
+			size_t len = headers[i].msg_len;
+#else
+			msghdr& msg = headers[i];
+			size_t len = lengths[i];
+#endif
+			m_received++;
+			if (msg.msg_flags & MSG_TRUNC)
+			{
+				m_truncated++;
+				continue;
+			}
+
+			udp_datagram& d = m_datagrams[m_count];
+			d.data_ = m_slabs.data() + i * m_slab_size;
+			d.size_ = len;
+			d.arrival_time_ = arrival_time(msg);
+			d.rtp_seq_ = -1;
+			d.rtp_timestamp_ = 0;
+			d.lost_ = 0;
+			if (strip_rtp(d))
+				m_count++;
+		}
+
+		return static_cast<int>(m_count);
+	}
+
+#endif
+
+	bool udp_source::strip_rtp(udp_datagram& d)
+	{
+		const uint8_t* p = d.data_;
+		size_t size = d.size_;
+
+		// 裸ts以同步字节开始, 否则按RTP(版本2)处理.
+		if (size == 0 || p[0] == 0x47)
+			return size != 0;
+		if ((p[0] >> 6) != rtp_version || size < rtp_header_size)
+			return false;
+
+		size_t header = rtp_header_size + (p[0] & 0x0f) * 4;
+		if (p[0] & 0x10)
+		{
+			// 扩展头不完整时无法确定负载的开始位置.
+			if (header + 4 > size)
+				return false;
+			header += 4 + ((p[header + 2] << 8) | p[header + 3]) * 4;
+		}
+		size_t padding = (p[0] & 0x20) ? p[size - 1] : 0;
+		if (header + padding > size)
+			return false;
+
+		int32_t seq = (p[2] << 8) | p[3];
+		d.rtp_seq_ = seq;
+		d.rtp_timestamp_ = (static_cast<uint32_t>(p[4]) << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+		d.data_ = p + header;
+		d.size_ = size - header - padding;
+
+		// 序号向前跳过的部分为丢失的包, 向后的为迟到或重复的包. 迟到的包已经
+		// 计入丢包, 按原顺序输出会打乱ts流, 与重复的包一样丢弃.
+		if (m_last_seq >= 0)
+		{
+			int diff = (seq - m_last_seq) & 0xffff;
+			if (diff == 0 || diff >= 0x8000)
+			{
+				m_rtp_reordered++;
+				return false;
+			}
+			d.lost_ = diff - 1;
+			m_rtp_lost += diff - 1;
+		}
+		m_last_seq = seq;
+		return true;
+	}
+
+	bool udp_source::is_open() const
+	{
+		return m_fd >= 0;
+	}
+
+	uint16_t udp_source::port() const
+	{
+		return m_port;
+	}
+
+	const udp_datagram* udp_source::datagrams() const
+	{
+		return m_datagrams.data();
+	}
+
+	size_t udp_source::count() const
+	{
+		return m_count;
+	}
+
+	int64_t udp_source::received() const
+	{
+		return m_received;
+	}
+
+	int64_t udp_source::rtp_lost() const
+	{
+		return m_rtp_lost;
+	}
+
+	int64_t udp_source::rtp_reordered() const
+	{
+		return m_rtp_reordered;
+	}
+
+	int64_t udp_source::truncated() const
+	{
+		return m_truncated;
+	}
+
+}